@@ -228,7 +228,7 @@ echo "[+] toastOS++ VM Prep finished... can run in VM"
 echo "[*] Launching toastOS++ in QEMU..."
 qemu-system-i386 \
   -kernel kernel \
-  -m 8M \
+  -m 64M \
   -serial stdio \
   -d int \
     -drive file=toastos.img,format=raw,if=ide \
@@ -0,0 +1,190 @@
+/*
+ * toastOS++ Async Tasks
+ * Namespace: toast::async
+ */
+
+#include "async.hpp"
+#include "kio.hpp"
+
+namespace {
+    workqueue_t* async_wq = nullptr;
+
+    /* Take t off the event it last listened on. Always through the
+       event's lock, so a signal() that already took t off the list is
+       done with it by the time this returns. */
+    void unlisten(async_task_t* t) {
+        async_event_t* e = t->event;
+        if (!e) return;
+        uint32_t flags = toast::spin::lock_irqsave(&e->lock);
+        if (t->listed) {
+            async_task_t** p = &e->waiters;
+            while (*p && *p != t)
+                p = &(*p)->event_next;
+            if (*p) *p = t->event_next;
+            t->listed = 0;
+        }
+        t->event = nullptr;
+        t->event_next = nullptr;
+        toast::spin::unlock_irqrestore(&e->lock, flags);
+    }
+
+    /* The same for the future t last polled */
+    void unpoll(async_task_t* t) {
+        async_future_t* f = t->future;
+        if (!f) return;
+        uint32_t flags = toast::spin::lock_irqsave(&f->lock);
+        if (f->waiter == t) f->waiter = nullptr;
+        t->future = nullptr;
+        toast::spin::unlock_irqrestore(&f->lock, flags);
+    }
+
+    /* Work function: one step of the task */
+    void run_step(void* arg) {
+        async_task_t* t = static_cast<async_task_t*>(arg);
+        if (t->done) return;
+        if (t->step(t) == ASYNC_PENDING) return;
+
+        /* From here wake() leaves t alone; then wait out anything that
+           got hold of it before, so whoever owns t may free it */
+        uint32_t flags = toast::spin::lock_irqsave(&t->lock);
+        t->done = 1;
+        toast::spin::unlock_irqrestore(&t->lock, flags);
+        toast::time::timer::del_sync(&t->timer);
+        unlisten(t);
+        unpoll(t);
+        toast::work::cancel(&t->work);
+
+        if (t->joiner) toast::async::wake(t->joiner);
+        toast::thread::sem::post(&t->finished);
+    }
+
+    void timer_wake(void* arg) {
+        toast::async::wake(static_cast<async_task_t*>(arg));
+    }
+}
+
+namespace toast {
+namespace async {
+
+void init() {
+    if (!async_wq)
+        async_wq = toast::work::create("kasync", WORK_PRIO_SYSTEM);
+    if (!async_wq)
+        kprint("async: could not start kasync");
+}
+
+int start(async_task_t* t, async_step_t step) {
+    if (!async_wq) return -1;
+    t->step = step;
+    t->resume = 0;
+    t->result = 0;
+    toast::spin::init(&t->lock);
+    t->event = nullptr;
+    t->event_next = nullptr;
+    t->listed = 0;
+    t->future = nullptr;
+    t->joiner = nullptr;
+    t->done = 0;
+    toast::thread::sem::init(&t->finished, 0);
+    toast::work::setup(&t->work, run_step, t);
+    toast::time::timer::setup(&t->timer, timer_wake, t);
+    toast::work::queue_on(async_wq, &t->work);
+    return 0;
+}
+
+/* Both tasks run on kasync, so t cannot finish between the two lines */
+bool poll(async_task_t* t, async_task_t* waiter) {
+    if (t->done) return true;
+    t->joiner = waiter;
+    return false;
+}
+
+int join(async_task_t* t) {
+    toast::thread::sem::wait(&t->finished);
+    /* The worker may still be on its way out of run_step() */
+    toast::work::cancel(&t->work);
+    return t->result;
+}
+
+int run(async_task_t* t, async_step_t step) {
+    if (start(t, step) < 0) return -1;
+    return join(t);
+}
+
+void wake(async_task_t* t) {
+    uint32_t flags = spin::lock_irqsave(&t->lock);
+    if (!t->done)
+        toast::work::queue_on(async_wq, &t->work);
+    spin::unlock_irqrestore(&t->lock, flags);
+}
+
+void wake_at(async_task_t* t, uint32_t deadline) {
+    toast::time::timer::add_at(&t->timer, deadline);
+}
+
+void future_init(async_future_t* f) {
+    toast::spin::init(&f->lock);
+    f->ready = 0;
+    f->value = 0;
+    f->waiter = nullptr;
+}
+
+/* The waiter is woken under f->lock, which unpoll() takes before t can
+   be freed; t->lock nests inside */
+void complete(async_future_t* f, int value) {
+    uint32_t flags = spin::lock_irqsave(&f->lock);
+    f->value = value;
+    f->ready = 1;
+    async_task_t* w = f->waiter;
+    f->waiter = nullptr;
+    if (w) wake(w);
+    spin::unlock_irqrestore(&f->lock, flags);
+}
+
+bool poll(async_future_t* f, async_task_t* t) {
+    if (t->future != f) unpoll(t);
+    uint32_t flags = spin::lock_irqsave(&f->lock);
+    bool ready = f->ready;
+    if (!ready) {
+        f->waiter = t;
+        t->future = f;
+    }
+    spin::unlock_irqrestore(&f->lock, flags);
+    return ready;
+}
+
+void event_init(async_event_t* e) {
+    toast::spin::init(&e->lock);
+    e->waiters = nullptr;
+}
+
+void listen(async_event_t* e, async_task_t* t) {
+    if (t->event != e) unlisten(t);
+    uint32_t flags = spin::lock_irqsave(&e->lock);
+    if (!t->listed) {
+        t->event = e;
+        t->event_next = e->waiters;
+        e->waiters = t;
+        t->listed = 1;
+    }
+    spin::unlock_irqrestore(&e->lock, flags);
+}
+
+void signal(async_event_t* e) {
+    uint32_t flags = spin::lock_irqsave(&e->lock);
+    async_task_t* t = e->waiters;
+    e->waiters = nullptr;
+    while (t) {
+        async_task_t* next = t->event_next;
+        t->event_next = nullptr;
+        t->listed = 0;
+        /* t->lock and wq_lock nest inside; nothing takes an event lock
+           under them */
+        wake(t);
+        t = next;
+    }
+    spin::unlock_irqrestore(&e->lock, flags);
+}
+
+} // namespace async
+} // namespace toast
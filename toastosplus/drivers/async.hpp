@@ -0,0 +1,147 @@
+/*
+ * toastOS++ Async Tasks
+ * Namespace: toast::async
+ */
+
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+#include "stdint.hpp"
+#include "time.hpp"
+#include "thread.hpp"
+#include "workqueue.hpp"
+#include "spinlock.hpp"
+
+/*
+ * Stackless tasks for drivers that spend their time waiting. A task is a
+ * step function that runs until it would block, notes where it got to
+ * and returns; whatever it waits on (a future, an event, its timer)
+ * queues it to run again. All tasks share the "kasync" worker, so many
+ * outstanding requests cost a small struct each rather than a stack.
+ *
+ * Locals do not survive an await. Keep state in the task, usually by
+ * making it the first member of a bigger struct.
+ */
+struct async_task_t;
+struct async_event_t;
+struct async_future_t;
+
+typedef int (*async_step_t)(async_task_t*);
+
+#define ASYNC_PENDING 0
+#define ASYNC_DONE    1
+
+struct async_task_t {
+    async_step_t      step;
+    uint32_t          resume;       /* where step() carries on, 0 at first */
+    int               result;
+    spinlock_t        lock;         /* done, against wake() */
+    work_t            work;         /* queued on kasync to run step() */
+    ktimer_t          timer;        /* sleeps and timeouts */
+    async_event_t    *event;        /* event we last listened on, if any */
+    async_task_t     *event_next;
+    uint32_t          listed;       /* still on event's list */
+    async_future_t   *future;       /* future we last polled, if any */
+    async_task_t     *joiner;       /* task to wake when done, see poll() */
+    volatile uint32_t done;
+    semaphore_t       finished;     /* posted once t is off everything above */
+};
+
+/* A value that arrives once; complete() is safe from IRQ handlers */
+struct async_future_t {
+    spinlock_t        lock;
+    volatile uint32_t ready;
+    int               value;
+    async_task_t     *waiter;
+};
+
+/* Wakes every task listening each time it is signalled */
+struct async_event_t {
+    spinlock_t    lock;
+    async_task_t *waiters;
+};
+
+#define ASYNC_FUTURE_INIT { SPINLOCK_INIT, 0, 0, nullptr }
+#define ASYNC_EVENT_INIT  { SPINLOCK_INIT, nullptr }
+
+/*
+ * Step function layout:
+ *
+ *     ASYNC_BEGIN(t);
+ *     ...
+ *     ASYNC_AWAIT(t, cond);
+ *     ...
+ *     ASYNC_END(t);
+ *
+ * The awaits expand to case labels of one switch, so there can be only
+ * one per source line and none inside a nested switch.
+ */
+#define ASYNC_BEGIN(t)  switch ((t)->resume) { case 0:
+#define ASYNC_END(t)    } return ASYNC_DONE
+
+#define ASYNC_RETURN(t, r) \
+    do { (t)->result = (r); return ASYNC_DONE; } while (0)
+
+/* Return to the worker until cond holds. cond is evaluated again every
+   time the task is woken; something must be set up to wake it. */
+#define ASYNC_AWAIT(t, cond) \
+    do { (t)->resume = __LINE__; case __LINE__: if (!(cond)) return ASYNC_PENDING; } while (0)
+
+#define ASYNC_AWAIT_FUTURE(t, f) \
+    ASYNC_AWAIT(t, toast::async::poll(f, t))
+
+/* Wait for a task started with start(); its result is in child->result */
+#define ASYNC_AWAIT_TASK(t, child) \
+    ASYNC_AWAIT(t, toast::async::poll(child, t))
+
+/* Listen before testing, so a signal in between is not lost */
+#define ASYNC_AWAIT_EVENT(t, e, cond) \
+    ASYNC_AWAIT(t, (toast::async::listen(e, t), (cond)))
+
+#define ASYNC_SLEEP(t, ms) \
+    do { toast::async::wake_at(t, toast::time::ms() + (ms)); \
+         ASYNC_AWAIT(t, !toast::time::timer::pending(&(t)->timer)); } while (0)
+
+namespace toast {
+namespace async {
+
+/* Start the kasync worker; needs workqueues */
+void init();
+
+/* Run step from the beginning on kasync and return at once. -1 if there
+   is no worker. */
+int start(async_task_t* t, async_step_t step);
+
+/* True once t is done; otherwise waiter is woken when it is. For tasks
+   waiting on tasks, which share the worker: a thread uses join(). The
+   waiter must see t through rather than finish while t still runs. */
+bool poll(async_task_t* t, async_task_t* waiter);
+
+/* Block the calling thread until t is done and return its result.
+   Never from a task: it would wait on its own worker. */
+int join(async_task_t* t);
+
+/* start() and join(); the task may live on the caller's stack, since
+   join() only returns once nothing can reach it any more */
+int run(async_task_t* t, async_step_t step);
+
+/* Run t's step again soon; safe from IRQ handlers */
+void wake(async_task_t* t);
+
+/* Wake t at deadline (ms() time), replacing any earlier wake_at() */
+void wake_at(async_task_t* t, uint32_t deadline);
+
+void future_init(async_future_t* f);
+void complete(async_future_t* f, int value);
+
+/* True once f is complete; otherwise t is woken when it is */
+bool poll(async_future_t* f, async_task_t* t);
+
+void event_init(async_event_t* e);
+void listen(async_event_t* e, async_task_t* t);
+void signal(async_event_t* e);     /* safe from IRQ handlers */
+
+} // namespace async
+} // namespace toast
+
+#endif /* ASYNC_HPP */
@@ -6,6 +6,13 @@
 #include "ata.hpp"
 #include "kio.hpp"
 #include "funcs.hpp"
+#include "panic.hpp"
+#include "thread.hpp"
+#include "paging.hpp"
+#include "toast_libc.hpp"
+
+/* How long a sector may take before we give up on the drive */
+#define ATA_TIMEOUT_MS 5000
 
 namespace toast {
 namespace disk {
@@ -22,6 +29,37 @@ inline uint16_t inw(uint16_t port) {
     return ret;
 }
 
+/* A run of words through the data port in one instruction */
+inline void insw(uint16_t port, uint16_t* buf, uint32_t words) {
+    __asm__ volatile ("rep insw" : "+D"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+inline void outsw(uint16_t port, const uint16_t* buf, uint32_t words) {
+    __asm__ volatile ("rep outsw" : "+S"(buf), "+c"(words) : "d"(port) : "memory");
+}
+
+inline void outl(uint16_t port, uint32_t val) {
+    __asm__ volatile ("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+uint32_t pci_read(uint8_t bus, uint8_t device, uint8_t func, uint8_t reg) {
+    outl(0xCF8, (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)device << 11) |
+                ((uint32_t)func << 8) | (reg & 0xFC));
+    return inl(0xCFC);
+}
+
+void pci_write(uint8_t bus, uint8_t device, uint8_t func, uint8_t reg, uint32_t val) {
+    outl(0xCF8, (1u << 31) | ((uint32_t)bus << 16) | ((uint32_t)device << 11) |
+                ((uint32_t)func << 8) | (reg & 0xFC));
+    outl(0xCFC, val);
+}
+
 int wait_bsy() {
     int timeout = 100000;
     while ((inb(ATA_PRIMARY_STATUS) & ATA_SR_BSY) && timeout > 0) {
@@ -49,10 +87,259 @@ void delay() {
     inb(ATA_PRIMARY_CTRL);
 }
 
+/* IRQ14 posts irq_done once per interrupt, with the status it read */
+semaphore_t irq_done = SEMAPHORE_INIT(0);
+volatile uint8_t irq_status = 0;
+int irq_live = 0;
+
+/* One command on the channel at a time */
+mutex_t chan_lock = MUTEX_INIT;
+
+/* Last IDENTIFY of the master drive */
+uint16_t ident[256];
+int lba48 = 0;              /* the EXT commands work */
+uint32_t multi_count = 1;   /* sectors per interrupt for READ/WRITE MULTIPLE */
+
+/* Bus-master DMA, when the controller and the drive both do it */
+uint16_t bm_base = 0;
+prd_t* prd_table = nullptr;
+uint32_t prd_phys = 0;
+uint8_t* dma_buf = nullptr;
+uint32_t dma_phys = 0;
+int dma_ready = 0;
+
+/* Reading the status register is what lowers INTRQ */
+void irq_handler() {
+    irq_status = inb(ATA_PRIMARY_STATUS);
+    toast::thread::sem::post(&irq_done);
+}
+
+/*
+ * Owns the channel for one command. With IRQ14 installed and interrupts
+ * on, the caller sleeps on the interrupt for every sector; otherwise
+ * (early boot, or called with interrupts off) it polls as before.
+ */
+struct channel {
+    bool sleep;
+    channel() {
+        uint32_t flags = irq_save();
+        irq_restore(flags);
+        sleep = irq_live && (flags & 0x200);
+        if (sleep) toast::thread::mutex::lock(&chan_lock);
+        /* Forget interrupts no one waited for, e.g. from IDENTIFY */
+        while (toast::thread::sem::trywait(&irq_done) == 0)
+            ;
+    }
+    ~channel() {
+        if (sleep) toast::thread::mutex::unlock(&chan_lock);
+    }
+
+    /* The drive is done with a block: data ready when drq, else the
+       command finished */
+    int wait(bool drq) {
+        if (!sleep) {
+            if (wait_bsy() < 0) return -1;
+            return drq ? wait_drq() : 0;
+        }
+        if (toast::thread::sem::timedwait(&irq_done, ATA_TIMEOUT_MS) < 0)
+            return -1;
+        uint8_t status = irq_status;
+        if (status & ATA_SR_ERR) return -1;
+        if (drq && !(status & ATA_SR_DRQ)) return -1;
+        return 0;
+    }
+};
+
+/* Select the master and load a command for sector_count sectors (up to
+   ATA_MAX_SECTORS_28/48; the maximum goes out as 0). The EXT commands
+   take the high bytes of the count and LBA first. */
+void send_command(uint32_t lba, uint32_t sector_count, uint8_t cmd, bool ext) {
+    if (ext) {
+        outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER);
+        delay();
+        
+        outb(ATA_PRIMARY_SECCOUNT, static_cast<uint8_t>((sector_count >> 8) & 0xFF));
+        outb(ATA_PRIMARY_LBA_LO, static_cast<uint8_t>((lba >> 24) & 0xFF));
+        outb(ATA_PRIMARY_LBA_MID, 0);
+        outb(ATA_PRIMARY_LBA_HI, 0);
+    } else {
+        outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER | ((lba >> 24) & 0x0F));
+        delay();
+    }
+    
+    outb(ATA_PRIMARY_SECCOUNT, static_cast<uint8_t>(sector_count & 0xFF));
+    outb(ATA_PRIMARY_LBA_LO, static_cast<uint8_t>(lba & 0xFF));
+    outb(ATA_PRIMARY_LBA_MID, static_cast<uint8_t>((lba >> 8) & 0xFF));
+    outb(ATA_PRIMARY_LBA_HI, static_cast<uint8_t>((lba >> 16) & 0xFF));
+    
+    outb(ATA_PRIMARY_COMMAND, cmd);
+}
+
+/* Most sectors one command may move */
+uint32_t max_per_command() {
+    if (dma_ready) return ATA_DMA_BUF_SIZE / ATA_SECTOR_SIZE;
+    return lba48 ? ATA_MAX_SECTORS_48 : ATA_MAX_SECTORS_28;
+}
+
+/* Put the drive in multiple mode with the largest block it offers; stay
+   on one sector per interrupt if it refuses */
+void set_multiple() {
+    multi_count = 1;
+    uint32_t max = ident[47] & 0xFF;
+    if (max < 2) return;
+    
+    outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER);
+    delay();
+    outb(ATA_PRIMARY_SECCOUNT, static_cast<uint8_t>(max));
+    outb(ATA_PRIMARY_COMMAND, ATA_CMD_SET_MULTIPLE);
+    delay();
+    if (wait_bsy() < 0 || (inb(ATA_PRIMARY_STATUS) & ATA_SR_ERR)) return;
+    multi_count = max;
+}
+
+/* Find the IDE controller's bus-master block and give it a PRD table and
+   a bounce buffer, both physically contiguous. Leaves bm_base at 0 (PIO
+   only) if anything is missing. */
+void dma_setup() {
+    for (uint8_t dev = 0; dev < 32 && !bm_base; dev++) {
+        for (uint8_t func = 0; func < 8; func++) {
+            uint32_t id = pci_read(0, dev, func, 0x00);
+            if ((id & 0xFFFF) == 0xFFFF) {
+                if (func == 0) break;
+                continue;
+            }
+            uint32_t cls = pci_read(0, dev, func, 0x08);
+            if ((cls >> 24) != ATA_PCI_CLASS || ((cls >> 16) & 0xFF) != ATA_PCI_SUBCLASS)
+                continue;
+
+            uint32_t bar4 = pci_read(0, dev, func, ATA_PCI_BAR4);
+            if (!(bar4 & 1) || !(bar4 & 0xFFFC))
+                continue;   /* no I/O-space bus-master block */
+
+            /* I/O decoding and bus mastering on */
+            uint32_t cmd = pci_read(0, dev, func, 0x04);
+            pci_write(0, dev, func, 0x04, cmd | 0x05);
+            bm_base = (uint16_t)(bar4 & 0xFFFC);
+            break;
+        }
+    }
+    if (!bm_base) return;
+
+    prd_phys = frame_alloc_contig(0);
+    dma_phys = frame_alloc_contig(ATA_DMA_ORDER);
+    if (prd_phys) prd_table = static_cast<prd_t*>(vmap(prd_phys, PAGE_SIZE, 0));
+    if (dma_phys) dma_buf = static_cast<uint8_t*>(vmap(dma_phys, ATA_DMA_BUF_SIZE, 0));
+    if (!prd_table || !dma_buf) {
+        if (prd_table) vfree(prd_table);
+        if (dma_buf) vfree(dma_buf);
+        if (prd_phys) frame_free_contig(prd_phys, 0);
+        if (dma_phys) frame_free_contig(dma_phys, ATA_DMA_ORDER);
+        prd_table = nullptr;
+        dma_buf = nullptr;
+        bm_base = 0;
+    }
+}
+
+/* Move sector_count sectors in one bus-master transaction through the
+   bounce buffer: into in, or out of out */
+int dma_transfer(channel& ch, uint32_t lba, uint32_t sector_count, void* in, const void* out) {
+    bool write = out != nullptr;
+    uint32_t bytes = sector_count * ATA_SECTOR_SIZE;
+    if (write)
+        memcpy(dma_buf, out, bytes);
+
+    /* 64KB halves of the buffer; a 0 count is a full 64KB */
+    int n = 0;
+    for (uint32_t off = 0; off < bytes; off += 0x10000, n++) {
+        uint32_t len = bytes - off < 0x10000 ? bytes - off : 0x10000;
+        prd_table[n].phys = dma_phys + off;
+        prd_table[n].bytes = static_cast<uint16_t>(len);
+        prd_table[n].flags = 0;
+    }
+    prd_table[n - 1].flags = PRD_EOT;
+
+    if (wait_bsy() < 0) return -1;
+    outl(bm_base + BM_PRDT, prd_phys);
+    outb(bm_base + BM_COMMAND, write ? 0 : BM_CMD_READ);
+    outb(bm_base + BM_STATUS, inb(bm_base + BM_STATUS) | BM_SR_ERR | BM_SR_IRQ);
+
+    if (lba48)
+        send_command(lba, sector_count, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT, true);
+    else
+        send_command(lba, sector_count, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA, false);
+    outb(bm_base + BM_COMMAND, inb(bm_base + BM_COMMAND) | BM_CMD_START);
+
+    /* One interrupt when the whole transfer is done */
+    int r = ch.wait(false);
+
+    outb(bm_base + BM_COMMAND, inb(bm_base + BM_COMMAND) & ~BM_CMD_START);
+    uint8_t bm = inb(bm_base + BM_STATUS);
+    outb(bm_base + BM_STATUS, bm | BM_SR_ERR | BM_SR_IRQ);
+    if (r < 0 || (bm & BM_SR_ERR) || (inb(ATA_PRIMARY_STATUS) & ATA_SR_ERR))
+        return -1;
+
+    if (!write)
+        memcpy(in, dma_buf, bytes);
+    return 0;
+}
+
+/* Programmed I/O. With multiple mode the drive interrupts once per
+   block of multi_count sectors instead of once per sector. */
+uint8_t pio_command(bool write) {
+    if (multi_count > 1) {
+        if (lba48) return write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+        return write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+    }
+    if (lba48) return write ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_READ_SECTORS_EXT;
+    return write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS;
+}
+
+int pio_read(channel& ch, uint32_t lba, uint32_t sector_count, uint16_t* buf) {
+    if (wait_bsy() < 0) return -1;
+    
+    send_command(lba, sector_count, pio_command(false), lba48);
+    
+    /* One interrupt per block, once its data is waiting */
+    for (uint32_t s = 0; s < sector_count; ) {
+        if (ch.wait(true) < 0) return -1;
+        
+        uint32_t n = sector_count - s < multi_count ? sector_count - s : multi_count;
+        insw(ATA_PRIMARY_DATA, buf + s * 256, n * 256);
+        s += n;
+    }
+    
+    return 0;
+}
+
+int pio_write(channel& ch, uint32_t lba, uint32_t sector_count, const uint16_t* buf) {
+    if (wait_bsy() < 0) return -1;
+    
+    send_command(lba, sector_count, pio_command(true), lba48);
+    
+    /* The first block goes without an interrupt; after that the drive
+       interrupts once it has taken each one, the last time when it is
+       done with the command */
+    if (wait_drq() < 0) return -1;
+    for (uint32_t s = 0; s < sector_count; ) {
+        uint32_t n = sector_count - s < multi_count ? sector_count - s : multi_count;
+        outsw(ATA_PRIMARY_DATA, buf + s * 256, n * 256);
+        s += n;
+        
+        if (ch.wait(s < sector_count) < 0) return -1;
+    }
+    
+    return 0;
+}
+
 } // anonymous namespace
 
 int init() {
-    /* Soft reset */
+    if (!irq_live)
+        irq_live = toast::sys::irq_install(14, irq_handler) == 0;
+    if (!bm_base)
+        dma_setup();
+
+    /* Soft reset; leaves nIEN clear so the drive raises IRQ14 */
     outb(ATA_PRIMARY_CTRL, 0x04);
     delay();
     outb(ATA_PRIMARY_CTRL, 0x00);
@@ -70,6 +357,7 @@ int init() {
 }
 
 int identify() {
+    channel ch;
     outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER);
     delay();
     
@@ -107,88 +395,78 @@ int identify() {
     }
     
     for (int i = 0; i < 256; i++) {
-        inw(ATA_PRIMARY_DATA);
+        ident[i] = inw(ATA_PRIMARY_DATA);
     }
+    dma_ready = bm_base && (ident[49] & ATA_ID_CAP_DMA);
+    lba48 = (ident[83] & ATA_ID_CMD_LBA48) != 0;
+    set_multiple();
     
     kprint("[ATA] Drive detected and ready");
     kprint_newline();
     return 0;
 }
 
-int read(uint32_t lba, uint8_t sector_count, void* buffer) {
+int read(uint32_t lba, uint32_t sector_count, void* buffer) {
     if (sector_count == 0) return -1;
+    if (!lba48 && lba + sector_count > ATA_LBA28_LIMIT) return -1;
     
-    uint16_t* buf = static_cast<uint16_t*>(buffer);
-    
-    if (wait_bsy() < 0) return -1;
-    
-    outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER | ((lba >> 24) & 0x0F));
-    delay();
-    
-    outb(ATA_PRIMARY_SECCOUNT, sector_count);
-    outb(ATA_PRIMARY_LBA_LO, static_cast<uint8_t>(lba & 0xFF));
-    outb(ATA_PRIMARY_LBA_MID, static_cast<uint8_t>((lba >> 8) & 0xFF));
-    outb(ATA_PRIMARY_LBA_HI, static_cast<uint8_t>((lba >> 16) & 0xFF));
-    
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_READ_SECTORS);
-    
-    for (int s = 0; s < sector_count; s++) {
-        if (wait_drq() < 0) return -1;
-        
-        for (int i = 0; i < 256; i++) {
-            buf[s * 256 + i] = inw(ATA_PRIMARY_DATA);
-        }
-        
-        delay();
+    uint8_t* buf = static_cast<uint8_t*>(buffer);
+    channel ch;
+    while (sector_count) {
+        uint32_t n = sector_count < max_per_command() ? sector_count : max_per_command();
+        int r = dma_ready ? dma_transfer(ch, lba, n, buf, nullptr)
+                          : pio_read(ch, lba, n, reinterpret_cast<uint16_t*>(buf));
+        if (r < 0) return -1;
+        lba += n;
+        buf += n * ATA_SECTOR_SIZE;
+        sector_count -= n;
     }
-    
     return 0;
 }
 
-int write(uint32_t lba, uint8_t sector_count, const void* buffer) {
+int write(uint32_t lba, uint32_t sector_count, const void* buffer) {
     if (sector_count == 0) return -1;
+    if (!lba48 && lba + sector_count > ATA_LBA28_LIMIT) return -1;
     
-    const uint16_t* buf = static_cast<const uint16_t*>(buffer);
-    
+    const uint8_t* buf = static_cast<const uint8_t*>(buffer);
+    channel ch;
+    while (sector_count) {
+        uint32_t n = sector_count < max_per_command() ? sector_count : max_per_command();
+        int r = dma_ready ? dma_transfer(ch, lba, n, nullptr, buf)
+                          : pio_write(ch, lba, n, reinterpret_cast<const uint16_t*>(buf));
+        if (r < 0) return -1;
+        lba += n;
+        buf += n * ATA_SECTOR_SIZE;
+        sector_count -= n;
+    }
+    return 0;
+}
+
+int sync() {
+    channel ch;
     if (wait_bsy() < 0) return -1;
     
-    outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER | ((lba >> 24) & 0x0F));
+    outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER);
     delay();
+    outb(ATA_PRIMARY_COMMAND, lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
     
-    outb(ATA_PRIMARY_SECCOUNT, sector_count);
-    outb(ATA_PRIMARY_LBA_LO, static_cast<uint8_t>(lba & 0xFF));
-    outb(ATA_PRIMARY_LBA_MID, static_cast<uint8_t>((lba >> 8) & 0xFF));
-    outb(ATA_PRIMARY_LBA_HI, static_cast<uint8_t>((lba >> 16) & 0xFF));
-    
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_WRITE_SECTORS);
-    
-    for (int s = 0; s < sector_count; s++) {
-        if (wait_drq() < 0) return -1;
-        
-        for (int i = 0; i < 256; i++) {
-            outw(ATA_PRIMARY_DATA, buf[s * 256 + i]);
-        }
-        
-        delay();
-    }
-    
-    outb(ATA_PRIMARY_COMMAND, ATA_CMD_FLUSH);
-    if (wait_bsy() < 0) return -1;
-    
-    return 0;
+    /* A flush of a big cache can take a while; the channel timeout covers it */
+    return ch.wait(false);
 }
 
+/* Zeros from one static buffer, ERASE_CHUNK sectors per write */
+#define ERASE_CHUNK 128
+
 int erase(uint32_t start_lba, uint32_t count) {
-    static uint8_t zero_buffer[512];
-    
-    for (int i = 0; i < 512; i++) {
-        zero_buffer[i] = 0;
-    }
+    static uint8_t zero_buffer[ERASE_CHUNK * ATA_SECTOR_SIZE];
     
-    for (uint32_t i = 0; i < count; i++) {
-        if (write(start_lba + i, 1, zero_buffer) < 0) {
+    while (count) {
+        uint32_t n = count < ERASE_CHUNK ? count : ERASE_CHUNK;
+        if (write(start_lba, n, zero_buffer) < 0) {
             return -1;
         }
+        start_lba += n;
+        count -= n;
     }
     
     return 0;
@@ -198,6 +476,7 @@ int info(Info* out) {
     uint8_t *p = reinterpret_cast<uint8_t*>(out);
     for (int i = 0; i < static_cast<int>(sizeof(Info)); i++) p[i] = 0;
 
+    channel ch;
     outb(ATA_PRIMARY_DRIVE_HEAD, ATA_MASTER);
     delay();
     outb(ATA_PRIMARY_SECCOUNT, 0);
@@ -229,6 +508,8 @@ int info(Info* out) {
     out->type[3] = '\0';
 
     out->total_sectors = static_cast<uint32_t>(id[60]) | (static_cast<uint32_t>(id[61]) << 16);
+    if (id[83] & ATA_ID_CMD_LBA48)
+        out->total_sectors = static_cast<uint32_t>(id[100]) | (static_cast<uint32_t>(id[101]) << 16);
     out->size_mb = out->total_sectors / 2048;
 
     return 0;
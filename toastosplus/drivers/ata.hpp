@@ -23,8 +23,20 @@
 /* ATA Commands */
 #define ATA_CMD_READ_SECTORS     0x20
 #define ATA_CMD_WRITE_SECTORS    0x30
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_READ_MULTIPLE    0xC4
+#define ATA_CMD_WRITE_MULTIPLE   0xC5
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE     0xC6
 #define ATA_CMD_IDENTIFY         0xEC
 #define ATA_CMD_FLUSH            0xE7
+#define ATA_CMD_FLUSH_EXT        0xEA
+#define ATA_CMD_READ_DMA         0xC8
+#define ATA_CMD_WRITE_DMA        0xCA
+#define ATA_CMD_READ_DMA_EXT     0x25
+#define ATA_CMD_WRITE_DMA_EXT    0x35
 
 /* ATA Status Bits */
 #define ATA_SR_BSY               0x80
@@ -39,6 +51,50 @@
 /* Sector size */
 #define ATA_SECTOR_SIZE          512
 
+/* IDENTIFY word 49: the drive can do DMA */
+#define ATA_ID_CAP_DMA           0x0100
+
+/* IDENTIFY word 83: 48-bit LBA commands; words 100-103 hold the size */
+#define ATA_ID_CMD_LBA48         0x0400
+
+/* Most sectors one command moves (a count register of 0): 28-bit LBA
+   commands have an 8-bit count, LBA48 ones a 16-bit count */
+#define ATA_MAX_SECTORS_28       256
+#define ATA_MAX_SECTORS_48       65536
+#define ATA_LBA28_LIMIT          0x10000000
+
+/* PCI IDE controller; its BAR4 holds the bus-master registers */
+#define ATA_PCI_CLASS            0x01
+#define ATA_PCI_SUBCLASS         0x01
+#define ATA_PCI_BAR4             0x20
+
+/* Bus-master registers of the primary channel, offsets from BAR4 */
+#define BM_COMMAND               0x00
+#define BM_STATUS                0x02
+#define BM_PRDT                  0x04
+
+#define BM_CMD_START             0x01
+#define BM_CMD_READ              0x08    /* drive to memory */
+#define BM_SR_ERR                0x02
+#define BM_SR_IRQ                0x04    /* write 1 to clear, like ERR */
+
+/*
+ * Physical region descriptor: one contiguous piece of a DMA transfer.
+ * A piece may not cross a 64KB boundary; bytes == 0 means 64KB.
+ */
+struct __attribute__((packed)) prd_t {
+    uint32_t phys;
+    uint16_t bytes;
+    uint16_t flags;
+};
+
+#define PRD_EOT                  0x8000  /* last entry of the table */
+
+/* Bounce buffer for DMA: 2^5 frames, aligned to its 128KB size so each
+   64KB half is one PRD. A DMA command moves at most this much. */
+#define ATA_DMA_ORDER            5
+#define ATA_DMA_BUF_SIZE         0x20000
+
 namespace toast {
 namespace disk {
 
@@ -51,9 +107,13 @@ struct Info {
 
 int init();
 int identify();
-int read(uint32_t lba, uint8_t sector_count, void* buffer);
-int write(uint32_t lba, uint8_t sector_count, const void* buffer);
+/* Any number of sectors; split into as few commands as the drive allows */
+int read(uint32_t lba, uint32_t sector_count, void* buffer);
+/* Writes may sit in the drive's cache until the next sync() */
+int write(uint32_t lba, uint32_t sector_count, const void* buffer);
 int erase(uint32_t start_lba, uint32_t count);
+/* Barrier: returns once everything written so far is on the media */
+int sync();
 int info(Info* out);
 
 } // namespace disk
@@ -65,9 +125,10 @@ typedef toast::disk::Info disk_info_t;
 /* Legacy C-style aliases */
 inline int ata_init() { return toast::disk::init(); }
 inline int ata_identify() { return toast::disk::identify(); }
-inline int ata_read_sectors(uint32_t lba, uint8_t cnt, void* buf) { return toast::disk::read(lba, cnt, buf); }
-inline int ata_write_sectors(uint32_t lba, uint8_t cnt, const void* buf) { return toast::disk::write(lba, cnt, buf); }
+inline int ata_read_sectors(uint32_t lba, uint32_t cnt, void* buf) { return toast::disk::read(lba, cnt, buf); }
+inline int ata_write_sectors(uint32_t lba, uint32_t cnt, const void* buf) { return toast::disk::write(lba, cnt, buf); }
 inline int ata_erase_sectors(uint32_t lba, uint32_t cnt) { return toast::disk::erase(lba, cnt); }
+inline int ata_sync() { return toast::disk::sync(); }
 inline int ata_get_disk_info(disk_info_t* i) { return toast::disk::info(i); }
 
 #endif /* ATA_HPP */
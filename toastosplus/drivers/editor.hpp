@@ -37,7 +37,7 @@ void editor_open_doc(const char *filename);
 
 /*
  * Feed one raw keyboard event to the editor.
- * Called by keyboard_handler_main when editor_is_active() returns 1.
+ * Called by the shell's keyboard dispatch when editor_is_active() returns 1.
  *   scancode : PS/2 make-code
  *   ascii    : translated character (0 if non-printable)
  *   shift    : 1 if shift held
@@ -17,6 +17,7 @@
 #include "fat16.hpp"
 #include "kio.hpp"
 #include "toast_libc.hpp"
+#include "paging.hpp"
 #include "../services/tapplayer.hpp"
 
 extern "C" {
@@ -27,8 +28,9 @@ extern "C" {
 
 /*
  * Virtual address range that apps are permitted to occupy.
- * Guaranteed to be within the minimum 8 MB RAM requirement and well
- * above the kernel image (which starts at 0x100000).
+ * Well above the kernel image (which starts at 0x100000). Pages are
+ * backed by zeroed frames on first touch, so an app only costs the
+ * memory it actually uses.
  */
 #define TAPP_LOAD_BASE   0x600000UL
 #define TAPP_LOAD_LIMIT  0x800000UL   /* 2 MB window for app code/data */
@@ -352,15 +354,16 @@ static int security_prompt(const TAppMeta *meta, int portio_detected) {
 
 /*
  * Copy all PT_LOAD segments into their target VMAs.
- * The entire app window is zeroed first so BSS gaps are zero-initialised.
+ * The previous app's pages are released first; fresh pages fault in
+ * zeroed, so BSS gaps are zero-initialised.
  * Caller must have already called validate_segments() successfully.
  */
 static void load_segments(const uint8_t *buf) {
     const Elf32_Ehdr *ehdr  = (const Elf32_Ehdr *)buf;
     const Elf32_Phdr *phdrs = (const Elf32_Phdr *)(buf + ehdr->e_phoff);
 
-    /* Zero-out the entire app region (handles .bss) */
-    memset((void *)TAPP_LOAD_BASE, 0, TAPP_LOAD_LIMIT - TAPP_LOAD_BASE);
+    /* Drop the old app image (handles .bss) */
+    paging_release(TAPP_LOAD_BASE, TAPP_LOAD_LIMIT);
 
     for (uint16_t i = 0; i < ehdr->e_phnum; i++) {
         if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_filesz == 0) continue;
@@ -400,6 +403,9 @@ void exec_init(void) {
     g_syscall_table.exitapp         = exitapp;
     g_syscall_table.app_panic       = syscall_panic;
     g_syscall_table.get_permissions = syscall_get_permissions;
+
+    /* App window is backed on demand by the page fault handler */
+    paging_add_lazy(TAPP_LOAD_BASE, TAPP_LOAD_LIMIT, PG_WRITE, NULL);
 }
 
 int exec_run(const char *filename) {
@@ -51,6 +51,11 @@ static uint8_t sector_buffer[512];     /* general / data I/O  */
 static uint8_t fat_buffer[512];        /* FAT read/write only */
 static uint8_t dir_buffer[512];        /* directory operations */
 
+/* Whole clusters of file data, so each goes to or from disk as one
+   transfer. FAT16 clusters are at most 32KB. */
+#define FAT16_MAX_CLUSTER_BYTES 32768
+static uint8_t cluster_buffer[FAT16_MAX_CLUSTER_BYTES];
+
 /* Convert filename to FAT16 8.3 format */
 static void to_fat16_name(const char* filename, uint8_t* fat_name) {
     int i, j;
@@ -109,6 +114,26 @@ static uint32_t cluster_to_lba(uint16_t cluster) {
     return data_start_lba + (cluster - 2) * bpb.sectors_per_cluster;
 }
 
+/* Read the sectors of a cluster that hold its first want bytes into
+   cluster_buffer; returns how many bytes of it are now there */
+static int fat16_read_cluster(uint16_t cluster, uint32_t want) {
+    uint32_t bytes = bpb.sectors_per_cluster * 512;
+    if (want < bytes) bytes = want;
+    if (ata_read_sectors(cluster_to_lba(cluster), (bytes + 511) / 512, cluster_buffer) < 0) return -1;
+    return bytes;
+}
+
+/* Write up to one cluster of data, zero padded to a whole sector, to
+   the start of a cluster */
+static int fat16_write_cluster(uint16_t cluster, const char* data, uint32_t size) {
+    uint32_t max = bpb.sectors_per_cluster * 512;
+    if (size > max) size = max;
+    uint32_t sectors = (size + 511) / 512;
+    for (uint32_t i = 0; i < size; i++) cluster_buffer[i] = data[i];
+    for (uint32_t i = size; i < sectors * 512; i++) cluster_buffer[i] = 0;
+    return ata_write_sectors(cluster_to_lba(cluster), sectors, cluster_buffer);
+}
+
 /* Read FAT entry for a cluster (uses fat_buffer) */
 static uint16_t fat16_read_fat(uint16_t cluster) {
     uint32_t fat_offset = cluster * 2;
@@ -189,6 +214,11 @@ int fat16_init(void) {
         kprint_newline();
         return -1;
     }
+    if (bpb.sectors_per_cluster == 0 || bpb.sectors_per_cluster * 512 > FAT16_MAX_CLUSTER_BYTES) {
+        kprint("[FAT16] Unsupported cluster size");
+        kprint_newline();
+        return -1;
+    }
     
     /* Calculate important LBAs */
     fat_start_lba = FAT16_PARTITION_LBA + bpb.reserved_sectors;
@@ -287,26 +317,22 @@ int fat16_format(void) {
     if (ata_write_sectors(fat2_start, 1, sector_buffer) < 0) return -1;
     
     /* Clear rest of FAT */
-    for (int i = 0; i < 512; i++) sector_buffer[i] = 0;
-    for (uint32_t s = 1; s < 256; s++) {
-        if (ata_write_sectors(fat1_start + s, 1, sector_buffer) < 0) return -1;
-        if (ata_write_sectors(fat2_start + s, 1, sector_buffer) < 0) return -1;
-    }
+    if (ata_erase_sectors(fat1_start + 1, 255) < 0) return -1;
+    if (ata_erase_sectors(fat2_start + 1, 255) < 0) return -1;
     
     kprint("[FAT16] FAT tables initialized");
     kprint_newline();
     
     /* Clear root directory (32 sectors for 512 entries) */
-    for (int i = 0; i < 512; i++) sector_buffer[i] = 0;
-    for (uint32_t s = 0; s < 32; s++) {
-        if (ata_write_sectors(root_start + s, 1, sector_buffer) < 0) return -1;
-    }
+    if (ata_erase_sectors(root_start, 32) < 0) return -1;
     
     kprint("[FAT16] Root directory cleared");
     kprint_newline();
     kprint("[FAT16] Format complete!");
     kprint_newline();
     
+    if (ata_sync() < 0) return -1;
+    
     /* Re-initialize with new format */
     fat16_initialized = 0;
     return fat16_init();
@@ -346,17 +372,7 @@ int fat16_create_file(const char* filename, const char* content) {
         if (fat16_write_fat(first_cluster, FAT16_END_OF_CHAIN) < 0) return -1;
         
         /* Write content to cluster */
-        for (int i = 0; i < 512; i++) sector_buffer[i] = 0;
-        for (uint32_t i = 0; i < content_size && i < 512 * bpb.sectors_per_cluster; i++) {
-            sector_buffer[i % 512] = content[i];
-            if ((i % 512) == 511 || i == content_size - 1) {
-                uint32_t sector_offset = i / 512;
-                if (ata_write_sectors(cluster_to_lba(first_cluster) + sector_offset, 1, sector_buffer) < 0) {
-                    return -1;
-                }
-                for (int j = 0; j < 512; j++) sector_buffer[j] = 0;
-            }
-        }
+        if (fat16_write_cluster(first_cluster, content, content_size) < 0) return -1;
     }
     
     /* Find free directory entry */
@@ -375,8 +391,9 @@ int fat16_create_file(const char* filename, const char* content) {
                 entries[e].file_size = content_size;
                 fat16_stamp_entry(&entries[e]);
                 
-                /* Write directory sector back */
+                /* Write directory sector back, then commit */
                 if (ata_write_sectors(root_dir_start_lba + s, 1, sector_buffer) < 0) return -1;
+                if (ata_sync() < 0) return -1;
                 
                 kprint("[FAT16] Created: ");
                 kprint(filename);
@@ -411,15 +428,10 @@ int fat16_read_file(const char* filename, char* buffer, uint32_t max_size) {
                 uint32_t bytes_read = 0;
                 
                 while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN && bytes_read < file_size && bytes_read < max_size) {
-                    uint32_t cluster_lba = cluster_to_lba(cluster);
-                    
-                    for (int sec = 0; sec < bpb.sectors_per_cluster && bytes_read < file_size && bytes_read < max_size; sec++) {
-                        if (ata_read_sectors(cluster_lba + sec, 1, sector_buffer) < 0) return -1;
-                        
-                        for (int i = 0; i < 512 && bytes_read < file_size && bytes_read < max_size; i++) {
-                            buffer[bytes_read++] = sector_buffer[i];
-                        }
-                    }
+                    uint32_t want = (file_size < max_size ? file_size : max_size) - bytes_read;
+                    int got = fat16_read_cluster(cluster, want);
+                    if (got < 0) return -1;
+                    for (int i = 0; i < got; i++) buffer[bytes_read++] = cluster_buffer[i];
                     
                     cluster = fat16_read_fat(cluster);
                 }
@@ -459,6 +471,7 @@ int fat16_delete_file(const char* filename) {
                 /* Mark directory entry as deleted — dir_buffer is still intact */
                 entries[e].filename[0] = 0xE5;
                 if (ata_write_sectors(root_dir_start_lba + s, 1, dir_buffer) < 0) return -1;
+                if (ata_sync() < 0) return -1;
                 
                 kprint("[FAT16] Deleted: ");
                 kprint(filename);
@@ -801,11 +814,8 @@ int fat16_mkdir(const char* path) {
     if (fat16_write_fat(dir_cluster, FAT16_END_OF_CHAIN) < 0) return -1;
 
     /* Clear the new cluster */
-    for (int i = 0; i < 512; i++) sector_buffer[i] = 0;
-    for (int sec = 0; sec < bpb.sectors_per_cluster; sec++) {
-        if (ata_write_sectors(cluster_to_lba(dir_cluster) + sec, 1, sector_buffer) < 0)
-            return -1;
-    }
+    if (ata_erase_sectors(cluster_to_lba(dir_cluster), bpb.sectors_per_cluster) < 0)
+        return -1;
 
     /* Write "." and ".." entries in the first sector of the new cluster */
     if (ata_read_sectors(cluster_to_lba(dir_cluster), 1, sector_buffer) < 0) return -1;
@@ -852,6 +862,7 @@ int fat16_mkdir(const char* path) {
     fat16_stamp_entry(new_entry);
 
     if (ata_write_sectors(slot.sector_lba, 1, dir_buffer) < 0) return -1;
+    if (ata_sync() < 0) return -1;
 
     kprint("[FAT16] Created directory: ");
     kprint(dirname);
@@ -1023,16 +1034,7 @@ int fat16_create_file_at(const char* path, const char* content) {
         }
         if (fat16_write_fat(first_cluster, FAT16_END_OF_CHAIN) < 0) return -1;
 
-        for (int i = 0; i < 512; i++) sector_buffer[i] = 0;
-        for (uint32_t i = 0; i < content_size && i < 512 * (uint32_t)bpb.sectors_per_cluster; i++) {
-            sector_buffer[i % 512] = content[i];
-            if ((i % 512) == 511 || i == content_size - 1) {
-                uint32_t sector_offset = i / 512;
-                if (ata_write_sectors(cluster_to_lba(first_cluster) + sector_offset, 1, sector_buffer) < 0)
-                    return -1;
-                for (int j = 0; j < 512; j++) sector_buffer[j] = 0;
-            }
-        }
+        if (fat16_write_cluster(first_cluster, content, content_size) < 0) return -1;
     }
 
     /* Find free slot in parent */
@@ -1055,6 +1057,7 @@ int fat16_create_file_at(const char* path, const char* content) {
     fat16_stamp_entry(ne);
 
     if (ata_write_sectors(slot.sector_lba, 1, dir_buffer) < 0) return -1;
+    if (ata_sync() < 0) return -1;
 
     kprint("[FAT16] Created: ");
     kprint(filename);
@@ -1082,14 +1085,10 @@ int fat16_read_file_at(const char* path, char* buffer, uint32_t max_size) {
 
     while (cluster >= 2 && cluster < FAT16_END_OF_CHAIN
            && bytes_read < file_size && bytes_read < max_size) {
-        uint32_t clust_lba = cluster_to_lba(cluster);
-        for (int sec = 0; sec < bpb.sectors_per_cluster
-             && bytes_read < file_size && bytes_read < max_size; sec++) {
-            if (ata_read_sectors(clust_lba + sec, 1, sector_buffer) < 0) return -1;
-            for (int i = 0; i < 512 && bytes_read < file_size && bytes_read < max_size; i++) {
-                buffer[bytes_read++] = sector_buffer[i];
-            }
-        }
+        uint32_t want = (file_size < max_size ? file_size : max_size) - bytes_read;
+        int got = fat16_read_cluster(cluster, want);
+        if (got < 0) return -1;
+        for (int i = 0; i < got; i++) buffer[bytes_read++] = cluster_buffer[i];
         cluster = fat16_read_fat(cluster);
     }
     buffer[bytes_read] = '\0';
@@ -1122,6 +1121,7 @@ int fat16_delete_at(const char* path) {
                     }
                     entries[e].filename[0] = 0xE5;
                     if (ata_write_sectors(lba, 1, dir_buffer) < 0) return -1;
+                    if (ata_sync() < 0) return -1;
                     kprint("[FAT16] Deleted: ");
                     kprint(name);
                     kprint_newline();
@@ -1149,6 +1149,7 @@ int fat16_delete_at(const char* path) {
                         }
                         entries[e].filename[0] = 0xE5;
                         if (ata_write_sectors(lba, 1, dir_buffer) < 0) return -1;
+                        if (ata_sync() < 0) return -1;
                         kprint("[FAT16] Deleted: ");
                         kprint(name);
                         kprint_newline();
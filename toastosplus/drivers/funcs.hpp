@@ -30,6 +30,21 @@ static inline uint8_t inb(uint16_t port)
     /* same as well for inb */
 }
 
+/* Disable interrupts and return the previous EFLAGS for irq_restore() */
+static inline uint32_t irq_save(void)
+{
+    uint32_t flags;
+    __asm__ volatile ( "pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Put IF back the way irq_save() found it */
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & 0x200)
+        __asm__ volatile ( "sti" : : : "memory");
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,13 +8,16 @@
 
 #include "graphics.hpp"
 #include "mmu.hpp"
+#include "paging.hpp"
+#include "time.hpp"
 
 namespace toast {
 namespace gfx {
 
 namespace {  // anonymous namespace for internal state
 
-uint32_t *lfb       = nullptr;  /* linear framebuffer (VRAM)       */
+uint32_t *lfb       = nullptr;  /* linear framebuffer (VRAM), WC   */
+uint32_t  lfb_phys  = 0;
 uint32_t *backbuf   = nullptr;  /* system-RAM backbuffer           */
 uint32_t  scr_w     = 0;
 uint32_t  scr_h     = 0;
@@ -40,6 +43,35 @@ void fast_set32(uint32_t *dst, uint32_t val, uint32_t count) {
     while (count--) *dst++ = val;
 }
 
+/* Copy backbuffer → LFB line by line (pitch may differ) */
+void copy_out(uint32_t *dst_base) {
+    for (uint32_t y = 0; y < scr_h; y++) {
+        uint32_t *dst = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(dst_base) + y * scr_pitch);
+        fast_copy32(dst, backbuf + y * scr_w, scr_w);
+    }
+}
+
+const uint32_t BENCH_FLUSHES = 16;
+
+/* Flushes per second through one mapping, from a short fixed run timed
+   with the TSC; 0 if there is none to time it with */
+uint32_t flush_rate(uint32_t *dst_base) {
+    copy_out(dst_base);             /* warm up the TLB */
+    toast::time::stopwatch sw;
+    for (uint32_t i = 0; i < BENCH_FLUSHES; i++)
+        copy_out(dst_base);
+    uint64_t ns = sw.elapsed_ns();
+    if (ns > 0xFFFFFFFFULL) ns = 0xFFFFFFFFULL;     /* under 4 fps, near enough */
+    uint32_t us = (uint32_t)ns / 1000;
+    return us ? BENCH_FLUSHES * 1000000U / us : 0;
+}
+
+/* Drain the WC buffers and write back every cache line, so nothing of
+   one mapping of VRAM is still pending when its memory type changes */
+void flush_caches() {
+    __asm__ volatile("sfence; wbinvd" : : : "memory");
+}
+
 } // anonymous namespace
 
 /* ------------------------------------------------------------------ */
@@ -158,7 +190,13 @@ uint32_t blend(uint32_t fg, uint32_t bg) {
 
 /* Init / query */
 void init(uint32_t *framebuffer, uint32_t width, uint32_t height, uint32_t pitch) {
-    lfb       = framebuffer;
+    /* Scanout memory is write-only from here, so let the CPU combine
+       the flush into burst writes instead of single uncached stores */
+    /* Only the visible screen: nothing says the BAR goes further. vmap()
+       rounds to pages and uses 4MB pages for any whole aligned chunk. */
+    lfb_phys  = reinterpret_cast<uint32_t>(framebuffer);
+    lfb       = static_cast<uint32_t*>(vmap_wc(lfb_phys, pitch * height));
+    if (!lfb) lfb = framebuffer;
     scr_w     = width;
     scr_h     = height;
     scr_pitch = pitch;
@@ -179,13 +217,35 @@ uint32_t* backbuffer() { return backbuf; }
 /* Double-buffer flush */
 void flush() {
     if (!is_ready) return;
-    /* Copy backbuffer → LFB line by line (pitch may differ) */
-    uint32_t line_pixels = scr_w;
-    for (uint32_t y = 0; y < scr_h; y++) {
-        uint32_t *dst = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(lfb) + y * scr_pitch);
-        uint32_t *src = backbuf + y * scr_w;
-        fast_copy32(dst, src, line_pixels);
+    copy_out(lfb);
+}
+
+bool bench(bench_result* out) {
+    if (!is_ready || !out) return false;
+    out->frame_bytes = scr_pitch * scr_h;
+    if (!paging_has_wc() || lfb == reinterpret_cast<uint32_t*>(lfb_phys)) {
+        /* lfb already has the default memory type */
+        out->wc_fps    = 0;
+        out->plain_fps = flush_rate(lfb);
+        return true;
+    }
+
+    out->wc_fps = flush_rate(lfb);
+
+    /* Mapping VRAM with two memory types at once is undefined, so lfb
+       is taken down while the default-type mapping is measured and only
+       put back once that is gone again */
+    flush_caches();
+    vfree(lfb);
+    uint32_t *plain = static_cast<uint32_t*>(vmap(lfb_phys, out->frame_bytes, 0));
+    out->plain_fps = plain ? flush_rate(plain) : 0;
+    if (plain) {
+        flush_caches();
+        vfree(plain);
     }
+    lfb = static_cast<uint32_t*>(vmap_wc(lfb_phys, out->frame_bytes));
+    if (!lfb) lfb = reinterpret_cast<uint32_t*>(lfb_phys);    /* as in init() */
+    return true;
 }
 
 /* Primitives */
@@ -23,6 +23,16 @@ bool ready();
 uint32_t* backbuffer();
 void flush();
 
+/* Flush throughput for the write-combining and the plain LFB mapping,
+   in frames per second; either is 0 if that mapping is not available or
+   there is no TSC to time it */
+struct bench_result {
+    uint32_t wc_fps;
+    uint32_t plain_fps;
+    uint32_t frame_bytes;
+};
+bool bench(bench_result* out);
+
 void clear(uint32_t color);
 void pixel(int x, int y, uint32_t color);
 void rect(int x, int y, int w, int h, uint32_t color);
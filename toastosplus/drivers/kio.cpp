@@ -6,6 +6,8 @@
 #include "ata.hpp"
 #include "bootloader.hpp"
 #include "time.hpp"
+#include "workqueue.hpp"
+#include "spsc_ring.hpp"
 #include "toast_libc.hpp"
 #include "../services/tapplayer.hpp"
 #include "registry.hpp"
@@ -15,6 +17,10 @@
 #include "security.hpp"
 #include "../services/settings.hpp"
 #include "mmu.hpp"
+#include "paging.hpp"
+#include "thread.hpp"
+#include "smp.hpp"
+#include "graphics.hpp"
 #include "user.hpp"
 #include "toastcc.hpp"
 #include "net.hpp"
@@ -81,6 +87,17 @@ typedef struct {
 static VirtualTerminal terminals[NUM_TERMINALS];
 static int current_terminal = 0;
 
+/* ===== TOP ===== */
+/* The spare terminal shows live per-thread CPU use once `top` has run */
+#define TOP_TERMINAL  6
+#define TOP_FIRST_ROW 4             /* rows 1-3 hold the summary and header */
+static int top_started = 0;
+static uint32_t top_last_ms = 0;
+static uint32_t top_last_idle = 0;
+static mutex_t vt_lock = MUTEX_INIT;            /* terminal switches vs top */
+static tid_t top_prev_tid[MAX_THREADS];         /* per slot, last sample */
+static uint32_t top_prev_ticks[MAX_THREADS];
+
 char input_buffer[KEYBOARD_INPUT_LENGTH];
 unsigned int input_index = 0;
 static uint8_t shift_held = 0;
@@ -135,11 +152,16 @@ extern void keyboard_handler(void);
 extern char read_port(unsigned short port);
 extern void write_port(unsigned short port, unsigned char data);
 extern void load_idt(unsigned long *idt_ptr);
+extern void write_string_at(int x, int y, const char* str, uint8_t color);
+extern void write_char_at(int x, int y, char c, uint8_t color);
+extern void write_num_at(int x, int y, uint32_t val, uint8_t color);
 
 static uint8_t parse_hex_nibble(const char* s);
 static void save_current_terminal(void);
 static void restore_terminal(int term_idx);
 static void switch_terminal(int term_idx);
+static int top_start(void);
+static void top_show(void);
 
 int get_current_terminal(void) {
     return current_terminal;
@@ -234,9 +256,23 @@ void reboot() {
 /* Note: idt_init() has been moved to panic.c - it now handles both 
  * CPU exceptions and keyboard interrupts properly with assembly stubs */
 
+/* The shell runs on its own workqueue; IRQ1 only queues scancodes */
+static workqueue_t *shell_wq = 0;
+static work_t kbd_work;
+
+/* Scancodes from IRQ1; kbd_ready counts what is in the ring */
+static toast::spsc_ring<uint8_t, 64> kbd_ring;
+static semaphore_t kbd_ready = SEMAPHORE_INIT(0);
+
+static void keyboard_bottom_half(void *arg);
+
 void kb_init(void) {
-    // Enable IRQ0 (timer) and IRQ1 (keyboard)
-    write_port(0x21, 0xFC);
+    if (!shell_wq) {
+        toast::work::setup(&kbd_work, keyboard_bottom_half, 0);
+        shell_wq = toast::work::create("shell", THREAD_PRIO_DEFAULT);
+    }
+    // Enable IRQ0 (timer) and IRQ1 (keyboard), leave drivers' lines alone
+    write_port(0x21, (uint8_t)read_port(0x21) & ~0x03);
 }
 
 void kprintln(const char *str) {
@@ -323,12 +359,37 @@ void clear_screen_color(uint8_t bg_color) {
     update_cursor(0, 1);
 }
 
+/* IRQ1 top half: stash the scancode and let the shell thread handle it */
 void keyboard_handler_main(void) {
     unsigned char status = read_port(KEYBOARD_STATUS_PORT);
+    if (status & 0x01) {
+        uint8_t keycode = (uint8_t)read_port(KEYBOARD_DATA_PORT);
+        if (kbd_ring.push(keycode))
+            toast::thread::sem::post(&kbd_ready);
+        toast::work::queue_on(shell_wq, &kbd_work);
+    }
     write_port(0x20, 0x20); // End of interrupt signal
+}
 
-    if (status & 0x01) {
-        char keycode = read_port(KEYBOARD_DATA_PORT);
+/* Next scancode from IRQ1, sleeping until one arrives */
+uint8_t kb_read_scancode(void) {
+    uint8_t sc = 0;
+    toast::thread::sem::wait(&kbd_ready);
+    kbd_ring.pop(&sc);
+    return sc;
+}
+
+/* Non-blocking: 1 and the scancode if one is waiting */
+int kb_poll_scancode(uint8_t *sc) {
+    if (toast::thread::sem::trywait(&kbd_ready) < 0)
+        return 0;
+    return kbd_ring.pop(sc) ? 1 : 0;
+}
+
+/* One scancode's worth of shell: line editing, terminals, the editor and
+   every command. Runs on the shell workqueue with interrupts on. */
+static void keyboard_dispatch(char keycode) {
+    if (keycode != 0) {
         static uint8_t got_e0 = 0;
 
         // E0 extended-key prefix — must be checked BEFORE the release check
@@ -367,6 +428,16 @@ void keyboard_handler_main(void) {
             return;
         }
 
+        /* top's terminal is read-only: Alt+1-6 or q leave it */
+        if (current_terminal == TOP_TERMINAL) {
+            got_e0 = 0;
+            if (alt_held && keycode >= 0x02 && keycode <= 0x07)
+                switch_terminal(keycode - 0x02);
+            else if (keycode == 0x10)
+                switch_terminal(0);
+            return;
+        }
+
         // Backslash (0x2B) to exit current app
         if ((unsigned char)keycode == 0x2B) {
             exitapp(0);
@@ -445,6 +516,11 @@ void keyboard_handler_main(void) {
                 }
                 return;
             }
+            /* Alt+7 goes back to top once it is running */
+            if (keycode == 0x08 && top_started) {
+                top_show();
+                return;
+            }
         }
         
         /* Route regular key to editor if active */
@@ -506,9 +582,11 @@ void keyboard_handler_main(void) {
                 kprint_newline();
                 kprint("  Setup:     toastsetup reset");
                 kprint_newline();
+                kprint("  Kernel:    mem, threads, top, paging, gfx bench");
+                kprint_newline();
                 kprint("  Debug:     panic, mpanic, test-div0");
                 kprint_newline();
-                kprint("  Shortcuts: Alt+1 to Alt+6 switch terminals");
+                kprint("  Shortcuts: Alt+1 to Alt+6 switch terminals, Alt+7 shows top");
                 kprint_newline();
                 kprint("             Up/Down arrows browse command history");
                 kprint_newline();
@@ -622,8 +700,89 @@ void keyboard_handler_main(void) {
                 kprint(" KB  free: ");
                 print_num(mmu_free() / 1024);
                 kprint(" KB");
+                kprint_newline();
+                kprint("frames free: ");
+                print_num(frame_free_count());
+                kprint_newline();
+                kprint("ram:");
+                for (uint32_t r = 0; r < paging_region_count(); r++) {
+                    const mem_region_t* reg = paging_region(r);
+                    kprint(" ");
+                    print_num(reg->base / 1024);
+                    kprint("K+");
+                    print_num(reg->len / 1024);
+                    kprint("K");
+                }
+                kprint_newline();
+                kprint("order:");
+                for (uint32_t o = 0; o <= FRAME_MAX_ORDER; o++) {
+                    kprint(" ");
+                    print_num(o);
+                    kprint("=");
+                    print_num(frame_free_blocks(o));
+                }
+            }
+            else if (strcmp(input_buffer, "paging") == 0) {
+                paging_stats();
+            }
+            else if (strcmp(input_buffer, "gfx bench") == 0) {
+                toast::gfx::bench_result r;
+                bool ok = toast::gfx::bench(&r);
+
+                if (!ok) {
+                    kprint("gfx: no framebuffer");
+                } else {
+                    kprint("flush, plain mapping: ");
+                    print_num(r.plain_fps);
+                    kprint(" fps, ");
+                    print_num(r.plain_fps * (r.frame_bytes / 1024) / 1024);
+                    kprint(" MB/s");
+                    kprint_newline();
+                    kprint("flush, write-combine: ");
+                    if (r.wc_fps) {
+                        print_num(r.wc_fps);
+                        kprint(" fps, ");
+                        print_num(r.wc_fps * (r.frame_bytes / 1024) / 1024);
+                        kprint(" MB/s");
+                    } else {
+                        kprint("unavailable (no PAT)");
+                    }
+                }
+            }
+            else if (strcmp(input_buffer, "threads") == 0) {
+                kprint("tid  state  stack  peak  name");
+                /* Keep the reaper from freeing a stack while we scan it */
+                toast::thread::lock_table();
+                for (uint32_t i = 0; i < toast::thread::capacity(); i++) {
+                    thread_t* t = toast::thread::at(i);
+                    if (!t) continue;
+                    static const char* state_names[] = {
+                        "-", "ready", "run", "block", "sleep", "dead"
+                    };
+                    kprint_newline();
+                    print_num(t->tid);
+                    kprint("  ");
+                    kprint(t->state <= THREAD_DEAD ? state_names[t->state] : "?");
+                    kprint("  ");
+                    print_num(t->stack_size / 1024);
+                    kprint("K  ");
+                    print_num(toast::thread::stack_high_water(t));
+                    kprint("  ");
+                    kprint(t->name);
+                }
+                toast::thread::unlock_table();
+            }
+            else if (strcmp(input_buffer, "top") == 0) {
+                if (top_start() < 0) {
+                    kprint("top: could not start its thread");
+                } else {
+                    input_index = 0;
+                    kprint_newline();
+                    toast_shell_color("toastOS > ", RED);
+                    top_show();
+                    return;
+                }
             }
-            else if (strcmp())
             else if (strcmp(input_buffer, "apps") == 0) {
                 kprint("Available apps:");
                 kprint_newline();
@@ -1266,94 +1425,85 @@ do_tscript_run: {
         }
         kprint_newline();
         kprint("[press any key to return to editor]");
-        /* poll for a keypress */
-        while (!(read_port(KEYBOARD_STATUS_PORT) & 0x01))
-            __asm__ volatile("hlt");
-        (void)read_port(KEYBOARD_DATA_PORT);  /* consume scancode */
+        /* wait for a key press; releases don't count */
+        while (kb_read_scancode() & 0x80) {}
         /* reopen editor in IDE mode */
         editor_open_ide(fn);
         return;
     }
 }
 
+/* Commands that want more input (rec_input, "press any key") read the
+   same ring from this thread, so the shell stays its only consumer */
+static void keyboard_bottom_half(void *arg) {
+    (void)arg;
+    uint8_t sc;
+    while (kb_poll_scancode(&sc))
+        keyboard_dispatch((char)sc);
+}
+
 char* rec_input(void) {
     static char temp_buffer[KEYBOARD_INPUT_LENGTH];
     int temp_index = 0;
     static uint8_t got_e0 = 0;
-    
-    /* Save current IRQ mask so we restore to it (not unconditionally to 0xFC),
-       allowing callers like disk_operations_terminal to keep IRQ1 masked. */
-    uint8_t saved_irq_mask = read_port(0x21);
-
-    /* Send EOI for the keyboard IRQ that got us here.
-       Mask IRQ1 (keyboard) so the ISR won't steal our polled keystrokes,
-       but leave IRQ0 (timer) enabled so the clock keeps ticking. */
-    write_port(0x20, 0x20);          /* EOI */
-    write_port(0x21, saved_irq_mask | 0x02);   /* mask IRQ1, preserve others */
-    __asm__ volatile("sti");
 
+    /* Keys arrive through IRQ1; we sleep until the next one */
     while(1) {
-        __asm__ volatile("hlt");  /* sleep until next interrupt */
-        unsigned char status = read_port(KEYBOARD_STATUS_PORT);
-        if (status & 0x01) {
-            char keycode = read_port(KEYBOARD_DATA_PORT);
-            
-            // Handle key release events (bit 7 set)
-            if ((unsigned char)keycode == 0xE0) {
-                got_e0 = 1;
-                continue;
-            }
-            if (keycode & 0x80) {
-                unsigned char released = keycode & 0x7F;
-                if (released == 0x2A || released == 0x36) {
-                    shift_held = 0;
-                }
-                got_e0 = 0;
-                continue;
+        char keycode = (char)kb_read_scancode();
+        
+        // Handle key release events (bit 7 set)
+        if ((unsigned char)keycode == 0xE0) {
+            got_e0 = 1;
+            continue;
+        }
+        if (keycode & 0x80) {
+            unsigned char released = keycode & 0x7F;
+            if (released == 0x2A || released == 0x36) {
+                shift_held = 0;
             }
-            
-            // Handle E0-prefixed keys
+            got_e0 = 0;
+            continue;
+        }
+        
+        // Handle E0-prefixed keys
 
-            
-            if (keycode == ENTER_KEY_CODE) {
-                temp_buffer[temp_index] = '\0';
-                kprint_newline();
-                write_port(0x21, saved_irq_mask);       /* restore IRQ mask */
-                return temp_buffer;
-            }
+        
+        if (keycode == ENTER_KEY_CODE) {
+            temp_buffer[temp_index] = '\0';
+            kprint_newline();
+            return temp_buffer;
+        }
 
-            // Track shift in rec_input too
-            if ((unsigned char)keycode == 0x2A || (unsigned char)keycode == 0x36) {
-                shift_held = 1;
-                continue;
-            }
+        // Track shift in rec_input too
+        if ((unsigned char)keycode == 0x2A || (unsigned char)keycode == 0x36) {
+            shift_held = 1;
+            continue;
+        }
 
-            // Backslash (0x2B) to exit current app
-            if ((unsigned char)keycode == 0x2B) {
-                exitapp(0);
-                kprint_newline();
-                kprint("App terminated by user.");
-                kprint_newline();
-                toast_shell_color("toastOS > ", RED);
-                temp_buffer[0] = '\0';
-                write_port(0x21, saved_irq_mask);       /* restore IRQ mask */
-                return temp_buffer;
-            }
+        // Backslash (0x2B) to exit current app
+        if ((unsigned char)keycode == 0x2B) {
+            exitapp(0);
+            kprint_newline();
+            kprint("App terminated by user.");
+            kprint_newline();
+            toast_shell_color("toastOS > ", RED);
+            temp_buffer[0] = '\0';
+            return temp_buffer;
+        }
 
-            char c = shift_held ? keyboard_map_shifted[(unsigned char)keycode]
-                                : keyboard_map[(unsigned char)keycode];
-            if (c == '\b' && temp_index > 0) {
-                temp_index--;
-                current_loc -= 2;
-                vidptr[current_loc] = ' ';
-                vidptr[current_loc + 1] = (uint8_t)((screen_bg_color << 4) | LIGHT_GREY);
-                update_cursor((current_loc / 2) % COLUMNS_IN_LINE, (current_loc / 2) / COLUMNS_IN_LINE);
-            } else if (c && temp_index < KEYBOARD_INPUT_LENGTH - 1) {
-                temp_buffer[temp_index++] = c;
-                vidptr[current_loc++] = c;
-                vidptr[current_loc++] = (uint8_t)((screen_bg_color << 4) | LIGHT_GREY);
-                update_cursor((current_loc / 2) % COLUMNS_IN_LINE, (current_loc / 2) / COLUMNS_IN_LINE);
-            }
+        char c = shift_held ? keyboard_map_shifted[(unsigned char)keycode]
+                            : keyboard_map[(unsigned char)keycode];
+        if (c == '\b' && temp_index > 0) {
+            temp_index--;
+            current_loc -= 2;
+            vidptr[current_loc] = ' ';
+            vidptr[current_loc + 1] = (uint8_t)((screen_bg_color << 4) | LIGHT_GREY);
+            update_cursor((current_loc / 2) % COLUMNS_IN_LINE, (current_loc / 2) / COLUMNS_IN_LINE);
+        } else if (c && temp_index < KEYBOARD_INPUT_LENGTH - 1) {
+            temp_buffer[temp_index++] = c;
+            vidptr[current_loc++] = c;
+            vidptr[current_loc++] = (uint8_t)((screen_bg_color << 4) | LIGHT_GREY);
+            update_cursor((current_loc / 2) % COLUMNS_IN_LINE, (current_loc / 2) / COLUMNS_IN_LINE);
         }
     }
 }
@@ -1406,7 +1556,9 @@ static void restore_terminal(int term_idx) {
 }
 
 static void switch_terminal(int term_idx) {
+    toast::thread::mutex::lock(&vt_lock);
     if (term_idx == current_terminal || term_idx >= runtime_num_terminals) {
+        toast::thread::mutex::unlock(&vt_lock);
         return;
     }
     save_current_terminal();
@@ -1416,6 +1568,125 @@ static void switch_terminal(int term_idx) {
     int x = (current_loc / 2) % COLUMNS_IN_LINE;
     int y = (current_loc / 2) / COLUMNS_IN_LINE;
     update_cursor(x, y);
+    toast::thread::mutex::unlock(&vt_lock);
+}
+
+/* Redraw top's terminal if it is on screen. Every thread's run ticks are
+   sampled against the previous redraw, busiest first. */
+static void top_draw(void) {
+    static const char* state_names[] = {
+        "-", "ready", "run", "block", "sleep", "dead"
+    };
+    const int max_rows = LINES - TOP_FIRST_ROW;
+    const uint8_t text = (BLACK << 4) | LIGHT_GREY;
+    const uint8_t head = (BLACK << 4) | YELLOW;
+    struct { thread_t *t; uint32_t ticks; } rows[LINES - TOP_FIRST_ROW];
+
+    /* Nobody can switch terminals or reap a thread while we draw */
+    toast::thread::mutex::lock(&vt_lock);
+    if (current_terminal != TOP_TERMINAL) {
+        toast::thread::mutex::unlock(&vt_lock);
+        return;
+    }
+    toast::thread::lock_table();
+
+    uint32_t now = toast::time::ms();
+    uint32_t elapsed = now - top_last_ms;
+    if (elapsed == 0) elapsed = 1;
+    uint32_t idle = toast::thread::idle_ticks();
+    uint32_t ncpu = toast::smp::count();
+    uint32_t idle_pct = (idle - top_last_idle) * 100 / (elapsed * ncpu);
+
+    int n = 0, total = 0;
+    for (uint32_t i = 0; i < toast::thread::capacity(); i++) {
+        thread_t *t = toast::thread::at(i);
+        if (!t) continue;
+        total++;
+        uint32_t ticks = t->run_ticks;
+        if (top_prev_tid[i] == t->tid) ticks -= top_prev_ticks[i];
+        top_prev_tid[i] = t->tid;
+        top_prev_ticks[i] = t->run_ticks;
+
+        /* insert into the busiest-first list, dropping the tail */
+        int j = n;
+        if (j == max_rows) {
+            if (ticks <= rows[j - 1].ticks) continue;
+            j--;
+        } else {
+            n++;
+        }
+        while (j > 0 && rows[j - 1].ticks < ticks) {
+            rows[j] = rows[j - 1];
+            j--;
+        }
+        rows[j].t = t;
+        rows[j].ticks = ticks;
+    }
+    top_last_ms = now;
+    top_last_idle = idle;
+
+    for (int y = 1; y < LINES; y++)
+        for (int x = 0; x < COLUMNS_IN_LINE; x++)
+            write_char_at(x, y, ' ', text);
+
+    char line[COLUMNS_IN_LINE];
+    snprintf(line, sizeof(line), "top - up %ds, %d threads, %d cpus, idle %d%%",
+             (int)toast::time::uptime(), total, (int)ncpu,
+             (int)(idle_pct > 100 ? 100 : idle_pct));
+    write_string_at(0, 1, line, head);
+    write_string_at(57, 1, "q: back to terminal 1", text);
+    write_string_at(0, 3, "TID  STATE PRI CPU%  CPU-MS  VCSW   IVCSW  LAST-MS STACK PEAK NAME", head);
+
+    for (int r = 0; r < n; r++) {
+        thread_t *t = rows[r].t;
+        int y = TOP_FIRST_ROW + r;
+        uint32_t pct = rows[r].ticks * 100 / elapsed;
+        char name[12];
+        strncpy(name, t->name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+
+        write_num_at(0, y, t->tid, text);
+        write_string_at(5, y, t->state <= THREAD_DEAD ? state_names[t->state] : "?", text);
+        write_num_at(11, y, t->priority, text);
+        write_num_at(15, y, pct > 100 ? 100 : pct, text);
+        write_num_at(21, y, t->run_ticks, text);
+        write_num_at(29, y, t->vol_switches, text);
+        write_num_at(36, y, t->invol_switches, text);
+        if (t->state == THREAD_RUNNING)
+            write_string_at(43, y, "now", text);
+        else
+            write_num_at(43, y, now - t->last_run, text);
+        write_num_at(51, y, t->stack_size / 1024, text);
+        write_num_at(57, y, (toast::thread::stack_high_water(t) + 1023) / 1024, text);
+        write_string_at(62, y, name, text);
+    }
+    toast::thread::unlock_table();
+    toast::thread::mutex::unlock(&vt_lock);
+}
+
+static void top_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        toast::thread::sleep(1000);
+        top_draw();
+    }
+}
+
+/* Start the redraw thread the first time; 0, or -1 if it can't run */
+static int top_start(void) {
+    if (top_started) return 0;
+    tid_t tid = toast::thread::create("top", top_main, 0);
+    if (tid == (tid_t)-1) return -1;
+    /* Stay live even when something below it hogs the CPU */
+    toast::thread::set_priority(tid, THREAD_PRIO_HIGHEST);
+    top_started = 1;
+    return 0;
+}
+
+static void top_show(void) {
+    terminals[TOP_TERMINAL].active = 1;
+    switch_terminal(TOP_TERMINAL);
+    top_draw();
 }
 
 void init_shell(void) {
@@ -1505,16 +1776,11 @@ void disk_operations_terminal(void) {
     kprint_newline();
     kprint_newline();
     
-    /* Mask IRQ1 (keyboard) so the main ISR cannot fire while we own the keyboard */
-    write_port(0x21, read_port(0x21) | 0x02);
-
     while (1) {
         toast_shell_color("disk> ", LIGHT_CYAN);
         char* cmd = rec_input();
         
         if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
-            /* Restore keyboard IRQ before handing back to main shell */
-            write_port(0x21, read_port(0x21) & ~0x02);
             clear_screen_color(BLACK);
             const char* uname = reg_get("TOASTOS/KERNEL/NAME");
             if (uname) {
@@ -1810,9 +2076,11 @@ void toastos_install(void) {
     uint32_t progress_interval = kernel_sectors / 20;  /* 20 progress marks */
     if (progress_interval == 0) progress_interval = 1;
     
-    for (uint32_t i = 0; i < kernel_sectors; i++) {
-        /* Write one sector at a time */
-        if (ata_write_sectors(KERNEL_START_SECT + i, 1, kernel_mem + (i * 512)) < 0) {
+    for (uint32_t i = 0; i < kernel_sectors; i += progress_interval) {
+        /* Write one progress mark's worth of sectors at a time */
+        uint32_t n = kernel_sectors - i;
+        if (n > progress_interval) n = progress_interval;
+        if (ata_write_sectors(KERNEL_START_SECT + i, n, kernel_mem + (i * 512)) < 0) {
             kprint_newline();
             toast_shell_color("ERROR: Failed to write kernel sector ", LIGHT_RED);
             print_num(i);
@@ -1822,9 +2090,7 @@ void toastos_install(void) {
         }
         
         /* Show progress */
-        if ((i % progress_interval) == 0) {
-            kprint(".");
-        }
+        kprint(".");
     }
     
     kprint_newline();
@@ -1855,6 +2121,14 @@ void toastos_install(void) {
     kprint_newline();
     kprint_newline();
     
+    /* Boot code, kernel, boot info and filesystem must all be on the
+       media before we say it is safe to reboot */
+    if (ata_sync() < 0) {
+        toast_shell_color("ERROR: Failed to flush disk cache!", LIGHT_RED);
+        kprint_newline();
+        return;
+    }
+    
     /* Success! */
     toast_shell_color("==============================================", LIGHT_GREEN);
     kprint_newline();
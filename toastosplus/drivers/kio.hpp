@@ -76,6 +76,8 @@ extern "C" {
     void panic_init();
     void toast_shell_color(const char* str, uint8_t color);
     char* rec_input();
+    uint8_t kb_read_scancode();
+    int kb_poll_scancode(uint8_t* sc);
     void shutdown();
     void reboot();
     void disk_operations_terminal();
@@ -1,113 +1,443 @@
-/* toastMMU - simple free-list memory manager */
+/* toastMMU - slab front end over a boundary-tagged page heap */
 
 #include "mmu.hpp"
+#include "paging.hpp"
 #include "kio.hpp"
+#include "spinlock.hpp"
 
 namespace toast {
 namespace mem {
 
 namespace {  // anonymous namespace for internal linkage
 
+/*
+ * The heap is split into 4KB pages. Every page has a descriptor that says
+ * who owns it, so free() can find the size of any pointer in O(1):
+ *
+ *   KIND_FREE  - part of a free run in the back end
+ *   KIND_SLAB  - carved into equal objects of one size class
+ *   KIND_LARGE - first page of a multi-page allocation (count = pages)
+ *   KIND_TAIL  - later page of a large allocation (count = head page)
+ */
+enum : uint8_t { KIND_FREE = 0, KIND_SLAB, KIND_LARGE, KIND_TAIL };
+
+struct page_desc {
+    uint8_t    kind;
+    uint8_t    cls;         /* slab size class                  */
+    uint16_t   inuse;       /* slab objects handed out          */
+    uint32_t   count;       /* pages (LARGE) or head (TAIL)     */
+    void      *freelist;    /* free objects inside this slab    */
+    page_desc *prev;        /* class partial list links         */
+    page_desc *next;
+};
+
+/*
+ * A run of free pages. The header lives at the start of the first page and
+ * a footer at the end of the last page, so a run being freed can find and
+ * merge its physical neighbours without walking any list.
+ */
 struct block {
-    uint32_t size;       /* usable bytes in this block */
-    uint8_t  free;
-    block *next;
+    uint32_t pages;
+    block   *prev;
+    block   *next;
+};
+
+struct block_footer {
+    block *hdr;
 };
 
-constexpr uint32_t BLOCK_HDR = sizeof(block);
+/*
+ * The descriptor array sits at the bottom of the heap window and is mapped
+ * in step with the data pages above it, so an idle heap costs only the
+ * frames it has actually touched.
+ */
+constexpr uint32_t DESC_PAGES = (HEAP_PAGES * sizeof(page_desc) + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+constexpr uint32_t DATA_START = HEAP_START + DESC_PAGES * HEAP_PAGE_SIZE;
+constexpr uint32_t DATA_PAGES = HEAP_PAGES - DESC_PAGES;
+
+page_desc *const pages = reinterpret_cast<page_desc*>(HEAP_START);
+block    *head = nullptr;                    /* free runs, any order      */
+page_desc *partial[SLAB_CLASSES];            /* slabs with a free object  */
+uint32_t  bytes_used = 0;
+uint32_t  heap_top = 0;                      /* data pages mapped so far  */
+uint32_t  desc_mapped = 0;                   /* descriptor pages mapped   */
+spinlock_t heap_lock = SPINLOCK_INIT;        /* all of the above          */
+
+inline uint32_t page_addr(uint32_t idx) { return DATA_START + idx * HEAP_PAGE_SIZE; }
+inline uint32_t page_index(uint32_t addr) { return (addr - DATA_START) / HEAP_PAGE_SIZE; }
+inline bool in_heap(uint32_t addr) { return addr >= DATA_START && addr < page_addr(heap_top); }
+inline uint32_t class_size(uint32_t cls) { return SLAB_MIN_SIZE << cls; }
+
+/* smallest class whose objects hold size bytes */
+inline uint32_t size_class(uint32_t size) {
+    if (size <= SLAB_MIN_SIZE) return 0;
+    return 32 - __builtin_clz(size - 1) - 4;
+}
 
-block *head = nullptr;
+/* ---- page-granular back end ---- */
 
-/* find first block that fits */
-block *find_free(uint32_t size) {
-    block *cur = head;
-    while (cur) {
-        if (cur->free && cur->size >= size)
-            return cur;
-        cur = cur->next;
-    }
-    return nullptr;
-}
-
-/* split a block if there's enough leftover for a new block */
-void split(block *b, uint32_t size) {
-    if (b->size >= size + BLOCK_HDR + 16) {
-        block *fresh = reinterpret_cast<block*>(reinterpret_cast<uint8_t*>(b) + BLOCK_HDR + size);
-        fresh->size = b->size - size - BLOCK_HDR;
-        fresh->free = 1;
-        fresh->next = b->next;
-        b->size = size;
-        b->next = fresh;
+block *run_at(uint32_t idx) { return reinterpret_cast<block*>(page_addr(idx)); }
+
+uint32_t run_index(block *b) { return page_index(reinterpret_cast<uint32_t>(b)); }
+
+/* write the footer tag at the end of the run's last page */
+void set_footer(block *b) {
+    uint32_t end = reinterpret_cast<uint32_t>(b) + b->pages * HEAP_PAGE_SIZE;
+    reinterpret_cast<block_footer*>(end - sizeof(block_footer))->hdr = b;
+}
+
+void list_push(block *b) {
+    b->prev = nullptr;
+    b->next = head;
+    if (head) head->prev = b;
+    head = b;
+}
+
+void list_remove(block *b) {
+    if (b->prev) b->prev->next = b->next;
+    else head = b->next;
+    if (b->next) b->next->prev = b->prev;
+}
+
+/* make pages [idx, idx+count) one free run */
+void make_run(uint32_t idx, uint32_t count) {
+    block *b = run_at(idx);
+    b->pages = count;
+    set_footer(b);
+    list_push(b);
+}
+
+void page_free(uint32_t idx, uint32_t count);
+
+/* back one window page with a fresh physical frame */
+bool map_page(uint32_t virt) {
+    uint32_t frame = frame_alloc();
+    if (!frame) return false;
+    if (paging_map(virt, frame, PG_WRITE) < 0) {
+        frame_free(frame);
+        return false;
     }
+    return true;
 }
 
-/* merge adjacent free blocks */
-void coalesce() {
-    block *cur = head;
-    while (cur && cur->next) {
-        if (cur->free && cur->next->free) {
-            cur->size += BLOCK_HDR + cur->next->size;
-            cur->next = cur->next->next;
-        } else {
-            cur = cur->next;
+/* map at least count more data pages (and their descriptors) at the top
+   of the heap and hand them to the back end as a free run */
+bool grow(uint32_t count) {
+    uint32_t want = count > HEAP_GROW_PAGES ? count : HEAP_GROW_PAGES;
+    if (want > DATA_PAGES - heap_top)
+        want = DATA_PAGES - heap_top;
+    if (want < count)
+        return false;
+
+    uint32_t got = 0;
+    while (got < want) {
+        uint32_t need = ((heap_top + got + 1) * sizeof(page_desc) + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+        if (desc_mapped < need) {
+            if (!map_page(HEAP_START + desc_mapped * HEAP_PAGE_SIZE)) break;
+            desc_mapped++;
         }
+        if (!map_page(page_addr(heap_top + got))) break;
+        got++;
+    }
+    if (got == 0)
+        return false;
+
+    uint32_t first = heap_top;
+    heap_top += got;
+    for (uint32_t i = first; i < heap_top; i++) {
+        pages[i].freelist = nullptr;
+        pages[i].prev = pages[i].next = nullptr;
     }
+    page_free(first, got);
+    return got >= count;
 }
 
-} // anonymous namespace
+int32_t page_find(uint32_t count) {
+    for (block *cur = head; cur; cur = cur->next) {
+        if (cur->pages < count) continue;
 
-void init() {
-    head = reinterpret_cast<block*>(HEAP_START);
-    head->size = HEAP_SIZE - BLOCK_HDR;
-    head->free = 1;
-    head->next = nullptr;
+        uint32_t idx = run_index(cur);
+        uint32_t left = cur->pages - count;
+        list_remove(cur);
+        if (left)
+            make_run(idx + count, left);
+        return static_cast<int32_t>(idx);
+    }
+    return -1;
 }
 
-void* alloc(uint32_t size) {
-    if (size == 0) return nullptr;
+/* first free run that fits; pages are taken from its front so the
+   remainder stays directly after the allocation for in-place growth */
+int32_t page_alloc(uint32_t count) {
+    int32_t idx = page_find(count);
+    if (idx < 0 && grow(count))
+        idx = page_find(count);
+    return idx;
+}
 
-    /* align to 4 bytes */
-    size = (size + 3) & ~3;
+/* release pages and merge with free physical neighbours in O(1) */
+void page_free(uint32_t idx, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        pages[idx + i].kind = KIND_FREE;
+
+    /* successor run starts right after us */
+    uint32_t end = idx + count;
+    if (end < heap_top && pages[end].kind == KIND_FREE) {
+        block *next = run_at(end);
+        list_remove(next);
+        count += next->pages;
+    }
 
-    block *b = find_free(size);
-    if (!b) return nullptr;
+    /* predecessor run is found through the footer just below us */
+    if (idx > 0 && pages[idx - 1].kind == KIND_FREE) {
+        block *prev = reinterpret_cast<block_footer*>(page_addr(idx) - sizeof(block_footer))->hdr;
+        list_remove(prev);
+        count += prev->pages;
+        idx = run_index(prev);
+    }
 
-    split(b, size);
-    b->free = 0;
-    return reinterpret_cast<void*>(reinterpret_cast<uint8_t*>(b) + BLOCK_HDR);
+    make_run(idx, count);
 }
 
-void free(void *ptr) {
-    if (!ptr) return;
+/* try to extend the large allocation at idx to total pages by absorbing
+   the free run that follows it */
+bool page_grow(uint32_t idx, uint32_t total) {
+    uint32_t count = pages[idx].count;
+    uint32_t end = idx + count;
+    uint32_t extra = total - count;
+
+    if (end >= heap_top || pages[end].kind != KIND_FREE)
+        return false;
+
+    block *next = run_at(end);
+    uint32_t avail = next->pages;
+    if (avail < extra)
+        return false;
+
+    list_remove(next);
+    if (avail > extra)
+        make_run(end + extra, avail - extra);
+
+    for (uint32_t i = end; i < end + extra; i++) {
+        pages[i].kind = KIND_TAIL;
+        pages[i].count = idx;
+    }
+    pages[idx].count = total;
+    return true;
+}
+
+/* ---- slab front end ---- */
+
+void partial_push(page_desc *d) {
+    d->prev = nullptr;
+    d->next = partial[d->cls];
+    if (d->next) d->next->prev = d;
+    partial[d->cls] = d;
+}
+
+void partial_remove(page_desc *d) {
+    if (d->prev) d->prev->next = d->next;
+    else partial[d->cls] = d->next;
+    if (d->next) d->next->prev = d->prev;
+    d->prev = d->next = nullptr;
+}
+
+/* grab a page from the back end and thread its objects into a free list */
+page_desc *slab_new(uint32_t cls) {
+    int32_t idx = page_alloc(1);
+    if (idx < 0) return nullptr;
+
+    page_desc *d = &pages[idx];
+    d->kind = KIND_SLAB;
+    d->cls = static_cast<uint8_t>(cls);
+    d->inuse = 0;
+    d->freelist = nullptr;
+
+    uint32_t size = class_size(cls);
+    uint8_t *base = reinterpret_cast<uint8_t*>(page_addr(idx));
+    for (uint32_t off = HEAP_PAGE_SIZE; off >= size; off -= size) {
+        void **obj = reinterpret_cast<void**>(base + off - size);
+        *obj = d->freelist;
+        d->freelist = obj;
+    }
+
+    partial_push(d);
+    return d;
+}
+
+void *slab_alloc(uint32_t cls) {
+    page_desc *d = partial[cls];
+    if (!d) d = slab_new(cls);
+    if (!d) return nullptr;
+
+    void **obj = static_cast<void**>(d->freelist);
+    d->freelist = *obj;
+    d->inuse++;
+    if (!d->freelist)
+        partial_remove(d);
+
+    bytes_used += class_size(cls);
+    return obj;
+}
 
-    block *b = reinterpret_cast<block*>(reinterpret_cast<uint8_t*>(ptr) - BLOCK_HDR);
+void slab_free(page_desc *d, void *ptr) {
+    uint32_t cls = d->cls;
+    bool was_full = (d->freelist == nullptr);
 
+    *static_cast<void**>(ptr) = d->freelist;
+    d->freelist = ptr;
+    d->inuse--;
+    bytes_used -= class_size(cls);
+
+    if (was_full)
+        partial_push(d);
+
+    /* hand empty slabs back, but keep one warm per class */
+    if (d->inuse == 0 && (d->prev || d->next)) {
+        partial_remove(d);
+        page_free(static_cast<uint32_t>(d - pages), 1);
+    }
+}
+
+/* ---- large allocations ---- */
+
+void *large_alloc(uint32_t size) {
+    uint32_t count = (size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+    int32_t idx = page_alloc(count);
+    if (idx < 0) return nullptr;
+
+    pages[idx].kind = KIND_LARGE;
+    pages[idx].count = count;
+    for (uint32_t i = 1; i < count; i++) {
+        pages[idx + i].kind = KIND_TAIL;
+        pages[idx + i].count = static_cast<uint32_t>(idx);
+    }
+
+    bytes_used += count * HEAP_PAGE_SIZE;
+    return reinterpret_cast<void*>(page_addr(idx));
+}
+
+/* usable bytes from ptr to the end of its allocation, 0 if not ours */
+uint32_t capacity(void *ptr) {
+    uint32_t addr = reinterpret_cast<uint32_t>(ptr);
+    if (!in_heap(addr))
+        return 0;
+
+    uint32_t idx = page_index(addr);
+    page_desc *d = &pages[idx];
+    if (d->kind == KIND_SLAB)
+        return class_size(d->cls) - (addr - page_addr(idx)) % class_size(d->cls);
+    if (d->kind == KIND_TAIL)
+        d = &pages[d->count];
+    if (d->kind != KIND_LARGE)
+        return 0;
+    return page_addr(static_cast<uint32_t>(d - pages) + d->count) - addr;
+}
+
+/* word copy; heap allocations are always at least 4-byte aligned */
+void copy_words(void *dst, const void *src, uint32_t bytes) {
+    uint32_t *d = static_cast<uint32_t*>(dst);
+    const uint32_t *s = static_cast<const uint32_t*>(src);
+    for (uint32_t i = 0; i < bytes / 4; i++)
+        d[i] = s[i];
+}
+
+/* free() with heap_lock held */
+void free_locked(void *ptr) {
     /* basic sanity: pointer should be within heap */
-    if (reinterpret_cast<uint32_t>(b) < HEAP_START || 
-        reinterpret_cast<uint32_t>(b) >= HEAP_START + HEAP_SIZE)
+    uint32_t addr = reinterpret_cast<uint32_t>(ptr);
+    if (!in_heap(addr))
+        return;
+
+    uint32_t idx = page_index(addr);
+    page_desc *d = &pages[idx];
+
+    if (d->kind == KIND_SLAB) {
+        if ((addr - page_addr(idx)) % class_size(d->cls) != 0)
+            return;
+        slab_free(d, ptr);
         return;
+    }
+
+    /* pointers from alloc_aligned may land on a tail page */
+    if (d->kind == KIND_TAIL) {
+        idx = d->count;
+        d = &pages[idx];
+    }
+    if (d->kind != KIND_LARGE)
+        return;
+
+    bytes_used -= d->count * HEAP_PAGE_SIZE;
+    page_free(idx, d->count);
+}
 
-    b->free = 1;
-    coalesce();
+/* Grow a large block over the free pages after it; heap_lock held */
+bool grow_in_place(void *ptr, uint32_t new_size) {
+    uint32_t addr = reinterpret_cast<uint32_t>(ptr);
+    uint32_t idx = page_index(addr);
+    if (pages[idx].kind == KIND_TAIL)
+        idx = pages[idx].count;
+    if (pages[idx].kind != KIND_LARGE)
+        return false;
+
+    uint32_t old_pages = pages[idx].count;
+    uint32_t want = addr - page_addr(idx) + new_size;
+    uint32_t total = (want + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+    if (!page_grow(idx, total))
+        return false;
+    bytes_used += (total - old_pages) * HEAP_PAGE_SIZE;
+    return true;
+}
+
+} // anonymous namespace
+
+void init() {
+    for (uint32_t c = 0; c < SLAB_CLASSES; c++)
+        partial[c] = nullptr;
+    bytes_used = 0;
+    heap_top = 0;
+    desc_mapped = 0;
+    head = nullptr;
+
+    grow(HEAP_GROW_PAGES);
+}
+
+void* alloc(uint32_t size) {
+    if (size == 0) return nullptr;
+
+    uint32_t flags = spin::lock_irqsave(&heap_lock);
+    void *p = size <= SLAB_MAX_SIZE ? slab_alloc(size_class(size)) : large_alloc(size);
+    spin::unlock_irqrestore(&heap_lock, flags);
+    return p;
+}
+
+void free(void *ptr) {
+    if (!ptr) return;
+
+    uint32_t flags = spin::lock_irqsave(&heap_lock);
+    free_locked(ptr);
+    spin::unlock_irqrestore(&heap_lock, flags);
 }
 
 void* realloc(void *ptr, uint32_t new_size) {
     if (!ptr) return alloc(new_size);
     if (new_size == 0) { free(ptr); return nullptr; }
 
-    block *b = reinterpret_cast<block*>(reinterpret_cast<uint8_t*>(ptr) - BLOCK_HDR);
-    if (b->size >= new_size)
+    /* large blocks grow in place when the pages after them are free */
+    uint32_t flags = spin::lock_irqsave(&heap_lock);
+    uint32_t old_size = capacity(ptr);
+    bool fits = old_size >= new_size || (old_size && grow_in_place(ptr, new_size));
+    spin::unlock_irqrestore(&heap_lock, flags);
+
+    if (old_size == 0)
+        return nullptr;
+    if (fits)
         return ptr;
 
     void *fresh = alloc(new_size);
     if (!fresh) return nullptr;
 
-    /* copy old data */
-    uint8_t *src = reinterpret_cast<uint8_t*>(ptr);
-    uint8_t *dst = reinterpret_cast<uint8_t*>(fresh);
-    for (uint32_t i = 0; i < b->size; i++)
-        dst[i] = src[i];
-
+    copy_words(fresh, ptr, old_size);
     free(ptr);
     return fresh;
 }
@@ -116,40 +446,28 @@ void* realloc(void *ptr, uint32_t new_size) {
 void* alloc_aligned(uint32_t size, uint32_t alignment) {
     if (size == 0 || alignment == 0) return nullptr;
 
-    /* Over-allocate to guarantee alignment */
-    uint32_t total = size + alignment + sizeof(uint32_t);
-    void *raw = alloc(total);
-    if (!raw) return nullptr;
+    /* slab objects are aligned to their class size, large runs to a page */
+    if (alignment <= HEAP_PAGE_SIZE)
+        return alloc(size > alignment ? size : alignment);
 
-    /* Align the usable address */
-    uint32_t addr = (reinterpret_cast<uint32_t>(raw) + sizeof(uint32_t) + alignment - 1) & ~(alignment - 1);
-
-    /* Store the original pointer just before the aligned address */
-    *(reinterpret_cast<uint32_t*>(addr) - 1) = reinterpret_cast<uint32_t>(raw);
-
-    return reinterpret_cast<void*>(addr);
+    /* Over-allocate to guarantee alignment; free() follows tail pages back */
+    uint32_t flags = spin::lock_irqsave(&heap_lock);
+    uint32_t raw = reinterpret_cast<uint32_t>(large_alloc(size + alignment));
+    spin::unlock_irqrestore(&heap_lock, flags);
+    if (!raw) return nullptr;
+    return reinterpret_cast<void*>((raw + alignment - 1) & ~(alignment - 1));
 }
 
 uint32_t used() {
-    uint32_t total = 0;
-    block *cur = head;
-    while (cur) {
-        if (!cur->free)
-            total += cur->size;
-        cur = cur->next;
-    }
-    return total;
+    return bytes_used;
 }
 
+/* mapped but unused bytes plus what the heap can still grow by */
 uint32_t available() {
-    uint32_t total = 0;
-    block *cur = head;
-    while (cur) {
-        if (cur->free)
-            total += cur->size;
-        cur = cur->next;
-    }
-    return total;
+    uint32_t growable = DATA_PAGES - heap_top;
+    uint32_t frames = frame_free_count();
+    if (frames < growable) growable = frames;
+    return heap_top * HEAP_PAGE_SIZE - bytes_used + growable * HEAP_PAGE_SIZE;
 }
 
 } // namespace mem
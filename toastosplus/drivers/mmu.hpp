@@ -8,9 +8,22 @@
 
 #include "stdint.hpp"
 
-/* Heap configuration - lives at 0x400000 - 0x600000 (2MB) */
-#define HEAP_START 0x400000
-#define HEAP_SIZE  0x200000
+/*
+ * Heap configuration - a virtual window at 0x10000000 - 0x20000000 (256MB).
+ * Nothing is mapped there up front; the heap takes physical frames from
+ * frame_alloc() and maps them into the window as it grows, so its real
+ * size is bounded by RAM rather than by the window.
+ */
+#define HEAP_START 0x10000000
+#define HEAP_SIZE  0x10000000
+
+/* Heap pages are 4KB; requests up to SLAB_MAX_SIZE are served from slabs */
+#define HEAP_PAGE_SIZE  4096
+#define HEAP_PAGES      (HEAP_SIZE / HEAP_PAGE_SIZE)
+#define HEAP_GROW_PAGES 16      /* map at least 64KB per growth step */
+#define SLAB_MIN_SIZE   16
+#define SLAB_MAX_SIZE   4096
+#define SLAB_CLASSES    9       /* 16, 32, 64, ... 4096 */
 
 namespace toast {
 namespace mem {
@@ -4,6 +4,11 @@
 #include "stdio.hpp"
 #include "time.hpp"
 #include "string.hpp"
+#include "panic.hpp"
+#include "thread.hpp"
+#include "workqueue.hpp"
+#include "spsc_ring.hpp"
+#include "async.hpp"
 
 /*
  * toastOS Network Driver  -  RTL8139-based
@@ -61,6 +66,7 @@ static inline uint32_t ntohl(uint32_t v) { return htonl(v); }
 /* ===== Static state ===== */
 
 static uint16_t nic_iobase = 0;
+static uint8_t  nic_irq = 0xFF;         /* PCI interrupt line, 0xFF = none */
 static int      nic_initialized = 0;
 
 static uint8_t our_mac[6];
@@ -78,6 +84,21 @@ static uint8_t  gateway_mac_known = 0;
 static uint8_t rx_buffer[RX_BUF_SIZE + 1536 + 16] __attribute__((aligned(4)));
 static uint16_t rx_read_ptr = 0;
 
+/* Frames the NIC bottom half has already taken off the ring. With an IRQ
+   line the bottom half is the only reader of the NIC ring and the only
+   producer here; net_recv is the only consumer, so no lock is needed.
+   Without one, net_recv reads the NIC ring itself and the backlog stays
+   empty. */
+struct rx_frame_t {
+    uint16_t len;
+    uint8_t  data[1536];
+};
+static toast::spsc_ring<rx_frame_t, RX_BACKLOG> rx_backlog;
+static semaphore_t rx_ready = SEMAPHORE_INIT(0);   /* posted per frame queued */
+static async_event_t rx_event = ASYNC_EVENT_INIT;  /* signalled per frame queued */
+static int         nic_irq_live = 0;
+static work_t      nic_work;
+
 static uint8_t tx_buffers[NUM_TX_DESC][TX_BUF_SIZE] __attribute__((aligned(4)));
 static int     tx_cur = 0;
 
@@ -118,6 +139,7 @@ static int pci_find_rtl8139(void) {
         if (vendor == RTL8139_VENDOR_ID && device == RTL8139_DEVICE_ID) {
             uint32_t bar0 = pci_read(0, dev, 0, 0x10);
             nic_iobase = (uint16_t)(bar0 & 0xFFFC);
+            nic_irq = (uint8_t)(pci_read(0, dev, 0, 0x3C) & 0xFF);
 
             /* Enable PCI bus mastering so the NIC can DMA */
             uint32_t cmd = pci_read(0, dev, 0, 0x04);
@@ -176,13 +198,18 @@ static void ip_print(uint32_t ip_net) {
     print_num( h        & 0xFF);
 }
 
+/* Pause between polls of the receive ring */
 static void net_delay_short(void) {
     for (volatile int i = 0; i < 5000; i++) inb(0x80);
 }
 
-static void net_delay_ms(void) {
-    for (volatile int i = 0; i < 20000; i++) inb(0x80);
-}
+/* Timeouts are in milliseconds against toast::time::ms() */
+#define ARP_TIMEOUT_MS      1000    /* per request, 3 tries */
+#define DNS_TIMEOUT_MS      2000    /* per query, 3 tries */
+#define PING_TIMEOUT_MS     2000    /* per echo request, 3 tries */
+#define TCP_CONNECT_MS      3000    /* SYN -> SYN-ACK */
+#define TCP_POLL_MS         50      /* one receive attempt */
+#define TCP_IDLE_MS         5000    /* give up after this long without data */
 
 /* ===== Transmit ===== */
 
@@ -208,10 +235,12 @@ static void net_send(const void *data, uint16_t len) {
 
 /* ===== Receive ===== */
 
-static int net_recv(uint8_t *out_buf, uint16_t max_len) {
+/* Take one frame off the NIC's ring; 0 if it is empty or the frame was bad.
+   Called from the bottom half when IRQs are live, else from net_recv. */
+static int nic_rx_frame(uint8_t *out_buf, uint16_t max_len) {
     /* Check BUFE (buffer empty) in the command register */
     uint8_t cmd = nic_read8(REG_CMD);
-    if (cmd & 0x01)
+    if (cmd & CMD_BUFE)
         return 0;
 
     uint16_t offset = rx_read_ptr % RX_BUF_SIZE;
@@ -247,6 +276,76 @@ static int net_recv(uint8_t *out_buf, uint16_t max_len) {
     return (int)pkt_len;
 }
 
+/* Next received frame, 0 if nothing is waiting */
+static int net_recv(uint8_t *out_buf, uint16_t max_len) {
+    if (!nic_irq_live)
+        return nic_rx_frame(out_buf, max_len);
+
+    rx_frame_t *f = rx_backlog.peek();
+    if (!f)
+        return 0;
+    int len = f->len < max_len ? f->len : max_len;
+    for (int i = 0; i < len; i++)
+        out_buf[i] = f->data[i];
+    bool was_full = rx_backlog.full();
+    rx_backlog.release();
+
+    /* the bottom half stops when the backlog fills; restart it */
+    if (was_full && !(nic_read8(REG_CMD) & CMD_BUFE))
+        toast::work::queue(&nic_work);
+    return len;
+}
+
+/* Next received frame, or 0 once deadline passes. Sleeps on rx_ready when
+   the NIC has an IRQ line, otherwise polls the ring. */
+static int net_recv_wait(uint8_t *out_buf, uint16_t max_len, uint32_t deadline) {
+    for (;;) {
+        int len = net_recv(out_buf, max_len);
+        if (len > 0 || toast::time::reached(deadline))
+            return len;
+        if (!nic_irq_live) {
+            net_delay_short();
+            return 0;
+        }
+        if (toast::thread::sem::timedwait(&rx_ready, deadline - toast::time::ms()) < 0)
+            return 0;
+    }
+}
+
+/* Something for net_recv, without taking it */
+static int net_rx_pending(void) {
+    if (!nic_irq_live)
+        return !(nic_read8(REG_CMD) & CMD_BUFE);
+    return rx_backlog.peek() != 0;
+}
+
+/* Bottom half: copy frames straight into backlog slots before the NIC's
+   ring can overflow */
+static void nic_rx_work(void *arg) {
+    (void)arg;
+    while (!(nic_read8(REG_CMD) & CMD_BUFE)) {
+        rx_frame_t *f = rx_backlog.reserve();
+        if (!f)
+            break;      /* backlog full; net_recv requeues us */
+        int len = nic_rx_frame(f->data, sizeof(f->data));
+        if (len <= 0)
+            break;      /* bad frame; leave the rest to the next IRQ */
+        f->len = (uint16_t)len;
+        rx_backlog.commit();
+        toast::thread::sem::post(&rx_ready);
+        toast::async::signal(&rx_event);
+    }
+}
+
+/* Top half: ack the NIC so its line drops, and defer the copying */
+static void nic_irq_handler(void) {
+    uint16_t isr = nic_read16(REG_ISR);
+    if (!isr) return;
+    nic_write16(REG_ISR, isr);
+    if (isr & (ISR_ROK | ISR_RXOVW | ISR_FOVW))
+        toast::work::queue(&nic_work);
+}
+
 /* ===== ARP ===== */
 
 static void net_send_arp_request(uint32_t target_ip_net) {
@@ -271,35 +370,68 @@ static void net_send_arp_request(uint32_t target_ip_net) {
     net_send(frame, sizeof(frame));
 }
 
-static int net_arp_resolve(uint32_t target_ip_net) {
-    static uint8_t pkt[1536];
+/* Return to kasync until a frame is waiting or deadline passes. Without
+   an IRQ line nothing signals rx_event, so poll each tick instead. */
+#define NET_AWAIT_RX(t, deadline) \
+    do { toast::async::wake_at(t, nic_irq_live ? (deadline) : toast::time::ms() + 1); \
+         ASYNC_AWAIT_EVENT(t, &rx_event, net_rx_pending() || !toast::time::timer::pending(&(t)->timer)); } while (0)
+
+/* ARP resolution as a kasync task: a request, then whatever frames come
+   in until a reply or ARP_TIMEOUT_MS, three times over */
+struct arp_task_t {
+    async_task_t task;
+    uint32_t     target_ip_net;
+    uint32_t     deadline;
+    int          retry;
+};
+
+static int arp_is_reply(const uint8_t *pkt, int len, uint32_t target_ip_net) {
+    if (len < (int)(ETH_HEADER_SIZE + sizeof(arp_header_t)))
+        return 0;
+    const eth_header_t *eth = (const eth_header_t *)pkt;
+    if (ntohs(eth->type) != ETH_TYPE_ARP)
+        return 0;
+    const arp_header_t *a = (const arp_header_t *)(pkt + ETH_HEADER_SIZE);
+    return ntohs(a->opcode) == ARP_REPLY && a->sender_ip == target_ip_net;
+}
 
-    for (int retry = 0; retry < 3; retry++) {
-        net_send_arp_request(target_ip_net);
-
-        for (int attempt = 0; attempt < 500; attempt++) {
-            int len = net_recv(pkt, sizeof(pkt));
-            if (len >= (int)(ETH_HEADER_SIZE + sizeof(arp_header_t))) {
-                eth_header_t *eth = (eth_header_t *)pkt;
-                if (ntohs(eth->type) == ETH_TYPE_ARP) {
-                    arp_header_t *a = (arp_header_t *)(pkt + ETH_HEADER_SIZE);
-                    if (ntohs(a->opcode) == ARP_REPLY &&
-                        a->sender_ip == target_ip_net) {
-                        for (int i = 0; i < 6; i++)
-                            gateway_mac[i] = a->sender_mac[i];
-                        gateway_mac_known = 1;
-                        return 0;
-                    }
+static int arp_step(async_task_t *t) {
+    static uint8_t pkt[1536];
+    arp_task_t *a = (arp_task_t *)t;
+
+    ASYNC_BEGIN(t);
+    for (a->retry = 0; a->retry < 3; a->retry++) {
+        net_send_arp_request(a->target_ip_net);
+        a->deadline = toast::time::ms() + ARP_TIMEOUT_MS;
+        while (!toast::time::reached(a->deadline)) {
+            NET_AWAIT_RX(t, a->deadline);
+
+            int len;
+            while ((len = net_recv(pkt, sizeof(pkt))) > 0) {
+                if (arp_is_reply(pkt, len, a->target_ip_net)) {
+                    arp_header_t *r = (arp_header_t *)(pkt + ETH_HEADER_SIZE);
+                    for (int i = 0; i < 6; i++)
+                        gateway_mac[i] = r->sender_mac[i];
+                    gateway_mac_known = 1;
+                    ASYNC_RETURN(t, 0);
                 }
             }
-            net_delay_ms();
         }
     }
-    return -1;
+    ASYNC_RETURN(t, -1);
+    ASYNC_END(t);
+}
+
+static int net_arp_resolve(uint32_t target_ip_net) {
+    arp_task_t a;
+    a.target_ip_net = target_ip_net;
+    return toast::async::run(&a.task, arp_step);
 }
 
 /* ===== IP send ===== */
 
+/* Resolves the gateway first if need be, which blocks: a task must have
+   done that itself before it sends (see dns_step) */
 static void net_send_ip(uint32_t dest_ip_net, uint8_t protocol,
                          const void *payload, uint16_t payload_len) {
     if (!gateway_mac_known) {
@@ -365,8 +497,114 @@ static void net_send_udp(uint32_t dest_ip_net, uint16_t src_port,
 
 /* ===== DNS resolver ===== */
 
+/* A lookup as a kasync task: the gateway's MAC if it is not known yet,
+   then the query and whatever frames come in until the answer or
+   DNS_TIMEOUT_MS, three times over */
+struct dns_task_t {
+    async_task_t task;
+    arp_task_t   arp;
+    uint8_t      query[512];
+    uint16_t     query_len;
+    uint16_t     txid;
+    uint32_t     deadline;
+    uint32_t     ip;
+    int          retry;
+};
+
+/* -1 if pkt is not the reply to txid. Otherwise 0 with *ip the first A
+   record, or 0 if the reply has none. */
+static int dns_parse_reply(const uint8_t *pkt, int len, uint16_t txid, uint32_t *ip) {
+    if (len <= (int)(ETH_HEADER_SIZE + 20 + 8 + 12))
+        return -1;
+    const ip_header_t *iph = (const ip_header_t *)(pkt + ETH_HEADER_SIZE);
+    if (iph->protocol != IP_PROTO_UDP)
+        return -1;
+
+    int udp_off = ETH_HEADER_SIZE + 20;
+    uint16_t sport = (uint16_t)((pkt[udp_off] << 8) | pkt[udp_off + 1]);
+    if (sport != 53) return -1;
+
+    int dns_off = udp_off + 8;
+    int dns_len = len - dns_off;
+    if (dns_len < 12) return -1;
+
+    const uint8_t *dns = pkt + dns_off;
+    uint16_t rid = (uint16_t)((dns[0] << 8) | dns[1]);
+    if (rid != txid) return -1;
+
+    *ip = 0;
+    uint16_t ancount = (uint16_t)((dns[6] << 8) | dns[7]);
+    if (ancount == 0) return 0;
+
+    /* Skip question section */
+    int off = 12;
+    while (off < dns_len && dns[off] != 0) {
+        if ((dns[off] & 0xC0) == 0xC0) { off += 2; goto qname_done; }
+        off += dns[off] + 1;
+    }
+    off++; /* skip 0 terminator */
+    qname_done:
+    off += 4; /* QTYPE + QCLASS */
+
+    /* Scan answers for type A */
+    for (int a = 0; a < ancount && off + 10 <= dns_len; a++) {
+        if ((dns[off] & 0xC0) == 0xC0) {
+            off += 2;
+        } else {
+            while (off < dns_len && dns[off] != 0) off += dns[off] + 1;
+            off++;
+        }
+        if (off + 10 > dns_len) break;
+        uint16_t rtype = (uint16_t)((dns[off] << 8) | dns[off+1]);
+        uint16_t rdlen = (uint16_t)((dns[off+8] << 8) | dns[off+9]);
+        off += 10;
+        if (rtype == 1 && rdlen == 4 && off + 4 <= dns_len) {
+            uint8_t *rp = (uint8_t *)ip;
+            rp[0] = dns[off];
+            rp[1] = dns[off+1];
+            rp[2] = dns[off+2];
+            rp[3] = dns[off+3];
+            return 0; /* already network order */
+        }
+        off += rdlen;
+    }
+    return 0;
+}
+
+static int dns_step(async_task_t *t) {
+    static uint8_t pkt[1536];
+    dns_task_t *d = (dns_task_t *)t;
+
+    ASYNC_BEGIN(t);
+    /* net_send_ip would block on ARP; the worker must not */
+    if (!gateway_mac_known) {
+        d->arp.target_ip_net = gateway_ip;
+        toast::async::start(&d->arp.task, arp_step);
+        ASYNC_AWAIT_TASK(t, &d->arp.task);
+        if (d->arp.task.result < 0)
+            ASYNC_RETURN(t, -1);
+    }
+
+    for (d->retry = 0; d->retry < 3; d->retry++) {
+        net_send_udp(dns_ip, 1053, 53, d->query, d->query_len);
+        d->deadline = toast::time::ms() + DNS_TIMEOUT_MS;
+        while (!toast::time::reached(d->deadline)) {
+            NET_AWAIT_RX(t, d->deadline);
+
+            int len;
+            while ((len = net_recv(pkt, sizeof(pkt))) > 0) {
+                if (dns_parse_reply(pkt, len, d->txid, &d->ip) == 0)
+                    ASYNC_RETURN(t, 0);
+            }
+        }
+    }
+    ASYNC_RETURN(t, -1);
+    ASYNC_END(t);
+}
+
 static uint32_t dns_resolve(const char *hostname) {
-    static uint8_t dns_pkt[512];
+    dns_task_t d;
+    uint8_t *dns_pkt = d.query;
     int pos = 0;
 
     uint16_t txid = ip_id_counter++;
@@ -404,71 +642,12 @@ static uint32_t dns_resolve(const char *hostname) {
     dns_pkt[pos++] = 0x00; /* QCLASS = IN (1) */
     dns_pkt[pos++] = 0x01;
 
-    static uint8_t pkt[1536];
-
-    for (int retry = 0; retry < 3; retry++) {
-        net_send_udp(dns_ip, 1053, 53, dns_pkt, (uint16_t)pos);
-
-        for (int attempt = 0; attempt < 1500; attempt++) {
-            int len = net_recv(pkt, sizeof(pkt));
-            if (len > (int)(ETH_HEADER_SIZE + 20 + 8 + 12)) {
-                ip_header_t *ip = (ip_header_t *)(pkt + ETH_HEADER_SIZE);
-                if (ip->protocol == IP_PROTO_UDP) {
-                    int udp_off = ETH_HEADER_SIZE + 20;
-                    uint16_t sport = (uint16_t)((pkt[udp_off] << 8) | pkt[udp_off + 1]);
-                    if (sport != 53) { net_delay_short(); continue; }
-
-                    int dns_off = udp_off + 8;
-                    int dns_len = len - dns_off;
-                    if (dns_len < 12) { net_delay_short(); continue; }
-
-                    uint8_t *dns = pkt + dns_off;
-                    uint16_t rid = (uint16_t)((dns[0] << 8) | dns[1]);
-                    if (rid != txid) { net_delay_short(); continue; }
-
-                    uint16_t ancount = (uint16_t)((dns[6] << 8) | dns[7]);
-                    if (ancount == 0) return 0;
-
-                    /* Skip question section */
-                    int off = 12;
-                    while (off < dns_len && dns[off] != 0) {
-                        if ((dns[off] & 0xC0) == 0xC0) { off += 2; goto qname_done; }
-                        off += dns[off] + 1;
-                    }
-                    off++; /* skip 0 terminator */
-                    qname_done:
-                    off += 4; /* QTYPE + QCLASS */
-
-                    /* Scan answers for type A */
-                    for (int a = 0; a < ancount && off + 10 <= dns_len; a++) {
-                        if ((dns[off] & 0xC0) == 0xC0) {
-                            off += 2;
-                        } else {
-                            while (off < dns_len && dns[off] != 0) off += dns[off] + 1;
-                            off++;
-                        }
-                        if (off + 10 > dns_len) break;
-                        uint16_t rtype = (uint16_t)((dns[off] << 8) | dns[off+1]);
-                        uint16_t rdlen = (uint16_t)((dns[off+8] << 8) | dns[off+9]);
-                        off += 10;
-                        if (rtype == 1 && rdlen == 4 && off + 4 <= dns_len) {
-                            uint32_t resolved;
-                            uint8_t *rp = (uint8_t *)&resolved;
-                            rp[0] = dns[off];
-                            rp[1] = dns[off+1];
-                            rp[2] = dns[off+2];
-                            rp[3] = dns[off+3];
-                            return resolved; /* already network order */
-                        }
-                        off += rdlen;
-                    }
-                    return 0;
-                }
-            }
-            net_delay_ms();
-        }
-    }
-    return 0;
+    d.query_len = (uint16_t)pos;
+    d.txid = txid;
+    d.ip = 0;
+    if (toast::async::run(&d.task, dns_step) < 0)
+        return 0;
+    return d.ip;
 }
 
 /* Check if string is a dotted IP address */
@@ -520,7 +699,7 @@ int net_ping(const char *host_str) {
     kprint(" ...");
     kprint_newline();
 
-    uint32_t start_tick = get_uptime_seconds();
+    uint32_t start_ms = toast::time::ms();
 
     icmp_header_t icmp;
     icmp.type     = ICMP_ECHO_REQUEST;
@@ -535,27 +714,27 @@ int net_ping(const char *host_str) {
     for (int retry = 0; retry < 3; retry++) {
         net_send_ip(target, IP_PROTO_ICMP, &icmp, sizeof(icmp));
 
-        for (int attempt = 0; attempt < 1500; attempt++) {
-            int len = net_recv(pkt, sizeof(pkt));
+        uint32_t deadline = toast::time::ms() + PING_TIMEOUT_MS;
+        while (!toast::time::reached(deadline)) {
+            int len = net_recv_wait(pkt, sizeof(pkt), deadline);
             if (len > (int)(ETH_HEADER_SIZE + 20 + (int)sizeof(icmp_header_t))) {
                 ip_header_t *ip = (ip_header_t *)(pkt + ETH_HEADER_SIZE);
                 if (ip->protocol == IP_PROTO_ICMP) {
                     int ip_hdr_len = (ip->ver_ihl & 0x0F) * 4;
                     icmp_header_t *reply = (icmp_header_t *)(pkt + ETH_HEADER_SIZE + ip_hdr_len);
                     if (reply->type == ICMP_ECHO_REPLY) {
-                        uint32_t elapsed = get_uptime_seconds() - start_tick;
+                        uint32_t elapsed = toast::time::ms() - start_ms;
                         kprint("Reply from ");
                         ip_print(target);
                         kprint(" - host is up! (");
-                        if (elapsed == 0) kprint("<1s");
-                        else { print_num(elapsed); kprint("s"); }
+                        if (elapsed == 0) kprint("<1ms");
+                        else { print_num(elapsed); kprint("ms"); }
                         kprint(")");
                         kprint_newline();
                         return 0;
                     }
                 }
             }
-            net_delay_ms();
         }
     }
 
@@ -634,49 +813,93 @@ static void net_send_tcp(uint32_t dest_ip_net, uint16_t src_port, uint16_t dst_p
 }
 
 /*
- * Wait for a TCP packet from dest_ip on the given ports.
+ * Wait for a TCP packet from dest_ip on the given ports, as a kasync task.
  * Fills *out_seq, *out_ack, *out_flags with the received TCP header values.
- * Returns payload length, or -1 on timeout.
+ * Returns payload length, or -1 if nothing arrived within timeout_ms.
  * If payload_buf is non-NULL, copies payload data into it.
  */
-static int tcp_recv(uint32_t dest_ip_net, uint16_t local_port, uint16_t remote_port,
-                     uint32_t *out_seq, uint32_t *out_ack, uint8_t *out_flags,
-                     uint8_t *payload_buf, uint16_t payload_max, int timeout_iters) {
+struct tcp_recv_task_t {
+    async_task_t task;
+    uint32_t     dest_ip_net;
+    uint16_t     local_port;
+    uint16_t     remote_port;
+    uint32_t     seq;
+    uint32_t     ack;
+    uint8_t      flags;
+    uint8_t     *payload_buf;
+    uint16_t     payload_max;
+    uint32_t     deadline;
+};
+
+/* Payload length if pkt belongs to r's connection, else -1 */
+static int tcp_match(const uint8_t *pkt, int len, tcp_recv_task_t *r) {
+    if (len <= (int)(ETH_HEADER_SIZE + 20 + 20))
+        return -1;
+    const ip_header_t *ip = (const ip_header_t *)(pkt + ETH_HEADER_SIZE);
+    if (ip->protocol != IP_PROTO_TCP || ip->src_ip != r->dest_ip_net)
+        return -1;
+    int ip_hdr_len = (ip->ver_ihl & 0x0F) * 4;
+    const tcp_header_t *tcp = (const tcp_header_t *)(pkt + ETH_HEADER_SIZE + ip_hdr_len);
+    if (ntohs(tcp->src_port) != r->remote_port ||
+        ntohs(tcp->dst_port) != r->local_port)
+        return -1;
+
+    r->seq   = ntohl(tcp->seq_num);
+    r->ack   = ntohl(tcp->ack_num);
+    r->flags = tcp->flags;
+
+    int tcp_hdr = ((tcp->data_off >> 4) & 0x0F) * 4;
+    int ip_total = ntohs(ip->total_len);
+    int payload_len = ip_total - ip_hdr_len - tcp_hdr;
+    if (payload_len < 0) payload_len = 0;
+
+    if (r->payload_buf && payload_len > 0) {
+        int copy = payload_len;
+        if (copy > r->payload_max) copy = r->payload_max;
+        const uint8_t *src = pkt + ETH_HEADER_SIZE + ip_hdr_len + tcp_hdr;
+        for (int i = 0; i < copy; i++)
+            r->payload_buf[i] = src[i];
+    }
+    return payload_len;
+}
+
+static int tcp_recv_step(async_task_t *t) {
     static uint8_t pkt[1536];
+    tcp_recv_task_t *r = (tcp_recv_task_t *)t;
 
-    for (int attempt = 0; attempt < timeout_iters; attempt++) {
-        int len = net_recv(pkt, sizeof(pkt));
-        if (len > (int)(ETH_HEADER_SIZE + 20 + 20)) {
-            ip_header_t *ip = (ip_header_t *)(pkt + ETH_HEADER_SIZE);
-            if (ip->protocol == IP_PROTO_TCP && ip->src_ip == dest_ip_net) {
-                int ip_hdr_len = (ip->ver_ihl & 0x0F) * 4;
-                tcp_header_t *tcp = (tcp_header_t *)(pkt + ETH_HEADER_SIZE + ip_hdr_len);
-
-                if (ntohs(tcp->src_port) == remote_port &&
-                    ntohs(tcp->dst_port) == local_port) {
-                    *out_seq   = ntohl(tcp->seq_num);
-                    *out_ack   = ntohl(tcp->ack_num);
-                    *out_flags = tcp->flags;
-
-                    int tcp_hdr = ((tcp->data_off >> 4) & 0x0F) * 4;
-                    int ip_total = ntohs(ip->total_len);
-                    int payload_len = ip_total - ip_hdr_len - tcp_hdr;
-                    if (payload_len < 0) payload_len = 0;
-
-                    if (payload_buf && payload_len > 0) {
-                        int copy = payload_len;
-                        if (copy > payload_max) copy = payload_max;
-                        uint8_t *src = pkt + ETH_HEADER_SIZE + ip_hdr_len + tcp_hdr;
-                        for (int i = 0; i < copy; i++)
-                            payload_buf[i] = src[i];
-                    }
-                    return payload_len;
-                }
-            }
+    ASYNC_BEGIN(t);
+    while (!toast::time::reached(r->deadline)) {
+        NET_AWAIT_RX(t, r->deadline);
+
+        int len;
+        while ((len = net_recv(pkt, sizeof(pkt))) > 0) {
+            int n = tcp_match(pkt, len, r);
+            if (n >= 0)
+                ASYNC_RETURN(t, n);
         }
-        net_delay_short();
     }
-    return -1;
+    ASYNC_RETURN(t, -1);
+    ASYNC_END(t);
+}
+
+static int tcp_recv(uint32_t dest_ip_net, uint16_t local_port, uint16_t remote_port,
+                     uint32_t *out_seq, uint32_t *out_ack, uint8_t *out_flags,
+                     uint8_t *payload_buf, uint16_t payload_max, uint32_t timeout_ms) {
+    tcp_recv_task_t r;
+    r.dest_ip_net = dest_ip_net;
+    r.local_port  = local_port;
+    r.remote_port = remote_port;
+    r.payload_buf = payload_buf;
+    r.payload_max = payload_max;
+    r.deadline    = toast::time::ms() + timeout_ms;
+
+    int n = toast::async::run(&r.task, tcp_recv_step);
+    if (n >= 0) {
+        *out_seq   = r.seq;
+        *out_ack   = r.ack;
+        *out_flags = r.flags;
+    }
+    return n;
 }
 
 /* ===== HTTP GET (over TCP) ===== */
@@ -705,7 +928,7 @@ int net_http_get(const char *host_str, const char *path) {
     net_send_tcp(target, lport, 80, our_seq, 0, TCP_SYN, 0, 0);
 
     /* 2. Wait for SYN-ACK */
-    int r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags, 0, 0, 3000);
+    int r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags, 0, 0, TCP_CONNECT_MS);
     if (r < 0 || !(flags & TCP_SYN) || !(flags & TCP_ACK)) {
         kprint("[net] TCP handshake failed (no SYN-ACK).");
         kprint_newline();
@@ -748,9 +971,12 @@ int net_http_get(const char *host_str, const char *path) {
     int done = 0;
     int past_headers = 0;
 
-    for (int wait = 0; wait < 8000 && !done; wait++) {
+    uint32_t idle_until = toast::time::ms() + TCP_IDLE_MS;
+    while (!done && !toast::time::reached(idle_until)) {
         r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags,
-                     data_buf, sizeof(data_buf), 50);
+                     data_buf, sizeof(data_buf), TCP_POLL_MS);
+        if (r >= 0)
+            idle_until = toast::time::ms() + TCP_IDLE_MS;
         if (r > 0) {
             /* ACK the received data */
             next_ack = srv_seq + (uint32_t)r;
@@ -1154,7 +1380,7 @@ int net_browse(const char *url) {
     /* === TCP 3-way handshake === */
     net_send_tcp(target, lport, 80, our_seq, 0, TCP_SYN, 0, 0);
 
-    int r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags, 0, 0, 3000);
+    int r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags, 0, 0, TCP_CONNECT_MS);
     if (r < 0 || !(flags & TCP_SYN) || !(flags & TCP_ACK)) {
         toast_shell_color("[browse] connection failed.", LIGHT_RED);
         kprint_newline();
@@ -1197,9 +1423,12 @@ int net_browse(const char *url) {
     toast_shell_color("----------------------------------------", DARK_GREY);
     kprint_newline();
 
-    for (int wait = 0; wait < 8000 && !done; wait++) {
+    uint32_t idle_until = toast::time::ms() + TCP_IDLE_MS;
+    while (!done && !toast::time::reached(idle_until)) {
         r = tcp_recv(target, lport, 80, &srv_seq, &srv_ack, &flags,
-                     data_buf, sizeof(data_buf), 50);
+                     data_buf, sizeof(data_buf), TCP_POLL_MS);
+        if (r >= 0)
+            idle_until = toast::time::ms() + TCP_IDLE_MS;
         if (r > 0) {
             next_ack = srv_seq + (uint32_t)r;
             if (flags & TCP_FIN) next_ack++;
@@ -1331,9 +1560,16 @@ int net_init(void) {
     /* Enable TX + RX */
     nic_write8(REG_CMD, CMD_RX_ENABLE | CMD_TX_ENABLE);
 
-    /* Enable all interrupts for polling */
-    nic_write16(REG_IMR, 0xFFFF);
+    /* Receive events raise the PCI line when we have one, else stay polled */
     nic_write16(REG_ISR, 0xFFFF);
+    toast::work::setup(&nic_work, nic_rx_work, 0);
+    rx_backlog.reset();
+    toast::thread::sem::init(&rx_ready, 0);
+    nic_irq_live = nic_irq < 16 && toast::sys::irq_install(nic_irq, nic_irq_handler) == 0;
+    if (nic_irq_live)
+        nic_write16(REG_IMR, ISR_ROK | ISR_RER | ISR_RXOVW | ISR_FOVW);
+    else
+        nic_write16(REG_IMR, 0);
 
     /* IP addresses (QEMU user-mode defaults) */
     our_ip     = ip_parse("10.0.2.15");
@@ -25,6 +25,14 @@
 #define REG_RX_CONFIG      0x44
 #define REG_CONFIG1        0x52
 
+#define ISR_ROK            0x0001      /* frame received */
+#define ISR_RER            0x0002      /* receive error */
+#define ISR_TOK            0x0004
+#define ISR_TER            0x0008
+#define ISR_RXOVW          0x0010      /* receive ring overflowed */
+#define ISR_FOVW           0x0040      /* receive FIFO overflowed */
+
+#define CMD_BUFE           0x01        /* receive ring empty */
 #define CMD_RX_ENABLE      0x08
 #define CMD_TX_ENABLE      0x04
 #define CMD_RESET          0x10
@@ -36,6 +44,7 @@
 #define RX_CFG_WRAP        (1 << 7)
 
 #define RX_BUF_SIZE        8192
+#define RX_BACKLOG         16          /* frames pulled off the ring by the IRQ bottom half */
 #define TX_BUF_SIZE        1536
 #define NUM_TX_DESC        4
 
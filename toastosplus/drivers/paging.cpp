@@ -1,18 +1,84 @@
 /* toastOS Paging - Virtual Memory Management */
 
 #include "paging.hpp"
-#include "mmu.hpp"
 #include "kio.hpp"
+#include "funcs.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 /* ---- Physical frame bitmap ---- */
-static uint32_t frame_bitmap[MAX_PHYS_FRAMES / 32];  /* 1 bit per frame */
+static uint32_t frame_bitmap[MAX_PHYS_FRAMES / 32];  /* 1 bit per frame, 1 = in use */
 static uint32_t total_frames = 0;
+static uint32_t free_frames = 0;
+
+/*
+ * ---- Buddy free maps ----
+ * One bitmap per order; bit n of order k set means the block of 2^k frames
+ * starting at frame n << k is free. The maps for all orders share one
+ * array, order k starting at buddy_off[k] words. buddy_hint[k] is a word
+ * index with no free block below it, so searches skip the used low end.
+ */
+static uint32_t buddy_map[2 * MAX_PHYS_FRAMES / 32];
+static uint32_t buddy_off[FRAME_MAX_ORDER + 1];
+static uint32_t buddy_words[FRAME_MAX_ORDER + 1];
+static uint32_t buddy_hint[FRAME_MAX_ORDER + 1];
+static uint32_t buddy_free[FRAME_MAX_ORDER + 1];
 
 /* ---- Page directory and tables (must be 4KB-aligned) ---- */
 static uint32_t page_directory[1024] __attribute__((aligned(4096)));
 static uint32_t page_table_0[1024]   __attribute__((aligned(4096)));  /* 0x000000 - 0x3FFFFF */
 static uint32_t page_table_1[1024]   __attribute__((aligned(4096)));  /* 0x400000 - 0x7FFFFF */
 
+/* Present entries per page table, so unmap knows when a table is empty */
+static uint16_t pt_used[1024];
+
+/* ---- Kernel virtual areas (sorted by address, free and used) ---- */
+struct vm_area {
+    uint32_t start;
+    uint32_t pages;
+    uint8_t  used;
+    uint8_t  owns_frames;   /* 1 = vmalloc, frames freed on vfree */
+};
+static vm_area vm_areas[VM_MAX_AREAS];
+static int vm_count = 0;
+
+/* Set once PAT slot 1 has been switched to write-combining */
+static int pat_wc = 0;
+
+/* Set when CR4.PSE is on and 4MB directory entries can be used */
+static int pse_on = 0;
+
+/* ---- Lazily backed regions ---- */
+struct lazy_region {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+    lazy_check_t check;
+};
+static lazy_region lazy_regions[MAX_LAZY_REGIONS];
+static uint32_t lazy_count = 0;
+
+/* ---- Usable RAM regions ---- */
+static mem_region_t mem_regions[MAX_MEM_REGIONS];
+static uint32_t region_count = 0;
+
+/*
+ * ---- Locks ----
+ * frame_lock covers the frame bitmap and buddy maps and takes no other
+ * lock. paging_lock covers the page tables, vm areas and lazy regions.
+ * Kernel stacks are never lazy, so nothing faults while holding it.
+ */
+static spinlock_t frame_lock = SPINLOCK_INIT;
+static spinlock_t paging_lock = SPINLOCK_INIT;
+
+static uint32_t paging_lock_take(void) {
+    return toast::spin::lock_irqsave(&paging_lock);
+}
+
+static void paging_lock_drop(uint32_t flags) {
+    toast::spin::unlock_irqrestore(&paging_lock, flags);
+}
+
 /* ---- Frame bitmap helpers ---- */
 static void frame_set(uint32_t frame_idx) {
     frame_bitmap[frame_idx / 32] |= (1U << (frame_idx % 32));
@@ -26,23 +92,119 @@ static int frame_test(uint32_t frame_idx) {
     return (frame_bitmap[frame_idx / 32] >> (frame_idx % 32)) & 1;
 }
 
-/* Allocate a free physical frame */
-uint32_t frame_alloc(void) {
-    for (uint32_t i = 0; i < total_frames; i++) {
-        if (!frame_test(i)) {
-            frame_set(i);
-            return i * PAGE_SIZE;
+/* ---- Buddy helpers ---- */
+static int buddy_test(uint32_t order, uint32_t block) {
+    return (buddy_map[buddy_off[order] + block / 32] >> (block % 32)) & 1;
+}
+
+static void buddy_set(uint32_t order, uint32_t block) {
+    buddy_map[buddy_off[order] + block / 32] |= (1U << (block % 32));
+    if (block / 32 < buddy_hint[order])
+        buddy_hint[order] = block / 32;
+    buddy_free[order]++;
+}
+
+static void buddy_clear(uint32_t order, uint32_t block) {
+    buddy_map[buddy_off[order] + block / 32] &= ~(1U << (block % 32));
+    buddy_free[order]--;
+}
+
+/* Lowest free block of an order, or -1 */
+static int32_t buddy_find(uint32_t order) {
+    uint32_t *map = &buddy_map[buddy_off[order]];
+    for (uint32_t w = buddy_hint[order]; w < buddy_words[order]; w++) {
+        if (map[w]) {
+            buddy_hint[order] = w;
+            return (int32_t)(w * 32 + __builtin_ctz(map[w]));
         }
     }
-    return 0; /* out of frames */
+    buddy_hint[order] = buddy_words[order];
+    return -1;
 }
 
-/* Free a physical frame */
-void frame_free(uint32_t phys_addr) {
+/* Put a block on the free maps, merging it with free buddies */
+static void buddy_insert(uint32_t idx, uint32_t order) {
+    while (order < FRAME_MAX_ORDER) {
+        uint32_t buddy = idx ^ (1U << order);
+        if ((buddy >> order) >= (total_frames >> order) || !buddy_test(order, buddy >> order))
+            break;
+        buddy_clear(order, buddy >> order);
+        idx &= ~(1U << order);
+        order++;
+    }
+    buddy_set(order, idx >> order);
+}
+
+/* Take a block of 2^order frames, splitting a larger one if needed */
+static int32_t buddy_take(uint32_t order) {
+    for (uint32_t o = order; o <= FRAME_MAX_ORDER; o++) {
+        int32_t block = buddy_find(o);
+        if (block < 0)
+            continue;
+        buddy_clear(o, block);
+        uint32_t idx = (uint32_t)block << o;
+        /* Hand the upper halves back down until the block fits */
+        while (o > order) {
+            o--;
+            buddy_set(o, (idx >> o) + 1);
+        }
+        return (int32_t)idx;
+    }
+    return -1;
+}
+
+/* Allocate 2^order contiguous frames aligned to their size */
+uint32_t frame_alloc_contig(uint32_t order) {
+    if (order > FRAME_MAX_ORDER)
+        return 0;
+    uint32_t flags = toast::spin::lock_irqsave(&frame_lock);
+    int32_t idx = buddy_take(order);
+    if (idx >= 0) {
+        for (uint32_t i = 0; i < (1U << order); i++)
+            frame_set(idx + i);
+        free_frames -= 1U << order;
+    }
+    toast::spin::unlock_irqrestore(&frame_lock, flags);
+    if (idx < 0)
+        return 0; /* out of frames */
+    return (uint32_t)idx * PAGE_SIZE;
+}
+
+/* Free a block from frame_alloc_contig() */
+void frame_free_contig(uint32_t phys_addr, uint32_t order) {
     uint32_t idx = phys_addr / PAGE_SIZE;
-    if (idx < total_frames) {
-        frame_clear(idx);
+    uint32_t count = 1U << order;
+    if (order > FRAME_MAX_ORDER || (idx & (count - 1)) || idx + count > total_frames)
+        return;
+    uint32_t flags = toast::spin::lock_irqsave(&frame_lock);
+    int allocated = 1;
+    for (uint32_t i = 0; i < count && allocated; i++)
+        allocated = frame_test(idx + i); /* if not, ignore the double free */
+    if (allocated) {
+        for (uint32_t i = 0; i < count; i++)
+            frame_clear(idx + i);
+        free_frames += count;
+        buddy_insert(idx, order);
     }
+    toast::spin::unlock_irqrestore(&frame_lock, flags);
+}
+
+/* Allocate a free physical frame */
+uint32_t frame_alloc(void) {
+    return frame_alloc_contig(0);
+}
+
+/* Free a physical frame */
+void frame_free(uint32_t phys_addr) {
+    frame_free_contig(phys_addr, 0);
+}
+
+uint32_t frame_free_blocks(uint32_t order) {
+    return order <= FRAME_MAX_ORDER ? buddy_free[order] : 0;
+}
+
+uint32_t frame_free_count(void) {
+    return free_frames;
 }
 
 /* Flush a single TLB entry */
@@ -57,51 +219,515 @@ uint32_t paging_get_cr3(void) {
     return cr3;
 }
 
-/* Map a virtual address to a physical address */
-void paging_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+/* Page table for a directory slot, reached through the recursive slot */
+static uint32_t *pt_of(uint32_t pd_idx) {
+    return (uint32_t *)(PT_WINDOW + pd_idx * PAGE_SIZE);
+}
+
+/* ---- Page tables (paging_lock held) ---- */
+
+static int map_locked(uint32_t virt, uint32_t phys, uint32_t flags) {
     uint32_t pd_idx = virt >> 22;
     uint32_t pt_idx = (virt >> 12) & 0x3FF;
 
-    /* Check if page table exists for this directory entry */
+    if (pd_idx == PD_RECURSIVE || (page_directory[pd_idx] & PG_4MB))
+        return -1;
+
+    /* Allocate the page table for this directory entry on first use */
     if (!(page_directory[pd_idx] & PG_PRESENT)) {
-        /* We only support the two statically allocated page tables for now */
-        return;
+        uint32_t table = frame_alloc();
+        if (!table)
+            return -1;
+        page_directory[pd_idx] = table | PG_PRESENT | PG_WRITE | (flags & PG_USER);
+        paging_flush_tlb((uint32_t)pt_of(pd_idx));
+        uint32_t *pt = pt_of(pd_idx);
+        for (int i = 0; i < 1024; i++)
+            pt[i] = 0;
+        pt_used[pd_idx] = 0;
     }
 
-    /* Get the page table */
-    uint32_t *pt = (uint32_t *)(page_directory[pd_idx] & 0xFFFFF000);
+    uint32_t *pt = pt_of(pd_idx);
+    if (!(pt[pt_idx] & PG_PRESENT))
+        pt_used[pd_idx]++;
     pt[pt_idx] = (phys & 0xFFFFF000) | (flags & 0xFFF) | PG_PRESENT;
     paging_flush_tlb(virt);
+    return 0;
 }
 
-/* Unmap a virtual address */
-void paging_unmap(uint32_t virt) {
+/*
+ * Frames taken out of the page tables but not yet given back. Another CPU
+ * can still reach them through a stale TLB entry, so they are freed only
+ * after tlb_shootdown(). Big ranges go in several rounds of UNMAP_BATCH.
+ */
+#define UNMAP_BATCH 64
+struct unmap_batch {
+    uint32_t count;
+    uint32_t frames[UNMAP_BATCH];
+};
+
+/* Outside paging_lock: the shootdown waits for the other CPUs */
+static void unmap_finish(unmap_batch *b) {
+    toast::smp::tlb_shootdown();
+    for (uint32_t i = 0; i < b->count; i++)
+        frame_free(b->frames[i]);
+    b->count = 0;
+}
+
+/* With no batch, frames are freed at once; only for mappings no CPU has
+   used yet */
+static void unmap_locked(uint32_t virt, unmap_batch *b) {
     uint32_t pd_idx = virt >> 22;
     uint32_t pt_idx = (virt >> 12) & 0x3FF;
 
-    if (!(page_directory[pd_idx] & PG_PRESENT))
+    if (pd_idx == PD_RECURSIVE || !(page_directory[pd_idx] & PG_PRESENT))
+        return;
+
+    /* A 4MB page goes away as a whole */
+    if (page_directory[pd_idx] & PG_4MB) {
+        page_directory[pd_idx] = 0;
+        paging_flush_tlb(virt);
+        return;
+    }
+
+    uint32_t *pt = pt_of(pd_idx);
+    if (!(pt[pt_idx] & PG_PRESENT))
         return;
 
-    uint32_t *pt = (uint32_t *)(page_directory[pd_idx] & 0xFFFFF000);
     pt[pt_idx] = 0;
     paging_flush_tlb(virt);
+
+    /* Give empty tables back, except the two static boot tables */
+    if (--pt_used[pd_idx] == 0 && pd_idx > 1) {
+        uint32_t table = page_directory[pd_idx] & 0xFFFFF000;
+        page_directory[pd_idx] = 0;
+        paging_flush_tlb((uint32_t)pt_of(pd_idx));
+        if (b)
+            b->frames[b->count++] = table;
+        else
+            frame_free(table);
+    }
 }
 
-/* Get physical address for a virtual address */
-uint32_t paging_get_phys(uint32_t virt) {
+static uint32_t phys_locked(uint32_t virt) {
     uint32_t pd_idx = virt >> 22;
     uint32_t pt_idx = (virt >> 12) & 0x3FF;
 
-    if (!(page_directory[pd_idx] & PG_PRESENT))
+    if (pd_idx == PD_RECURSIVE || !(page_directory[pd_idx] & PG_PRESENT))
         return 0;
 
-    uint32_t *pt = (uint32_t *)(page_directory[pd_idx] & 0xFFFFF000);
+    if (page_directory[pd_idx] & PG_4MB)
+        return (page_directory[pd_idx] & 0xFFC00000) | (virt & (LARGE_PAGE_SIZE - 1));
+
+    uint32_t *pt = pt_of(pd_idx);
     if (!(pt[pt_idx] & PG_PRESENT))
         return 0;
 
     return (pt[pt_idx] & 0xFFFFF000) | (virt & 0xFFF);
 }
 
+/* Map a virtual address to a physical address */
+int paging_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t irq = paging_lock_take();
+    int r = map_locked(virt, phys, flags);
+    paging_lock_drop(irq);
+    return r;
+}
+
+/* Unmap a virtual address and shoot down the other CPUs' entries */
+void paging_unmap(uint32_t virt) {
+    unmap_batch batch;
+    batch.count = 0;
+    uint32_t irq = paging_lock_take();
+    unmap_locked(virt, &batch);
+    paging_lock_drop(irq);
+    unmap_finish(&batch);
+}
+
+/* Get physical address for a virtual address */
+uint32_t paging_get_phys(uint32_t virt) {
+    uint32_t irq = paging_lock_take();
+    uint32_t phys = phys_locked(virt);
+    paging_lock_drop(irq);
+    return phys;
+}
+
+/* ---- Kernel virtual areas ---- */
+
+static void vm_insert(int at, uint32_t start, uint32_t pages) {
+    for (int i = vm_count; i > at; i--)
+        vm_areas[i] = vm_areas[i - 1];
+    vm_areas[at].start = start;
+    vm_areas[at].pages = pages;
+    vm_areas[at].used = 0;
+    vm_areas[at].owns_frames = 0;
+    vm_count++;
+}
+
+static void vm_remove(int at) {
+    for (int i = at; i < vm_count - 1; i++)
+        vm_areas[i] = vm_areas[i + 1];
+    vm_count--;
+}
+
+/* First-fit reservation of a page range whose start is aligned to
+   align bytes; returns the area index or -1 */
+static int vm_reserve(uint32_t pages, uint32_t align) {
+    for (int i = 0; i < vm_count; i++) {
+        vm_area *a = &vm_areas[i];
+        if (a->used)
+            continue;
+        uint32_t start = (a->start + align - 1) & ~(align - 1);
+        uint32_t lead = (start - a->start) / PAGE_SIZE;
+        if (a->pages < lead + pages)
+            continue;
+        if (vm_count + 2 > VM_MAX_AREAS)
+            return -1;
+        /* Leave the unaligned head as its own free area */
+        if (lead) {
+            vm_insert(i + 1, start, a->pages - lead);
+            a->pages = lead;
+            a = &vm_areas[++i];
+        }
+        if (a->pages > pages) {
+            vm_insert(i + 1, a->start + pages * PAGE_SIZE, a->pages - pages);
+            a->pages = pages;
+        }
+        a->used = 1;
+        return i;
+    }
+    return -1;
+}
+
+/* Mark an area free again and merge it with free neighbours */
+static void vm_release(int i) {
+    vm_areas[i].used = 0;
+    vm_areas[i].owns_frames = 0;
+    if (i + 1 < vm_count && !vm_areas[i + 1].used) {
+        vm_areas[i].pages += vm_areas[i + 1].pages;
+        vm_remove(i + 1);
+    }
+    if (i > 0 && !vm_areas[i - 1].used) {
+        vm_areas[i - 1].pages += vm_areas[i].pages;
+        vm_remove(i);
+    }
+}
+
+/* Unmap up to pages pages; returns how many were done before the batch
+   filled up (each page may add its frame and its page table) */
+static uint32_t vm_unmap_range(uint32_t start, uint32_t pages, int free_frames_too,
+                               unmap_batch *b) {
+    for (uint32_t p = 0; p < pages; p++) {
+        if (b && b->count + 2 > UNMAP_BATCH)
+            return p;
+        uint32_t virt = start + p * PAGE_SIZE;
+        uint32_t phys = phys_locked(virt);
+        if (!phys) continue;
+        unmap_locked(virt, b);
+        if (!free_frames_too)
+            continue;
+        if (b)
+            b->frames[b->count++] = phys & 0xFFFFF000;
+        else
+            frame_free(phys & 0xFFFFF000);
+    }
+    return pages;
+}
+
+static void *vmalloc_locked(uint32_t size) {
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    int i = vm_reserve(pages, PAGE_SIZE);
+    if (i < 0) return NULL;
+    uint32_t start = vm_areas[i].start;
+    vm_areas[i].owns_frames = 1;
+
+    for (uint32_t p = 0; p < pages; p++) {
+        uint32_t frame = frame_alloc();
+        if (!frame || map_locked(start + p * PAGE_SIZE, frame, PG_WRITE) < 0) {
+            if (frame) frame_free(frame);
+            vm_unmap_range(start, p, 1, NULL);
+            vm_release(i);
+            return NULL;
+        }
+    }
+    return (void *)start;
+}
+
+static void *vmap_locked(uint32_t phys, uint32_t size, uint32_t flags) {
+    uint32_t offset = phys & 0xFFF;
+    uint32_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    phys &= 0xFFFFF000;
+
+    /* Large pages need matching 4MB alignment on both sides */
+    const uint32_t large_pages = LARGE_PAGE_SIZE / PAGE_SIZE;
+    int large = pse_on && (phys & (LARGE_PAGE_SIZE - 1)) == 0 && pages >= large_pages;
+
+    int i = vm_reserve(pages, large ? LARGE_PAGE_SIZE : PAGE_SIZE);
+    if (i < 0) return NULL;
+    uint32_t start = vm_areas[i].start;
+
+    uint32_t p = 0;
+    while (p < pages) {
+        uint32_t virt = start + p * PAGE_SIZE;
+        if (large && pages - p >= large_pages) {
+            page_directory[virt >> 22] = (phys + p * PAGE_SIZE) | (flags & 0xFFF) |
+                                         PG_PRESENT | PG_WRITE | PG_4MB;
+            paging_flush_tlb(virt);
+            p += large_pages;
+            continue;
+        }
+        if (map_locked(virt, phys + p * PAGE_SIZE, flags | PG_WRITE) < 0) {
+            vm_unmap_range(start, p, 0, NULL);
+            vm_release(i);
+            return NULL;
+        }
+        p++;
+    }
+    return (void *)(start + offset);
+}
+
+void *vmalloc(uint32_t size) {
+    if (size == 0) return NULL;
+    uint32_t irq = paging_lock_take();
+    void *p = vmalloc_locked(size);
+    paging_lock_drop(irq);
+    return p;
+}
+
+void *vmap(uint32_t phys, uint32_t size, uint32_t flags) {
+    if (size == 0) return NULL;
+    uint32_t irq = paging_lock_take();
+    void *p = vmap_locked(phys, size, flags);
+    paging_lock_drop(irq);
+    return p;
+}
+
+void *vmap_wc(uint32_t phys, uint32_t size) {
+    return vmap(phys, size, pat_wc ? PG_WRITECOMBINE : 0);
+}
+
+int paging_has_wc(void) {
+    return pat_wc;
+}
+
+int paging_has_pse(void) {
+    return pse_on;
+}
+
+static void print_hex(uint32_t v) {
+    char buf[11] = "0x";
+    for (int i = 0; i < 8; i++)
+        buf[2 + i] = "0123456789ABCDEF"[(v >> (28 - i * 4)) & 0xF];
+    buf[10] = 0;
+    kprint(buf);
+}
+
+/* One line per run of directory entries with the same page size */
+void paging_stats(void) {
+    kprint("PSE: ");
+    kprint(pse_on ? "on" : "off");
+    kprint("  PAT write-combining: ");
+    kprint(pat_wc ? "on" : "off");
+    kprint_newline();
+
+    uint32_t large = 0, tables = 0, small_pages = 0;
+    uint32_t pd = 0;
+    while (pd < PD_RECURSIVE) {
+        uint32_t pde = page_directory[pd];
+        if (!(pde & PG_PRESENT)) { pd++; continue; }
+
+        uint32_t is_large = pde & PG_4MB;
+        uint32_t first = pd, pages = 0;
+        while (pd < PD_RECURSIVE && (page_directory[pd] & PG_PRESENT) &&
+               (page_directory[pd] & PG_4MB) == is_large) {
+            if (is_large) large++;
+            else { tables++; pages += pt_used[pd]; }
+            pd++;
+        }
+        small_pages += pages;
+
+        kprint("  ");
+        print_hex(first << 22);
+        kprint("-");
+        print_hex((pd << 22) - 1);
+        if (is_large) {
+            kprint("  4MB x");
+            print_num(pd - first);
+        } else {
+            kprint("  4KB, ");
+            print_num(pages);
+            kprint(" pages");
+        }
+        kprint_newline();
+    }
+
+    kprint("large pages: ");
+    print_num(large);
+    kprint("  page tables: ");
+    print_num(tables);
+    kprint("  4KB pages: ");
+    print_num(small_pages);
+}
+
+static int vm_find(uint32_t start) {
+    for (int i = 0; i < vm_count; i++) {
+        if (vm_areas[i].start == start && vm_areas[i].used)
+            return i;
+    }
+    return -1;
+}
+
+/* The area stays reserved until every round is shot down, so neither its
+   addresses nor its frames are handed out while a stale entry remains */
+void vfree(void *addr) {
+    uint32_t start = (uint32_t)addr & 0xFFFFF000;
+    uint32_t done = 0;
+    unmap_batch batch;
+    batch.count = 0;
+    for (;;) {
+        uint32_t irq = paging_lock_take();
+        int i = vm_find(start);     /* indices move while the lock is dropped */
+        if (i < 0) {
+            paging_lock_drop(irq);
+            return;
+        }
+        if (done == vm_areas[i].pages) {
+            vm_release(i);
+            paging_lock_drop(irq);
+            return;
+        }
+        done += vm_unmap_range(start + done * PAGE_SIZE, vm_areas[i].pages - done,
+                               vm_areas[i].owns_frames, &batch);
+        paging_lock_drop(irq);
+        unmap_finish(&batch);
+    }
+}
+
+/* ---- Demand paging ---- */
+int paging_add_lazy(uint32_t start, uint32_t end, uint32_t flags, lazy_check_t check) {
+    uint32_t irq = paging_lock_take();
+    int r = -1;
+    if (lazy_count < MAX_LAZY_REGIONS) {
+        lazy_regions[lazy_count].start = start & 0xFFFFF000;
+        lazy_regions[lazy_count].end = end;
+        lazy_regions[lazy_count].flags = flags & 0xFFF;
+        lazy_regions[lazy_count].check = check;
+        lazy_count++;
+        r = 0;
+    }
+    paging_lock_drop(irq);
+    return r;
+}
+
+void paging_remove_lazy(uint32_t start) {
+    uint32_t irq = paging_lock_take();
+    for (uint32_t i = 0; i < lazy_count; i++) {
+        if (lazy_regions[i].start == start) {
+            lazy_regions[i] = lazy_regions[--lazy_count];
+            break;
+        }
+    }
+    paging_lock_drop(irq);
+}
+
+void paging_release(uint32_t start, uint32_t end) {
+    start &= 0xFFFFF000;
+    if (end <= start)
+        return;
+    uint32_t pages = (end - start + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t done = 0;
+    unmap_batch batch;
+    batch.count = 0;
+    while (done < pages) {
+        uint32_t irq = paging_lock_take();
+        done += vm_unmap_range(start + done * PAGE_SIZE, pages - done, 1, &batch);
+        paging_lock_drop(irq);
+        unmap_finish(&batch);
+    }
+}
+
+static int fault_locked(uint32_t addr, uint32_t err_code) {
+    /* Present pages faulting are protection violations, never lazy */
+    if (err_code & (PF_PRESENT | PF_RESERVED))
+        return -1;
+
+    for (uint32_t i = 0; i < lazy_count; i++) {
+        lazy_region *r = &lazy_regions[i];
+        if (addr < r->start || addr >= r->end)
+            continue;
+        if ((err_code & PF_USER) && !(r->flags & PG_USER))
+            return -1;
+        if (r->check && !r->check(addr))
+            return -1;
+
+        uint32_t page = addr & 0xFFFFF000;
+        /* Another CPU may have backed it while we waited for the lock */
+        if (phys_locked(page))
+            return 0;
+        uint32_t frame = frame_alloc();
+        if (!frame)
+            return -1;
+        if (map_locked(page, frame, r->flags) < 0) {
+            frame_free(frame);
+            return -1;
+        }
+        uint32_t *p = (uint32_t *)page;
+        for (uint32_t w = 0; w < PAGE_SIZE / 4; w++)
+            p[w] = 0;
+        return 0;
+    }
+    return -1;
+}
+
+int paging_handle_fault(uint32_t addr, uint32_t err_code) {
+    uint32_t irq = paging_lock_take();
+    int r = fault_locked(addr, err_code);
+    paging_lock_drop(irq);
+    return r;
+}
+
+/* ---- Page attribute table ---- */
+
+/* The PAT MSR is per CPU, so every CPU writes its own */
+static void pat_write(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(PAT_MSR));
+    lo = (lo & ~0x0000FF00U) | (PAT_WC << 8);
+    __asm__ volatile("wbinvd; wrmsr; wbinvd" : : "a"(lo), "d"(hi), "c"(PAT_MSR) : "memory");
+}
+
+static void pat_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1U << 16)))
+        return;     /* no PAT: PWT keeps meaning write-through */
+
+    pat_write();
+    pat_wc = 1;
+}
+
+/* ---- Usable RAM regions ---- */
+int paging_add_region(uint64_t base, uint64_t len) {
+    if (base >= 0x100000000ULL || len == 0)
+        return 0;
+    if (base + len > 0x100000000ULL)
+        len = 0x100000000ULL - base;
+    if (region_count >= MAX_MEM_REGIONS)
+        return -1;
+    mem_regions[region_count].base = (uint32_t)base;
+    mem_regions[region_count].len = (uint32_t)len;
+    region_count++;
+    return 0;
+}
+
+uint32_t paging_region_count(void) {
+    return region_count;
+}
+
+const mem_region_t *paging_region(uint32_t idx) {
+    return idx < region_count ? &mem_regions[idx] : NULL;
+}
+
 /* ---- Initialise paging ---- */
 void paging_init(uint32_t total_mem_kb) {
     /*
@@ -111,37 +737,110 @@ void paging_init(uint32_t total_mem_kb) {
      * Memory layout:
      *   0x000000 - 0x0FFFFF : BIOS, VGA (0xB8000), low memory
      *   0x100000 - 0x3FFFFF : Kernel code/data/bss/stack
-     *   0x400000 - 0x5FFFFF : Kernel heap (mmu.c)
-     *   0x600000 - 0x7FFFFF : Reserved / future use
+     *                         (one 4MB page when the CPU has PSE)
+     *   0x400000 - 0x5FFFFF : not mapped, frames given to the frame allocator
+     *   0x600000 - 0x7FFFFF : .tapp load window, backed on fault (exec.cpp)
+     *
+     * Everything above 8MB (kernel heap, vmalloc area) is mapped on demand
+     * into page tables taken from the frame allocator. The last directory
+     * slot maps the directory itself so those tables stay reachable.
      */
 
-    total_frames = (total_mem_kb * 1024) / PAGE_SIZE;
+    /* Without a memory map, assume one flat range */
+    if (region_count == 0)
+        paging_add_region(0, (uint64_t)total_mem_kb * 1024);
+
+    total_frames = 0;
+    for (uint32_t r = 0; r < region_count; r++) {
+        uint32_t end = (uint32_t)(((uint64_t)mem_regions[r].base + mem_regions[r].len) / PAGE_SIZE);
+        if (end > total_frames)
+            total_frames = end;
+    }
     if (total_frames > MAX_PHYS_FRAMES)
         total_frames = MAX_PHYS_FRAMES;
 
-    /* Clear frame bitmap */
+    /* Every frame starts out used; holes, reserved and ACPI ranges stay so */
     for (uint32_t i = 0; i < MAX_PHYS_FRAMES / 32; i++)
-        frame_bitmap[i] = 0;
+        frame_bitmap[i] = 0xFFFFFFFF;
+
+    /* Free whole frames inside usable regions. The first 8MB belongs to the
+       kernel, except the low pool, which is free for page tables and the heap */
+    for (uint32_t r = 0; r < region_count; r++) {
+        uint64_t end = (uint64_t)mem_regions[r].base + mem_regions[r].len;
+        uint32_t first = (mem_regions[r].base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint32_t last = (uint32_t)(end / PAGE_SIZE);
+        for (uint32_t i = first; i < last && i < total_frames; i++) {
+            if (i >= 2048 || (i >= LOW_POOL_START / PAGE_SIZE && i < LOW_POOL_END / PAGE_SIZE))
+                frame_clear(i);
+        }
+    }
+
+    /* Lay out the per-order buddy maps and hand every free frame to them */
+    uint32_t off = 0;
+    for (uint32_t o = 0; o <= FRAME_MAX_ORDER; o++) {
+        buddy_off[o] = off;
+        buddy_words[o] = ((total_frames >> o) + 31) / 32;
+        buddy_hint[o] = 0;
+        buddy_free[o] = 0;
+        off += buddy_words[o];
+    }
+    for (uint32_t i = 0; i < off; i++)
+        buddy_map[i] = 0;
 
-    /* Mark frames 0 - 0x7FFFFF (first 8MB) as used by kernel */
-    for (uint32_t i = 0; i < 2048 && i < total_frames; i++)
-        frame_set(i);
+    free_frames = 0;
+    for (uint32_t i = 0; i < total_frames; i++) {
+        if (!frame_test(i)) {
+            buddy_insert(i, 0);
+            free_frames++;
+        }
+    }
 
     /* Clear page directory */
     for (int i = 0; i < 1024; i++)
         page_directory[i] = 0;
 
-    /* Fill page table 0: identity-map 0x000000 - 0x3FFFFF */
+    /* 4MB pages need CR4.PSE (CPUID.1:EDX bit 3) */
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    pse_on = (edx & (1U << 3)) != 0;
+
+    /* Fill page table 0: identity-map 0x000000 - 0x3FFFFF. With PSE the
+       whole range is one 4MB page and the table is left unused. */
     for (int i = 0; i < 1024; i++)
         page_table_0[i] = (i * PAGE_SIZE) | PG_PRESENT | PG_WRITE;
 
-    /* Fill page table 1: identity-map 0x400000 - 0x7FFFFF */
-    for (int i = 0; i < 1024; i++)
-        page_table_1[i] = ((1024 + i) * PAGE_SIZE) | PG_PRESENT | PG_WRITE;
+    /* Fill page table 1: identity-map 0x400000 - 0x7FFFFF, leaving the
+       low pool unmapped (today that is all of it) */
+    pt_used[1] = 0;
+    for (int i = 0; i < 1024; i++) {
+        uint32_t addr = (1024 + i) * PAGE_SIZE;
+        if (addr >= LOW_POOL_START && addr < LOW_POOL_END) {
+            page_table_1[i] = 0;
+        } else {
+            page_table_1[i] = addr | PG_PRESENT | PG_WRITE;
+            pt_used[1]++;
+        }
+    }
+    pt_used[0] = 1024;
 
     /* Install page tables into page directory */
-    page_directory[0] = ((uint32_t)page_table_0) | PG_PRESENT | PG_WRITE;
+    if (pse_on)
+        page_directory[0] = 0 | PG_PRESENT | PG_WRITE | PG_4MB;
+    else
+        page_directory[0] = ((uint32_t)page_table_0) | PG_PRESENT | PG_WRITE;
     page_directory[1] = ((uint32_t)page_table_1) | PG_PRESENT | PG_WRITE;
+    page_directory[PD_RECURSIVE] = ((uint32_t)page_directory) | PG_PRESENT | PG_WRITE;
+
+    /* One free area spanning the whole vmalloc range */
+    vm_count = 0;
+    vm_insert(0, VM_START, (VM_END - VM_START) / PAGE_SIZE);
+    lazy_count = 0;
+
+    if (pse_on) {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PSE));
+    }
 
     /* Load page directory into CR3 and enable paging in CR0 */
     __asm__ volatile(
@@ -153,4 +852,14 @@ void paging_init(uint32_t total_mem_kb) {
         : "r"((uint32_t)page_directory)
         : "eax", "memory"
     );
+
+    /* Nothing maps with PWT yet, so slot 1 can change meaning safely */
+    pat_init();
+}
+
+/* An AP shares our page tables (the trampoline loads CR3 and CR4); only
+   the PAT needs setting up again */
+void paging_init_ap(void) {
+    if (pat_wc)
+        pat_write();
 }
@@ -30,22 +30,97 @@ extern "C" {
 #define PG_DIRTY      0x040
 #define PG_4MB        0x080
 
-/* Page frame allocator - manages physical 4KB frames */
-#define MAX_PHYS_FRAMES  2048   /* 8MB / 4KB = 2048 frames */
-
-/* Initialise paging: identity-map first 8MB, enable CR0.PG */
+/* A 4MB page spans one whole directory entry (needs CR4.PSE) */
+#define LARGE_PAGE_SIZE 0x400000
+#define CR4_PSE         0x010
+
+/* paging_init reprograms PAT slot 1 (selected by PWT alone) from
+   write-through to write-combining when the CPU has PAT */
+#define PAT_MSR         0x277
+#define PAT_WC          0x01
+#define PG_WRITECOMBINE PG_WRITETHROUGH
+
+/* Page frame allocator - buddy allocator over physical 4KB frames */
+#define MAX_PHYS_FRAMES  262144 /* 1GB / 4KB = 262144 frames */
+#define FRAME_MAX_ORDER  10     /* largest block is 2^10 frames = 4MB */
+
+/* Low memory between these is not identity-mapped; its frames are free */
+#define LOW_POOL_START   0x400000
+#define LOW_POOL_END     0x800000
+
+/* The last directory slot points back at the directory itself, which
+   makes every page table visible at PT_WINDOW + pd_idx * PAGE_SIZE */
+#define PD_RECURSIVE     1023
+#define PT_WINDOW        0xFFC00000
+
+/* Kernel virtual range handed out by vmalloc()/vmap() */
+#define VM_START         0xD0000000
+#define VM_END           PT_WINDOW
+#define VM_MAX_AREAS     128
+
+/* Page fault error code bits */
+#define PF_PRESENT       0x01   /* 0 = page not present, 1 = protection violation */
+#define PF_WRITE         0x02
+#define PF_USER          0x04
+#define PF_RESERVED      0x08
+#define PF_IFETCH        0x10
+
+/* Ranges whose pages are backed by a zeroed frame on first touch */
+#define MAX_LAZY_REGIONS 32
+
+/* Optional per-region filter: returns nonzero if addr may be backed */
+typedef int (*lazy_check_t)(uint32_t addr);
+
+/* Usable physical RAM ranges, from the multiboot memory map */
+#define MAX_MEM_REGIONS  32
+
+typedef struct {
+    uint32_t base;
+    uint32_t len;
+} mem_region_t;
+
+/* Record a usable RAM range before paging_init(). Ranges above 4GB are
+   dropped and ranges crossing it are clipped. Returns -1 if the list is full. */
+int paging_add_region(uint64_t base, uint64_t len);
+
+/* Usable RAM ranges handed to the frame allocator */
+uint32_t paging_region_count(void);
+const mem_region_t *paging_region(uint32_t idx);
+
+/* Initialise paging: identity-map first 8MB, enable CR0.PG.
+   Only frames inside recorded regions are made free; with no regions,
+   one flat range of total_mem_kb is assumed. */
 void paging_init(uint32_t total_mem_kb);
 
+/* Per-CPU paging setup for an application processor */
+void paging_init_ap(void);
+
 /* Allocate a physical 4KB frame, returns physical address or 0 on failure */
 uint32_t frame_alloc(void);
 
 /* Free a physical frame */
 void frame_free(uint32_t phys_addr);
 
-/* Map a virtual address to a physical address in the current page directory */
-void paging_map(uint32_t virt, uint32_t phys, uint32_t flags);
+/* Allocate 2^order contiguous frames aligned to their size (DMA, large
+   buffers); returns the physical address or 0 on failure */
+uint32_t frame_alloc_contig(uint32_t order);
+
+/* Free a block from frame_alloc_contig() with the same order */
+void frame_free_contig(uint32_t phys_addr, uint32_t order);
+
+/* Number of physical frames still available */
+uint32_t frame_free_count(void);
+
+/* Number of free blocks of one order */
+uint32_t frame_free_blocks(uint32_t order);
 
-/* Unmap a virtual address */
+/* Map a virtual address to a physical address in the current page directory.
+   Missing page tables are allocated from the frame allocator.
+   Returns 0 on success, -1 if no frame was available for a page table. */
+int paging_map(uint32_t virt, uint32_t phys, uint32_t flags);
+
+/* Unmap a virtual address and shoot down other CPUs' TLB entries; a page
+   table left empty is given back afterwards. Interrupts on, as for vfree() */
 void paging_unmap(uint32_t virt);
 
 /* Get physical address for a virtual address, returns 0 if not mapped */
@@ -57,6 +132,49 @@ void paging_flush_tlb(uint32_t virt);
 /* Get the current page directory physical address */
 uint32_t paging_get_cr3(void);
 
+/* ---- Kernel virtual ranges ---- */
+
+/* Reserve size bytes of kernel virtual space and back it with fresh frames */
+void *vmalloc(uint32_t size);
+
+/* Map a physical range (MMIO, framebuffer) into kernel virtual space.
+   Whole 4MB-aligned chunks use 4MB pages when PSE is available. */
+void *vmap(uint32_t phys, uint32_t size, uint32_t flags);
+
+/* Map a physical range write-combining (framebuffers). Falls back to the
+   default memory type when PAT is missing. */
+void *vmap_wc(uint32_t phys, uint32_t size);
+
+/* 1 if PAT was found and the write-combining slot is set up */
+int paging_has_wc(void);
+
+/* 1 if CR4.PSE is on and vmap() may use 4MB pages */
+int paging_has_pse(void);
+
+/* Print which virtual ranges use 4MB pages and which use 4KB tables */
+void paging_stats(void);
+
+/* Release a range from vmalloc() or vmap(); vmalloc frames are freed.
+   Needs interrupts on: other CPUs are made to flush their TLBs. */
+void vfree(void *addr);
+
+/* ---- Demand paging ---- */
+
+/* Register [start, end) as lazily backed; pages get the given PG_* flags.
+   If check is set, only addresses it accepts are backed (guard pages).
+   Returns -1 if the table is full. */
+int paging_add_lazy(uint32_t start, uint32_t end, uint32_t flags, lazy_check_t check);
+
+/* Forget the lazy region starting at start (its pages stay mapped) */
+void paging_remove_lazy(uint32_t start);
+
+/* Unmap [start, end) and free the frames behind it; interrupts on, as for vfree() */
+void paging_release(uint32_t start, uint32_t end);
+
+/* Page fault from isr_handler: returns 0 if a lazy page was mapped,
+   -1 if the fault is a real violation */
+int paging_handle_fault(uint32_t addr, uint32_t err_code);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,6 +6,10 @@
 #include "panic.hpp"
 #include "kio.hpp"
 #include "funcs.hpp"
+#include "paging.hpp"
+#include "thread.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 namespace toast {
 namespace sys {
@@ -63,6 +67,50 @@ struct registers_t {
     unsigned int eip, cs, eflags, useresp, ss;
 };
 
+/* Page fault report, built in place since the heap may be what faulted */
+char fault_msg[128];
+unsigned int fault_len = 0;
+
+void fault_append(const char* s) {
+    while (*s && fault_len < sizeof(fault_msg) - 1)
+        fault_msg[fault_len++] = *s++;
+    fault_msg[fault_len] = 0;
+}
+
+void fault_append_hex(unsigned int v) {
+    char buf[11] = "0x";
+    for (int i = 0; i < 8; i++)
+        buf[2 + i] = "0123456789ABCDEF"[(v >> (28 - i * 4)) & 0xF];
+    buf[10] = 0;
+    fault_append(buf);
+}
+
+/* "PAGE_FAULT // write to 0x... (not present, kernel) at eip 0x..." */
+const char* describe_page_fault(unsigned int addr, unsigned int err, unsigned int eip) {
+    fault_len = 0;
+    fault_append("PAGE_FAULT // ");
+    if (err & PF_IFETCH)     fault_append("exec at ");
+    else if (err & PF_WRITE) fault_append("write to ");
+    else                     fault_append("read from ");
+    fault_append_hex(addr);
+    fault_append((err & PF_PRESENT) ? " (protection, " : " (not present, ");
+    if (err & PF_RESERVED)   fault_append("reserved bit, ");
+    fault_append((err & PF_USER) ? "user)" : "kernel)");
+    fault_append(" at eip ");
+    fault_append_hex(eip);
+    return fault_msg;
+}
+
+/* "STACK_OVERFLOW // thread <name> at eip 0x..." */
+const char* describe_stack_overflow(const char* name, unsigned int eip) {
+    fault_len = 0;
+    fault_append("STACK_OVERFLOW // thread ");
+    fault_append(name);
+    fault_append(" at eip ");
+    fault_append_hex(eip);
+    return fault_msg;
+}
+
 void set_idt_gate(int n, unsigned int handler) {
     idt[n].base_low = handler & 0xFFFF;
     idt[n].base_high = (handler >> 16) & 0xFFFF;
@@ -71,6 +119,15 @@ void set_idt_gate(int n, unsigned int handler) {
     idt[n].flags = 0x8E;
 }
 
+/* Switch to the task whose TSS sel selects */
+void set_task_gate(int n, unsigned short sel) {
+    idt[n].base_low = 0;
+    idt[n].base_high = 0;
+    idt[n].sel = sel;
+    idt[n].always0 = 0;
+    idt[n].flags = 0x85;
+}
+
 } // anonymous namespace
 
 void warn(const char* message) {
@@ -150,6 +207,43 @@ extern "C" {
     extern void irq0_handler();
     extern void keyboard_handler();
     extern void syscall_isr();
+
+    /* Local APIC vectors, see smp.cpp */
+    extern void lapic_timer_isr();
+    extern void resched_isr();
+    extern void tlb_isr();
+    extern void spurious_isr();
+
+    /* irqN_stub for lines 2-15, see kernel.asm */
+    extern unsigned int irq_stub_table[16];
+}
+
+/* Handlers for PIC lines 2-15, filled in by irq_install() */
+static void (*irq_handlers[16])();
+static spinlock_t irq_lock = SPINLOCK_INIT;
+
+/* Common hardware IRQ handler called from the irqN stubs. A handler
+   that wakes a thread (ATA completing a request, say) leaves
+   need_resched set; take the switch once the PIC has its EOI. */
+extern "C" void irq_dispatch(unsigned int irq) {
+    if (irq < 16 && irq_handlers[irq])
+        irq_handlers[irq]();
+    if (irq >= 8)
+        write_port(0xA0, 0x20);
+    write_port(0x20, 0x20);
+    thread_resched();
+}
+
+/* #DF comes in through a task gate, on a stack of its own. The usual
+   cause is a thread pushing onto its guard page: the #PF could not be
+   delivered on that same stack. */
+extern "C" void double_fault_task() {
+    const tss_t* f = toast::smp::double_faulted();
+    unsigned int addr;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(addr));
+    if (thread_t* t = toast::thread::stack_overflowed(addr))
+        toast::sys::panic(toast::sys::describe_stack_overflow(t->name, f->eip));
+    toast::sys::panic(toast::sys::exception_messages[8]);
 }
 
 /* Common ISR handler called from assembly */
@@ -171,9 +265,17 @@ extern "C" void isr_handler(toast::sys::registers_t *regs) {
             kprint_newline();
             regs->eip += 2;
             break;
-        case 14:
-            toast::sys::panic("PAGE_FAULT");
+        case 14: {
+            unsigned int addr;
+            __asm__ volatile("mov %%cr2, %0" : "=r"(addr));
+            /* Lazy regions are backed here; anything else is a real fault */
+            if (paging_handle_fault(addr, regs->err_code) == 0)
+                break;
+            if (thread_t* t = toast::thread::stack_overflowed(addr))
+                toast::sys::panic(toast::sys::describe_stack_overflow(t->name, regs->eip));
+            toast::sys::panic(toast::sys::describe_page_fault(addr, regs->err_code, regs->eip));
             break;
+        }
         default:
             if (regs->int_no < 20) {
                 toast::sys::panic(toast::sys::exception_messages[regs->int_no]);
@@ -206,7 +308,7 @@ void init() {
     set_idt_gate(5, (unsigned int)isr5);
     set_idt_gate(6, (unsigned int)isr6);
     set_idt_gate(7, (unsigned int)isr7);
-    set_idt_gate(8, (unsigned int)isr8);
+    set_task_gate(8, toast::smp::fault_task_selector());
     set_idt_gate(9, (unsigned int)isr9);
     set_idt_gate(10, (unsigned int)isr10);
     set_idt_gate(11, (unsigned int)isr11);
@@ -225,6 +327,11 @@ void init() {
     /* Set up keyboard interrupt (IRQ1 = INT 0x21) */
     set_idt_gate(0x21, (unsigned int)keyboard_handler);
 
+    /* Remaining PIC lines go through irq_dispatch; they stay masked
+       until a driver claims one */
+    for (int irq = 2; irq < 16; irq++)
+        set_idt_gate(0x20 + irq, irq_stub_table[irq]);
+
     /* INT 0x80 - Syscall interface (ring 3 callable) */
     idt[0x80].base_low = ((unsigned int)syscall_isr) & 0xFFFF;
     idt[0x80].base_high = (((unsigned int)syscall_isr) >> 16) & 0xFFFF;
@@ -232,6 +339,12 @@ void init() {
     idt[0x80].always0 = 0;
     idt[0x80].flags = 0xEE;
 
+    /* Local APIC timer and IPIs; harmless until smp::start() enables it */
+    set_idt_gate(VEC_LAPIC_TIMER, (unsigned int)lapic_timer_isr);
+    set_idt_gate(VEC_RESCHED, (unsigned int)resched_isr);
+    set_idt_gate(VEC_TLB, (unsigned int)tlb_isr);
+    set_idt_gate(VEC_SPURIOUS, (unsigned int)spurious_isr);
+
     /* PIC Initialization */
     write_port(0x20, 0x11);
     write_port(0xA0, 0x11);
@@ -253,6 +366,31 @@ void init() {
     load_idt((unsigned long *)&idtp);
 }
 
+/* APs share the BSP's IDT; they turn interrupts on once they can schedule */
+void init_ap() {
+    __asm__ volatile("lidt %0" : : "m"(idtp));
+}
+
+int irq_install(int irq, void (*handler)()) {
+    if (irq <= 2 || irq > 15 || !handler)   /* 2 is the cascade */
+        return -1;
+
+    uint32_t flags = toast::spin::lock_irqsave(&irq_lock);
+    if (irq_handlers[irq]) {
+        toast::spin::unlock_irqrestore(&irq_lock, flags);
+        return -1;
+    }
+    irq_handlers[irq] = handler;
+    if (irq < 8) {
+        write_port(0x21, (uint8_t)read_port(0x21) & ~(1 << irq));
+    } else {
+        write_port(0xA1, (uint8_t)read_port(0xA1) & ~(1 << (irq - 8)));
+        write_port(0x21, (uint8_t)read_port(0x21) & ~0x04);     /* cascade */
+    }
+    toast::spin::unlock_irqrestore(&irq_lock, flags);
+    return 0;
+}
+
 } // namespace sys
 } // namespace toast
 
@@ -18,9 +18,16 @@ void warn(const char* msg);
 /* Initialize IDT */
 void init();
 
+/* Load the IDT on an application processor */
+void init_ap();
+
 /* ISR handler */
 void isr_handler();
 
+/* Route PIC line irq (3-15) to handler and unmask it. The handler runs
+   with interrupts off and the EOI is sent for it; -1 if the line is taken */
+int irq_install(int irq, void (*handler)());
+
 } // namespace sys
 } // namespace toast
 
@@ -30,4 +37,7 @@ void l3_panic(const char* message);
 void init_idt();
 void isr_handler();
 
+/* Entry of the #DF task, see toast::smp::init_fault_task() */
+extern "C" [[noreturn]] void double_fault_task();
+
 #endif /* PANIC_HPP */
@@ -0,0 +1,468 @@
+/*
+ * toastOS++ Multiprocessor Support
+ * Namespace: toast::smp
+ */
+
+#include "smp.hpp"
+#include "paging.hpp"
+#include "panic.hpp"
+#include "thread.hpp"
+#include "time.hpp"
+#include "spinlock.hpp"
+#include "kio.hpp"
+#include "funcs.hpp"
+
+/* GDT layout; 0x08 and 0x10 match what GRUB left us */
+#define GDT_CODE    0x08
+#define GDT_DATA    0x10
+#define GDT_CPU0    3           /* first per-CPU data segment */
+#define GDT_TSS0    (GDT_CPU0 + MAX_CPUS)   /* first per-CPU TSS */
+#define GDT_DF_TSS  (GDT_TSS0 + MAX_CPUS)   /* the #DF task */
+
+#define LAPIC_TPR        0x080
+#define LAPIC_BASE_MSR   0x1B
+#define LAPIC_MSR_ENABLE 0x800
+#define LAPIC_SVR_ENABLE 0x100
+#define LVT_MASKED       0x10000
+#define LVT_PERIODIC     0x20000
+#define LVT_NMI          0x400
+#define LVT_EXTINT       0x700
+#define ICR_INIT         0x4500
+#define ICR_STARTUP      0x4600
+#define ICR_PENDING      0x1000
+
+/* Symbols around the real-mode AP trampoline in kernel.asm */
+extern "C" char ap_trampoline[], ap_trampoline_end[], ap_params[];
+
+namespace {
+    struct gdt_entry {
+        uint16_t limit_low;
+        uint16_t base_low;
+        uint8_t  base_mid;
+        uint8_t  access;
+        uint8_t  gran;
+        uint8_t  base_high;
+    } __attribute__((packed));
+
+    struct gdt_ptr {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed));
+
+    /* Filled in by the BSP for one AP at a time; see ap_params in kernel.asm */
+    struct ap_params_t {
+        uint16_t pad;
+        uint16_t gdt_limit;
+        uint32_t gdt_base;
+        uint32_t cr3;
+        uint32_t cr4;
+        uint32_t cr0;
+        uint32_t stack;
+        uint32_t cpu;
+    } __attribute__((packed));
+
+    /* ACPI tables, only the parts we read */
+    struct rsdp_t {
+        char     sig[8];
+        uint8_t  checksum;
+        char     oem[6];
+        uint8_t  revision;
+        uint32_t rsdt;
+    } __attribute__((packed));
+
+    struct sdt_header {
+        char     sig[4];
+        uint32_t length;
+        uint8_t  revision;
+        uint8_t  checksum;
+        char     oem[6];
+        char     oem_table[8];
+        uint32_t oem_revision;
+        uint32_t creator;
+        uint32_t creator_revision;
+    } __attribute__((packed));
+
+    struct madt_cpu {
+        uint8_t  type;          /* 0 */
+        uint8_t  length;
+        uint8_t  acpi_id;
+        uint8_t  apic_id;
+        uint32_t flags;         /* bit 0: enabled */
+    } __attribute__((packed));
+
+    gdt_entry gdt[GDT_DF_TSS + 1];
+    gdt_ptr gdtp;
+
+    tss_t cpu_tss[MAX_CPUS];
+    tss_t df_tss;
+    uint8_t df_stack[8192] __attribute__((aligned(16)));
+
+    cpu_t cpus[MAX_CPUS];
+    volatile uint32_t ncpus = 1;
+
+    volatile uint32_t* lapic = nullptr;
+    uint32_t lapic_tick_count = 0;  /* LAPIC timer counts per scheduler tick */
+
+    spinlock_t tlb_lock = SPINLOCK_INIT;
+    volatile uint32_t tlb_pending = 0;
+
+    void set_gdt_entry(int n, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+        gdt[n].limit_low = limit & 0xFFFF;
+        gdt[n].base_low = base & 0xFFFF;
+        gdt[n].base_mid = (base >> 16) & 0xFF;
+        gdt[n].access = access;
+        gdt[n].gran = (gran & 0xF0) | ((limit >> 16) & 0x0F);
+        gdt[n].base_high = (base >> 24) & 0xFF;
+    }
+
+    /* Load the GDT, reload every segment register, point GS at cpu and
+       load cpu's TSS */
+    void load_gdt(uint32_t cpu) {
+        __asm__ volatile(
+            "lgdt %0\n\t"
+            "ljmp %1, $1f\n"
+            "1:\n\t"
+            "movw %w2, %%ds\n\t"
+            "movw %w2, %%es\n\t"
+            "movw %w2, %%fs\n\t"
+            "movw %w2, %%ss\n\t"
+            "movw %w3, %%gs\n\t"
+            "ltr %w4"
+            :
+            : "m"(gdtp), "i"(GDT_CODE), "r"(GDT_DATA), "r"((GDT_CPU0 + cpu) * 8),
+              "r"((GDT_TSS0 + cpu) * 8)
+            : "memory");
+    }
+
+    uint32_t lapic_read(uint32_t reg) {
+        return lapic[reg / 4];
+    }
+
+    void lapic_write(uint32_t reg, uint32_t val) {
+        lapic[reg / 4] = val;
+    }
+
+    void lapic_eoi() {
+        lapic_write(LAPIC_EOI, 0);
+    }
+
+    /* Interrupts off so an IRQ on this CPU cannot send between the two writes */
+    void send_ipi(uint32_t apic_id, uint32_t icr) {
+        uint32_t flags = irq_save();
+        lapic_write(LAPIC_ICR_HI, apic_id << 24);
+        lapic_write(LAPIC_ICR_LO, icr);
+        while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+            __asm__ volatile("pause");
+        irq_restore(flags);
+    }
+
+    /* Enable this CPU's LAPIC. Only the BSP passes the PIC through LINT0. */
+    void lapic_enable(int bsp) {
+        lapic_write(LAPIC_TPR, 0);
+        lapic_write(LAPIC_LVT_LINT0, bsp ? LVT_EXTINT : LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+        lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | VEC_SPURIOUS);
+    }
+
+    /* Count LAPIC timer ticks (divide by 16) over 10ms of the PIT clock */
+    void lapic_calibrate() {
+        lapic_write(LAPIC_TIMER_DIV, 0x3);
+        lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+        uint32_t start = toast::time::ms() + 1;
+        while (!toast::time::reached(start))
+            __asm__ volatile("hlt");
+        lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+        while (!toast::time::reached(start + 10))
+            __asm__ volatile("hlt");
+        uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+
+        lapic_tick_count = counted / 10 * 1000 / TIMER_HZ;
+    }
+
+    void lapic_periodic() {
+        lapic_write(LAPIC_LVT_TIMER, VEC_LAPIC_TIMER | LVT_PERIODIC);
+        lapic_write(LAPIC_TIMER_INIT, lapic_tick_count);
+    }
+
+    void lapic_oneshot(uint32_t ms) {
+        lapic_write(LAPIC_LVT_TIMER, VEC_LAPIC_TIMER);
+        lapic_write(LAPIC_TIMER_INIT, ms * lapic_tick_count);
+    }
+
+    /* The count stops at zero in one-shot mode. Split so the 32-bit
+       count times 1000 cannot overflow. */
+    uint32_t lapic_elapsed_us() {
+        uint32_t counts = lapic_read(LAPIC_TIMER_INIT) - lapic_read(LAPIC_TIMER_CUR);
+        return counts / lapic_tick_count * 1000 + counts % lapic_tick_count * 1000 / lapic_tick_count;
+    }
+
+    /* Shared by the APs, each programs its own LAPIC; max_ms is set once
+       the rate is known */
+    clock_event_t lapic_clock = { "lapic", 0, lapic_periodic, lapic_oneshot, lapic_elapsed_us };
+
+    int checksum_ok(const void* p, uint32_t len) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        uint8_t sum = 0;
+        for (uint32_t i = 0; i < len; i++)
+            sum += b[i];
+        return sum == 0;
+    }
+
+    const rsdp_t* rsdp_scan(uint32_t start, uint32_t len) {
+        for (uint32_t a = start; a + sizeof(rsdp_t) <= start + len; a += 16) {
+            const rsdp_t* r = reinterpret_cast<const rsdp_t*>(a);
+            if (r->sig[0] == 'R' && r->sig[1] == 'S' && r->sig[2] == 'D' && r->sig[3] == ' ' &&
+                r->sig[4] == 'P' && r->sig[5] == 'T' && r->sig[6] == 'R' && r->sig[7] == ' ' &&
+                checksum_ok(r, sizeof(rsdp_t)))
+                return r;
+        }
+        return nullptr;
+    }
+
+    /* The RSDP is in the first KB of the EBDA or in the BIOS ROM area */
+    const rsdp_t* rsdp_find() {
+        /* BDA word 0x40E holds the EBDA segment. Hide the constant address
+           from the compiler, which takes it for a zero-length object. */
+        const volatile uint16_t* bda_ebda = reinterpret_cast<const volatile uint16_t*>(0x40E);
+        __asm__("" : "+r"(bda_ebda));
+        uint32_t ebda = (uint32_t)*bda_ebda << 4;
+        const rsdp_t* r = ebda ? rsdp_scan(ebda, 1024) : nullptr;
+        return r ? r : rsdp_scan(0xE0000, 0x20000);
+    }
+
+    /* Map a whole ACPI table; vfree() it when done */
+    const sdt_header* table_map(uint32_t phys) {
+        const sdt_header* h = static_cast<const sdt_header*>(vmap(phys, sizeof(sdt_header), 0));
+        if (!h) return nullptr;
+        uint32_t len = h->length;
+        vfree((void*)h);
+        if (len < sizeof(sdt_header) || len > 0x10000) return nullptr;
+        return static_cast<const sdt_header*>(vmap(phys, len, 0));
+    }
+
+    /* APIC IDs of the enabled CPUs in the MADT other than our own */
+    uint32_t madt_cpus(uint8_t* ids, uint32_t max, uint32_t self) {
+        const rsdp_t* rsdp = rsdp_find();
+        if (!rsdp) return 0;
+        const sdt_header* rsdt = table_map(rsdp->rsdt);
+        if (!rsdt) return 0;
+
+        uint32_t n = 0;
+        const uint32_t* entry = reinterpret_cast<const uint32_t*>(rsdt + 1);
+        uint32_t entries = (rsdt->length - sizeof(sdt_header)) / 4;
+        for (uint32_t i = 0; i < entries && !n; i++) {
+            const sdt_header* t = table_map(entry[i]);
+            if (!t) continue;
+            if (t->sig[0] == 'A' && t->sig[1] == 'P' && t->sig[2] == 'I' && t->sig[3] == 'C' &&
+                checksum_ok(t, t->length)) {
+                /* Entries follow the LAPIC address and flags words */
+                const uint8_t* p = reinterpret_cast<const uint8_t*>(t + 1) + 8;
+                const uint8_t* end = reinterpret_cast<const uint8_t*>(t) + t->length;
+                while (p + 2 <= end && p[1] >= 2 && n < max) {
+                    const madt_cpu* c = reinterpret_cast<const madt_cpu*>(p);
+                    if (c->type == 0 && (c->flags & 1) && c->apic_id != self)
+                        ids[n++] = c->apic_id;
+                    p += p[1];
+                }
+            }
+            vfree((void*)t);
+        }
+        vfree((void*)rsdt);
+        return n;
+    }
+
+    /* INIT, then the startup IPI twice as the MP spec asks */
+    int boot_ap(uint32_t idx, uint8_t apic_id) {
+        uint32_t stack = toast::thread::prepare_cpu(idx);
+        if (!stack) return -1;
+
+        ap_params_t* params = reinterpret_cast<ap_params_t*>(AP_TRAMPOLINE + (ap_params - ap_trampoline));
+        params->stack = stack;
+        params->cpu = idx;
+        cpus[idx].apic_id = apic_id;
+
+        send_ipi(apic_id, ICR_INIT);
+        toast::time::delay(10);
+        for (int tries = 0; tries < 2 && !cpus[idx].online; tries++) {
+            send_ipi(apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+            toast::time::delay(1);
+        }
+
+        uint32_t deadline = toast::time::ms() + 100;
+        while (!cpus[idx].online && !toast::time::reached(deadline))
+            __asm__ volatile("pause");
+        return cpus[idx].online ? 0 : -1;
+    }
+}
+
+namespace toast {
+namespace smp {
+
+void init() {
+    set_gdt_entry(0, 0, 0, 0, 0);
+    set_gdt_entry(1, 0, 0xFFFFF, 0x9A, 0xCF);
+    set_gdt_entry(2, 0, 0xFFFFF, 0x92, 0xCF);
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpus[i].id = i;
+        cpus[i].apic_id = 0;
+        cpus[i].online = 0;
+        /* byte granular, just big enough for the cpu_t */
+        set_gdt_entry(GDT_CPU0 + i, (uint32_t)&cpus[i], sizeof(cpu_t) - 1, 0x92, 0x40);
+        /* available 32-bit TSS, no I/O bitmap */
+        cpu_tss[i].iomap = sizeof(tss_t);
+        set_gdt_entry(GDT_TSS0 + i, (uint32_t)&cpu_tss[i], sizeof(tss_t) - 1, 0x89, 0x00);
+    }
+    df_tss.iomap = sizeof(tss_t);
+    set_gdt_entry(GDT_DF_TSS, (uint32_t)&df_tss, sizeof(tss_t) - 1, 0x89, 0x00);
+    gdtp.limit = sizeof(gdt) - 1;
+    gdtp.base = (uint32_t)&gdt;
+
+    load_gdt(0);
+    cpus[0].online = 1;
+    ncpus = 1;
+}
+
+void start() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1U << 9)))
+        return;     /* no local APIC: stay on one CPU */
+
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(LAPIC_BASE_MSR));
+    if (!(lo & LAPIC_MSR_ENABLE)) {
+        lo |= LAPIC_MSR_ENABLE;
+        __asm__ volatile("wrmsr" : : "a"(lo), "d"(hi), "c"(LAPIC_BASE_MSR));
+    }
+    lapic = static_cast<volatile uint32_t*>(vmap(lo & 0xFFFFF000, PAGE_SIZE, PG_CACHE_DIS));
+    if (!lapic)
+        return;
+
+    lapic_enable(1);
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+    lapic_calibrate();
+    if (!lapic_tick_count)
+        return;
+    lapic_clock.max_ms = 0xFFFFFFFF / lapic_tick_count;
+
+    uint8_t ids[MAX_CPUS - 1];
+    uint32_t found = madt_cpus(ids, MAX_CPUS - 1, cpus[0].apic_id);
+    if (!found)
+        return;
+
+    /* Everything but the stack and index is the same for every AP */
+    uint32_t size = ap_trampoline_end - ap_trampoline;
+    uint8_t* dst = reinterpret_cast<uint8_t*>(AP_TRAMPOLINE);
+    for (uint32_t i = 0; i < size; i++)
+        dst[i] = ap_trampoline[i];
+
+    ap_params_t* params = reinterpret_cast<ap_params_t*>(AP_TRAMPOLINE + (ap_params - ap_trampoline));
+    params->gdt_limit = gdtp.limit;
+    params->gdt_base = gdtp.base;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(params->cr3));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(params->cr4));
+    __asm__ volatile("mov %%cr0, %0" : "=r"(params->cr0));
+
+    for (uint32_t i = 0; i < found; i++) {
+        if (boot_ap(ncpus, ids[i]) < 0) {
+            kprint("smp: a CPU did not come up");
+            kprint_newline();
+            break;
+        }
+        ncpus++;
+    }
+}
+
+void init_fault_task() {
+    df_tss.cr3 = paging_get_cr3();
+    df_tss.eip = (uint32_t)double_fault_task;
+    df_tss.esp = (uint32_t)(df_stack + sizeof(df_stack));
+    df_tss.eflags = 0x002;     /* interrupts off */
+    df_tss.cs = GDT_CODE;
+    df_tss.ss = df_tss.ds = df_tss.es = df_tss.fs = GDT_DATA;
+    df_tss.gs = GDT_CPU0 * 8;  /* fixed up by double_faulted() */
+}
+
+uint16_t fault_task_selector() {
+    return GDT_DF_TSS * 8;
+}
+
+const tss_t* double_faulted() {
+    uint32_t cpu = (df_tss.prev & 0xFFFF) / 8 - GDT_TSS0;
+    if (cpu >= MAX_CPUS) cpu = 0;
+    __asm__ volatile("movw %w0, %%gs" : : "r"((GDT_CPU0 + cpu) * 8));
+    return &cpu_tss[cpu];
+}
+
+uint32_t count() {
+    return ncpus;
+}
+
+cpu_t* cpu(uint32_t idx) {
+    return idx < MAX_CPUS ? &cpus[idx] : nullptr;
+}
+
+void send_resched(uint32_t idx) {
+    if (lapic && idx < ncpus && idx != id())
+        send_ipi(cpus[idx].apic_id, VEC_RESCHED);
+}
+
+void tlb_shootdown() {
+    if (ncpus < 2) return;
+
+    /* Stay on this CPU so "everyone but me" keeps meaning the same thing */
+    toast::thread::preempt_disable();
+    toast::spin::lock(&tlb_lock);
+    uint32_t self = id();
+    tlb_pending = ncpus - 1;
+    for (uint32_t i = 0; i < ncpus; i++) {
+        if (i != self)
+            send_ipi(cpus[i].apic_id, VEC_TLB);
+    }
+    /* We may have run elsewhere when the entries went; flush here too */
+    __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause");
+    toast::spin::unlock(&tlb_lock);
+    toast::thread::preempt_enable();
+}
+
+} // namespace smp
+} // namespace toast
+
+/* First C code on an AP, on its idle thread's stack; the trampoline has
+   loaded our GDT, page tables and control registers */
+extern "C" void ap_main(uint32_t idx) {
+    load_gdt(idx);
+    toast::sys::init_ap();
+    paging_init_ap();
+
+    lapic_enable(0);
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    toast::time::clockevent_register(idx, &lapic_clock);
+
+    cpus[idx].online = 1;
+    toast::thread::start_cpu();
+}
+
+/* The PIT only interrupts the BSP; APs tick off their own LAPIC timer */
+extern "C" void lapic_timer_interrupt() {
+    lapic_eoi();
+    toast::time::tick_fired();
+    thread_preempt();
+}
+
+/* May switch threads right here, so the tick has to be going first */
+extern "C" void resched_interrupt() {
+    lapic_eoi();
+    toast::time::tick_resume();
+    thread_resched();
+}
+
+extern "C" void tlb_interrupt() {
+    __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+    __atomic_sub_fetch(&tlb_pending, 1, __ATOMIC_RELEASE);
+    lapic_eoi();
+}
@@ -0,0 +1,111 @@
+/*
+ * toastOS++ Multiprocessor Support
+ * Namespace: toast::smp
+ */
+
+#ifndef SMP_HPP
+#define SMP_HPP
+
+#include "stdint.hpp"
+
+#define MAX_CPUS 8
+
+/* Local APIC registers, as offsets into its 4KB MMIO page */
+#define LAPIC_ID        0x020
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LO    0x300
+#define LAPIC_ICR_HI    0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+
+/* IDT vectors owned by the local APIC, above the PIC's 0x20-0x2F */
+#define VEC_LAPIC_TIMER 0xEF
+#define VEC_RESCHED     0xF0
+#define VEC_TLB         0xF1
+#define VEC_SPURIOUS    0xFF
+
+/* APs start in real mode at this page; the trampoline is copied there */
+#define AP_TRAMPOLINE   0x8000
+
+/*
+ * Per-CPU block. Each CPU's GS selects a data segment based here, so
+ * %gs:0 is always the running CPU's own index, whatever thread it runs.
+ */
+struct cpu_t {
+    uint32_t          id;       /* must stay first, see id() */
+    uint32_t          apic_id;
+    volatile uint32_t online;
+};
+
+/*
+ * 32-bit task state segment. Threads switch in software, so the only
+ * hardware task switch is into the #DF task; each CPU loads a TSS of
+ * its own just so that switch has somewhere to save the faulting state.
+ */
+struct tss_t {
+    uint32_t prev;              /* selector of the task that faulted */
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap;
+    uint16_t iomap;
+} __attribute__((packed));
+
+namespace toast {
+namespace smp {
+
+/* Kernel GDT with one per-CPU segment and TSS; first thing kmain does */
+void init();
+
+/* Set up the #DF task, with a stack and page directory of its own, so a
+   fault while pushing onto an overflowed stack can still be reported.
+   Once paging is on. */
+void init_fault_task();
+
+/* GDT selector of the #DF task, for its task gate in the IDT */
+uint16_t fault_task_selector();
+
+/* From the #DF task: point GS back at the CPU that faulted and return
+   the state its task switch saved. The task is shared, so a second CPU
+   double faulting meanwhile still resets the machine. */
+const tss_t* double_faulted();
+
+/* Find the other CPUs in the ACPI MADT and boot them; needs the timer,
+   paging and the scheduler. Without a local APIC this is a no-op. */
+void start();
+
+/* Index of the CPU this runs on */
+inline uint32_t id() {
+    uint32_t v;
+    __asm__ volatile("movl %%gs:0, %0" : "=r"(v));
+    return v;
+}
+
+/* CPUs online; they are numbered 0 .. count()-1 in boot order */
+uint32_t count();
+
+cpu_t* cpu(uint32_t idx);
+
+/* Ask another CPU to look at its run queue */
+void send_resched(uint32_t idx);
+
+/* Flush every other CPU's TLB after page table entries were removed,
+   and wait until they have. Call with interrupts on and no spinlock held. */
+void tlb_shootdown();
+
+} // namespace smp
+} // namespace toast
+
+/* Entry points from kernel.asm */
+extern "C" void ap_main(uint32_t idx);
+extern "C" void lapic_timer_interrupt();
+extern "C" void resched_interrupt();
+extern "C" void tlb_interrupt();
+
+#endif /* SMP_HPP */
@@ -0,0 +1,62 @@
+/*
+ * toastOS++ Spinlocks
+ * Namespace: toast::spin
+ */
+
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP
+
+#include "stdint.hpp"
+#include "funcs.hpp"
+
+/*
+ * Busy-waiting lock for data shared between CPUs. Hold it briefly and
+ * never sleep while holding it. Anything an IRQ handler also takes must
+ * be locked with lock_irqsave(), or the handler could spin forever on a
+ * lock its own CPU holds.
+ */
+struct spinlock_t {
+    volatile uint32_t locked;
+};
+
+#define SPINLOCK_INIT { 0 }
+
+namespace toast {
+namespace spin {
+
+inline void init(spinlock_t* l) {
+    l->locked = 0;
+}
+
+inline int trylock(spinlock_t* l) {
+    return __atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE) == 0 ? 0 : -1;
+}
+
+inline void lock(spinlock_t* l) {
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        /* Wait on a plain read so the line is not bounced between CPUs */
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+            __asm__ volatile("pause");
+    }
+}
+
+inline void unlock(spinlock_t* l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* Interrupts off, then the lock; returns the flags for unlock_irqrestore() */
+inline uint32_t lock_irqsave(spinlock_t* l) {
+    uint32_t flags = irq_save();
+    lock(l);
+    return flags;
+}
+
+inline void unlock_irqrestore(spinlock_t* l, uint32_t flags) {
+    unlock(l);
+    irq_restore(flags);
+}
+
+} // namespace spin
+} // namespace toast
+
+#endif /* SPINLOCK_HPP */
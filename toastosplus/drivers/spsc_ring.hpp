@@ -0,0 +1,101 @@
+/*
+ * toastOS++ SPSC Ring
+ * Namespace: toast
+ */
+
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include "stdint.hpp"
+
+namespace toast {
+
+/*
+ * Lock-free ring for exactly one producer and one consumer, typically an
+ * IRQ handler feeding a thread. N must be a power of two; the indices run
+ * free and are masked on use, so all N slots hold data.
+ *
+ * The producer fills a slot and then publishes it with a release store of
+ * head; the consumer's acquire load of head is therefore guaranteed to see
+ * the slot's contents. tail hands slots back the same way. Each index is
+ * written by one side only and sits on its own cache line.
+ *
+ * There is no constructor (global constructors never run here); a ring in
+ * static storage starts out empty, anything else needs reset().
+ */
+template<typename T, uint32_t N>
+class spsc_ring {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "spsc_ring capacity must be a power of two");
+
+public:
+    /* Not thread-safe: only while neither side is running */
+    void reset() {
+        head = 0;
+        tail = 0;
+    }
+
+    /* ---- producer side ---- */
+
+    bool push(const T& v) {
+        T* slot = reserve();
+        if (!slot) return false;
+        *slot = v;
+        commit();
+        return true;
+    }
+
+    /* Next free slot to fill in place, or nullptr if full; commit() publishes it */
+    T* reserve() {
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if (h - t == N) return nullptr;
+        return &buf[h & (N - 1)];
+    }
+
+    void commit() {
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    }
+
+    /* ---- consumer side ---- */
+
+    bool pop(T* out) {
+        T* slot = peek();
+        if (!slot) return false;
+        *out = *slot;
+        release();
+        return true;
+    }
+
+    /* Oldest filled slot, or nullptr if empty; release() hands it back */
+    T* peek() {
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if (h == t) return nullptr;
+        return &buf[t & (N - 1)];
+    }
+
+    void release() {
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    }
+
+    /* ---- either side; a snapshot that may be stale at once ---- */
+
+    uint32_t size() const {
+        return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    }
+
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() == N; }
+    static constexpr uint32_t capacity() { return N; }
+
+private:
+    T buf[N];
+    alignas(64) uint32_t head;      /* next slot to fill, producer only */
+    alignas(64) uint32_t tail;      /* next slot to drain, consumer only */
+};
+
+} // namespace toast
+
+#endif /* SPSC_RING_HPP */
@@ -5,187 +5,885 @@
 
 #include "thread.hpp"
 #include "mmu.hpp"
+#include "paging.hpp"
 #include "kio.hpp"
 #include "toast_libc.hpp"
 #include "time.hpp"
+#include "funcs.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+
+extern "C" void thread_switch_asm(uint32_t *old_esp, uint32_t new_esp);
 
 namespace {
-    thread_t threads[MAX_THREADS];
-    tid_t current_tid = 0;
+    /* Slot -> TCB. Slot n owns stack slot n; the table doubles on demand
+       up to MAX_THREADS. */
+    thread_t** threads = nullptr;
+    uint32_t thread_cap = 0;
+    uint32_t slots_used = 0;        /* slots ever handed out */
+    thread_t* free_tcbs = nullptr;  /* reaped TCBs, linked by q_next */
+
     tid_t next_tid = 1;
     int scheduler_active = 0;
+    uint32_t slice_ticks = THREAD_TIMESLICE;
+
+    /*
+     * Locks, outermost first:
+     *   table_lock   thread table, TID index, dead and free lists
+     *   pi_lock      contended mutexes: their waiters, the owners' held
+     *                lists and the priorities lent along the chain
+     *   q->lock      one per wait queue, covering its mutex, semaphore
+     *                or condvar
+     *   c->lock      one per CPU run queue; two at once lower CPU first
+     * A thread that switches away holds its CPU's run queue lock across
+     * thread_switch_asm and the thread that comes in drops it. Whoever
+     * wakes a thread waits for its on_cpu to clear first, so nobody runs
+     * a thread whose registers are not saved yet; wakers hold no lock
+     * while they wait. The timer wheel's lock is never held with these.
+     */
+    spinlock_t table_lock = SPINLOCK_INIT;
+    spinlock_t pi_lock = SPINLOCK_INIT;
+
+    /* One FIFO per priority; bit p of ready_mask is set while queue p
+       is non-empty, so the best ready thread is one ctz away */
+    struct run_queue {
+        thread_t* head;
+        thread_t* tail;
+    };
+
+    /* Scheduler state of one CPU, under its lock. A CPU may also read
+       its own entry with interrupts off. */
+    struct sched_cpu {
+        spinlock_t lock;
+        thread_t* cur;
+        thread_t* prev;             /* switched away from, until on_cpu clears */
+        thread_t* idle;             /* runs when nothing else can, never queued */
+        run_queue ready[THREAD_PRIORITIES];
+        uint32_t ready_mask;
+        uint32_t nr_ready;
+        volatile int need_resched;
+        uint32_t idle_count;        /* ticks that found the idle thread running */
+    };
+    sched_cpu cpus[MAX_CPUS];
+
+    /* Only stable with interrupts off; a preemptible thread may move */
+    sched_cpu* this_cpu() {
+        return &cpus[toast::smp::id()];
+    }
+
+    thread_t* dead = nullptr;       /* exited, waiting to be reaped */
+    mutex_t reap_lock = MUTEX_INIT; /* held while reaping; see lock_table() */
+
+    /* TID -> TCB, open addressing, twice the table size */
+    thread_t** tid_index = nullptr;
+    uint32_t tid_index_size = 0;
+
+    uint32_t tid_hash(tid_t tid) {
+        return (tid * 2654435761u) & (tid_index_size - 1);
+    }
+
+    void index_insert(thread_t* t) {
+        uint32_t i = tid_hash(t->tid);
+        while (tid_index[i])
+            i = (i + 1) & (tid_index_size - 1);
+        tid_index[i] = t;
+    }
 
     thread_t* find_thread(tid_t tid) {
-        for (int i = 0; i < MAX_THREADS; i++) {
-            if (threads[i].state != THREAD_UNUSED && threads[i].tid == tid)
-                return &threads[i];
+        uint32_t i = tid_hash(tid);
+        while (tid_index[i]) {
+            if (tid_index[i]->tid == tid)
+                return tid_index[i];
+            i = (i + 1) & (tid_index_size - 1);
         }
         return nullptr;
     }
 
-    int find_slot() {
-        for (int i = 0; i < MAX_THREADS; i++) {
-            if (threads[i].state == THREAD_UNUSED)
-                return i;
+    /* Remove and shift later entries of the same probe run back */
+    void index_remove(tid_t tid) {
+        uint32_t mask = tid_index_size - 1;
+        uint32_t i = tid_hash(tid);
+        while (tid_index[i] && tid_index[i]->tid != tid)
+            i = (i + 1) & mask;
+        if (!tid_index[i]) return;
+        tid_index[i] = nullptr;
+        for (uint32_t j = (i + 1) & mask; tid_index[j]; j = (j + 1) & mask) {
+            uint32_t home = tid_hash(tid_index[j]->tid);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                tid_index[i] = tid_index[j];
+                tid_index[j] = nullptr;
+                i = j;
+            }
+        }
+    }
+
+    /* Double the slot table and rebuild the TID index. Two CPUs may race
+       here; the loser finds the table already grown and backs out. */
+    bool grow_table() {
+        uint32_t cap = thread_cap ? thread_cap * 2 : THREAD_TABLE_INIT;
+        if (cap > MAX_THREADS) return false;
+
+        thread_t** table = static_cast<thread_t**>(toast::mem::alloc(cap * sizeof(thread_t*)));
+        thread_t** index = static_cast<thread_t**>(toast::mem::alloc(cap * 2 * sizeof(thread_t*)));
+        if (!table || !index) {
+            toast::mem::free(table);
+            toast::mem::free(index);
+            return false;
         }
-        return -1;
+        memset(table, 0, cap * sizeof(thread_t*));
+        memset(index, 0, cap * 2 * sizeof(thread_t*));
+
+        uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+        if (thread_cap >= cap) {
+            toast::spin::unlock_irqrestore(&table_lock, flags);
+            toast::mem::free(table);
+            toast::mem::free(index);
+            return true;
+        }
+        thread_t** old_index = tid_index;
+        for (uint32_t i = 0; i < slots_used; i++)
+            table[i] = threads[i];
+        threads = table;
+        thread_cap = cap;
+        tid_index = index;
+        tid_index_size = cap * 2;
+        for (uint32_t i = 0; i < slots_used; i++) {
+            if (threads[i]->state != THREAD_UNUSED)
+                index_insert(threads[i]);
+        }
+        toast::spin::unlock_irqrestore(&table_lock, flags);
+
+        /* The old slot table is left alone: at() and the page fault path
+           read the table without the lock and may be on it right now */
+        toast::mem::free(old_index);
+        return true;
+    }
+
+    uint32_t slot_top(uint32_t slot) {
+        return THREAD_STACK_REGION + (slot + 1) * THREAD_STACK_SLOT;
     }
 
-    int pick_next() {
-        int cur = -1;
-        for (int i = 0; i < MAX_THREADS; i++) {
-            if (threads[i].tid == current_tid && threads[i].state != THREAD_UNUSED) {
-                cur = i;
-                break;
+    thread_t* slot_thread(uint32_t addr) {
+        if (addr < THREAD_STACK_REGION || addr >= THREAD_STACK_REGION_END) return nullptr;
+        uint32_t slot = (addr - THREAD_STACK_REGION) / THREAD_STACK_SLOT;
+        if (slot >= slots_used || threads[slot]->state == THREAD_UNUSED) return nullptr;
+        return threads[slot];
+    }
+
+    /* What a stack word holds until the thread first writes it */
+    const uint32_t STACK_POISON = 0x57AC57AC;
+
+    /* Back the whole stack up front. A push that faulted on a missing
+       stack page would need that same page to deliver the #PF. */
+    bool map_stack(thread_t* t) {
+        uint32_t top = t->stack_base + t->stack_size;
+        for (uint32_t page = t->stack_base; page < top; page += PAGE_SIZE) {
+            uint32_t frame = frame_alloc();
+            if (!frame || paging_map(page, frame, PG_WRITE) < 0) {
+                if (frame) frame_free(frame);
+                paging_release(t->stack_base, page);
+                return false;
             }
+            uint32_t* p = (uint32_t*)page;
+            for (uint32_t w = 0; w < PAGE_SIZE / 4; w++)
+                p[w] = STACK_POISON;
         }
-        for (int off = 1; off <= MAX_THREADS; off++) {
-            int idx = (cur + off) % MAX_THREADS;
-            if (threads[idx].state == THREAD_READY)
-                return idx;
+        return true;
+    }
+
+    /* ---- Run queues (c->lock held) ---- */
+    void enqueue(sched_cpu* c, thread_t* t) {
+        run_queue* q = &c->ready[t->priority];
+        t->q_next = nullptr;
+        t->q_prev = q->tail;
+        if (q->tail) q->tail->q_next = t;
+        else q->head = t;
+        q->tail = t;
+        c->ready_mask |= 1U << t->priority;
+        c->nr_ready++;
+        t->rq_prio = t->priority;   /* priority may change under pi_lock alone */
+        t->on_rq = 1;
+        t->cpu = c - cpus;
+    }
+
+    void dequeue(sched_cpu* c, thread_t* t) {
+        run_queue* q = &c->ready[t->rq_prio];
+        if (t->q_prev) t->q_prev->q_next = t->q_next;
+        else q->head = t->q_next;
+        if (t->q_next) t->q_next->q_prev = t->q_prev;
+        else q->tail = t->q_prev;
+        t->q_next = t->q_prev = nullptr;
+        if (!q->head) c->ready_mask &= ~(1U << t->rq_prio);
+        c->nr_ready--;
+        t->on_rq = 0;
+    }
+
+    /* Make a CPU look at its run queue, by IPI if it is not us */
+    void kick(uint32_t cpu) {
+        cpus[cpu].need_resched = 1;
+        if (cpu != toast::smp::id())
+            toast::smp::send_resched(cpu);
+    }
+
+    /* Unlocked, so only a hint */
+    bool cpu_idle(const sched_cpu* c) {
+        return c->cur == c->idle && !c->nr_ready;
+    }
+
+    /* Pull the most urgent thread of the busiest other CPU onto c. Run by
+       c's idle thread with interrupts off and no lock held, so it can take
+       both run queue locks in CPU order. One thread queued behind an idle
+       CPU is left alone, that CPU is about to run it. */
+    void steal(sched_cpu* c) {
+        sched_cpu* victim = nullptr;
+        uint32_t most = 1;
+        for (uint32_t i = 0; i < toast::smp::count(); i++) {
+            sched_cpu* v = &cpus[i];
+            if (v == c || !v->nr_ready) continue;
+            uint32_t load = v->nr_ready + (v->cur != v->idle);
+            if (load > most) {
+                most = load;
+                victim = v;
+            }
+        }
+        if (!victim) return;
+
+        sched_cpu* first = victim < c ? victim : c;
+        sched_cpu* second = victim < c ? c : victim;
+        toast::spin::lock(&first->lock);
+        toast::spin::lock(&second->lock);
+        /* Look again now that neither queue can change */
+        if (!c->nr_ready && victim->ready_mask &&
+            victim->nr_ready + (victim->cur != victim->idle) > 1) {
+            thread_t* t = victim->ready[__builtin_ctz(victim->ready_mask)].head;
+            dequeue(victim, t);
+            enqueue(c, t);
+        }
+        toast::spin::unlock(&second->lock);
+        toast::spin::unlock(&first->lock);
+    }
+
+    /* Own queue, else the idle thread, which steals before it halts */
+    thread_t* pick_next(sched_cpu* c) {
+        if (c->ready_mask) {
+            thread_t* t = c->ready[__builtin_ctz(c->ready_mask)].head;
+            dequeue(c, t);
+            return t;
         }
-        return cur;
+        return c->idle;
     }
 
-    void wake_sleepers() {
-        uint32_t now = get_uptime_seconds();
-        for (int i = 0; i < MAX_THREADS; i++) {
-            if (threads[i].state == THREAD_SLEEPING && now >= threads[i].sleep_until) {
-                threads[i].state = THREAD_READY;
+    /* Queue a thread the caller has claimed from whatever it waited on:
+       back on the CPU it last ran on if that one is free, since its cache
+       is warm there; otherwise on any idle CPU, else where it was.
+       Interrupts off and no run queue lock held. It may not be done
+       switching away yet, so wait for that first. */
+    void make_ready(thread_t* t) {
+        while (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+            __asm__ volatile("pause");
+
+        uint32_t target = t->cpu;
+        if (!cpu_idle(&cpus[target])) {
+            for (uint32_t i = 0; i < toast::smp::count(); i++) {
+                if (cpu_idle(&cpus[i])) {
+                    target = i;
+                    break;
+                }
             }
         }
+        sched_cpu* c = &cpus[target];
+        toast::spin::lock(&c->lock);
+        t->state = THREAD_READY;
+        enqueue(c, t);
+        if (!c->cur || t->priority < c->cur->priority)
+            kick(target);
+        toast::spin::unlock(&c->lock);
     }
-}
 
-extern "C" void thread_switch_asm(uint32_t *old_esp, uint32_t new_esp);
+    /* The thread we switched to marks the one we left as fully saved */
+    void finish_switch() {
+        __atomic_store_n(&this_cpu()->prev->on_cpu, 0, __ATOMIC_RELEASE);
+    }
+
+    /* Give this CPU to the most urgent thread. Called with c->lock held
+       and interrupts off, and returns the same way: the lock goes over to
+       the next thread, which drops it, and whoever switches back to us
+       hands over their own CPU's lock - possibly another CPU, so c is
+       stale after this returns. */
+    void reschedule(sched_cpu* c) {
+        thread_t* old = c->cur;
+        /* Blocking with preemption off would hand the count to nobody */
+        assert(old->state == THREAD_RUNNING || !old->preempt_count);
+        c->need_resched = 0;
+        bool preempted = old == c->idle;
+        if (old->state == THREAD_RUNNING && old != c->idle) {
+            /* Nothing as important is waiting: keep the CPU */
+            if (!c->ready_mask || (uint32_t)__builtin_ctz(c->ready_mask) > old->priority) {
+                old->slice_left = slice_ticks;
+                return;
+            }
+            old->state = THREAD_READY;
+            enqueue(c, old);
+            preempted = true;
+        }
+
+        thread_t* next = pick_next(c);
+        if (next == old) {
+            old->slice_left = slice_ticks;
+            return;
+        }
+        if (old == c->idle)
+            old->state = THREAD_READY;
+
+        next->state = THREAD_RUNNING;
+        next->slice_left = slice_ticks;
+        next->last_run = toast::time::ms();
+        next->cpu = c - cpus;
+        next->on_cpu = 1;
+        c->cur = next;
+        c->prev = old;
+
+        /* Still runnable means something else took the CPU from it */
+        if (preempted)
+            old->invol_switches++;
+        else
+            old->vol_switches++;
+        thread_switch_asm(&old->context.esp, next->context.esp);
+        finish_switch();
+    }
+
+    /* Reschedule on whatever CPU we are on; interrupts off. The caller
+       has marked the thread blocked, sleeping or dead, if it is, and let
+       go of every other lock. */
+    void switch_cpu() {
+        sched_cpu* c = this_cpu();
+        toast::spin::lock(&c->lock);
+        reschedule(c);
+        toast::spin::unlock(&this_cpu()->lock);
+    }
+
+    /* Put interrupts back, and switch at once if we woke someone more
+       urgent - unless we are in an IRQ handler, where the IRQ tail does it */
+    void resched_restore(uint32_t flags) {
+        sched_cpu* c = this_cpu();
+        int resched = c->need_resched && c->cur && !c->cur->preempt_count;
+        irq_restore(flags);
+        if ((flags & 0x200) && resched)
+            toast::thread::yield();
+    }
+
+    /* ---- Wait queues (q->lock held) ---- */
+    void wq_insert(wait_queue_t* q, thread_t* t) {
+        thread_t* after = q->tail;
+        while (after && after->priority > t->priority)
+            after = after->q_prev;
+        t->q_prev = after;
+        t->q_next = after ? after->q_next : q->head;
+        if (t->q_next) t->q_next->q_prev = t;
+        else q->tail = t;
+        if (after) after->q_next = t;
+        else q->head = t;
+        t->waiting_on = q;
+    }
+
+    void wq_remove(wait_queue_t* q, thread_t* t) {
+        if (t->q_prev) t->q_prev->q_next = t->q_next;
+        else q->head = t->q_next;
+        if (t->q_next) t->q_next->q_prev = t->q_prev;
+        else q->tail = t->q_prev;
+        t->q_next = t->q_prev = nullptr;
+        t->waiting_on = nullptr;
+    }
+
+    thread_t* wq_pop(wait_queue_t* q) {
+        thread_t* t = q->head;
+        if (t) wq_remove(q, t);
+        return t;
+    }
+
+    /* Park the running thread t on q. The caller drops q->lock and
+       reschedules with interrupts still off. */
+    void wq_block(wait_queue_t* q, thread_t* t) {
+        wq_insert(q, t);
+        t->state = THREAD_BLOCKED;
+    }
+
+    /* ---- Priority inheritance (pi_lock held) ---- */
+
+    /* Own priority, or that of the most urgent waiter on a held mutex */
+    uint8_t inherited_priority(thread_t* t) {
+        uint8_t p = t->base_priority;
+        for (mutex_t* m = t->held; m; m = m->next_held) {
+            if (m->waiters.head && m->waiters.head->priority < p)
+                p = m->waiters.head->priority;
+        }
+        return p;
+    }
+
+    /* Move t to the ready queue of its new priority if it sits in one,
+       or kick its CPU if it runs there and is no longer the most urgent */
+    void requeue(thread_t* t) {
+        for (;;) {
+            uint32_t cpu = t->cpu;
+            sched_cpu* c = &cpus[cpu];
+            toast::spin::lock(&c->lock);
+            if (t->cpu != cpu) {
+                /* stolen or woken elsewhere meanwhile */
+                toast::spin::unlock(&c->lock);
+                continue;
+            }
+            if (t->on_rq) {
+                dequeue(c, t);
+                enqueue(c, t);
+                if (c->cur && t->priority < c->cur->priority)
+                    kick(cpu);
+            } else if (c->cur == t) {
+                if (c->ready_mask && (uint32_t)__builtin_ctz(c->ready_mask) < t->priority)
+                    kick(cpu);
+            }
+            toast::spin::unlock(&c->lock);
+            return;
+        }
+    }
+
+    /* Give t a new effective priority, keeping whatever queue it sits in
+       sorted, and pass the change on to the owner of the mutex it is
+       waiting for */
+    void reprioritize(thread_t* t) {
+        while (t) {
+            uint8_t prio = inherited_priority(t);
+            if (prio == t->priority) return;
+            t->priority = prio;
+            requeue(t);
+
+            wait_queue_t* q = t->waiting_on;
+            if (!q) return;
+            toast::spin::lock(&q->lock);
+            if (t->waiting_on == q) {
+                wq_remove(q, t);
+                wq_insert(q, t);
+            }
+            toast::spin::unlock(&q->lock);
+            t = t->blocked_on ? t->blocked_on->owner_t : nullptr;
+        }
+    }
+
+    /* m->waiters.lock held */
+    void mutex_take(mutex_t* m, thread_t* t) {
+        m->locked = 1;
+        m->owner = t ? t->tid : 0;
+        m->owner_t = t;
+    }
+
+    /* Only mutexes with waiters go on the owner's held list, so the
+       uncontended paths never need pi_lock */
+    void hold(thread_t* t, mutex_t* m) {
+        if (!t) return;
+        m->next_held = t->held;
+        t->held = m;
+    }
+
+    void unhold(thread_t* t, mutex_t* m) {
+        if (t) {
+            mutex_t** pp = &t->held;
+            while (*pp && *pp != m)
+                pp = &(*pp)->next_held;
+            if (*pp) *pp = m->next_held;
+        }
+        m->next_held = nullptr;
+    }
+
+    /* Let go of a mutex the caller owns, handing it to the most urgent
+       waiter if any. Interrupts off, no lock held. */
+    void mutex_release(mutex_t* m) {
+        toast::spin::lock(&m->waiters.lock);
+        if (!m->waiters.head) {
+            m->locked = 0;
+            m->owner = 0;
+            m->owner_t = nullptr;
+            toast::spin::unlock(&m->waiters.lock);
+            return;
+        }
+        toast::spin::unlock(&m->waiters.lock);
+
+        /* Waiters only come and go under pi_lock too, so they are still
+           there once we have it */
+        toast::spin::lock(&pi_lock);
+        toast::spin::lock(&m->waiters.lock);
+        thread_t* t = m->owner_t;
+        unhold(t, m);
+        thread_t* next = wq_pop(&m->waiters);
+        next->blocked_on = nullptr;
+        mutex_take(m, next);
+        if (m->waiters.head) hold(next, m);
+        toast::spin::unlock(&m->waiters.lock);
+        reprioritize(next);
+        if (t) reprioritize(t);
+        toast::spin::unlock(&pi_lock);
+        make_ready(next);
+    }
+
+    /* Sleep timer callback, runs from the timer IRQ. The wheel lets go of
+       a timer before calling it, so by now the thread may have been woken
+       some other way and be waiting again: only a due deadline counts.
+       Whoever takes a timed waiter off its queue, or moves a sleeper out
+       of THREAD_SLEEPING, is the one who wakes it. */
+    void sleep_expired(void* arg) {
+        thread_t* t = static_cast<thread_t*>(arg);
+        uint32_t flags = irq_save();
+        bool wake = false;
+        if (wait_queue_t* q = t->waiting_on) {
+            toast::spin::lock(&q->lock);
+            if (t->waiting_on == q && t->timed_wait) {
+                if (!toast::time::reached(t->sleep_until)) {
+                    /* stale, or beyond the wheel's reach: wait for the real one */
+                    toast::time::timer::add_at(&t->sleep_timer, t->sleep_until);
+                } else {
+                    /* a timed wait ran out */
+                    wq_remove(q, t);
+                    t->timed_out = 1;
+                    wake = true;
+                }
+            }
+            toast::spin::unlock(&q->lock);
+        } else if (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) == THREAD_SLEEPING) {
+            if (!toast::time::reached(t->sleep_until)) {
+                toast::time::timer::add_at(&t->sleep_timer, t->sleep_until);
+            } else {
+                uint8_t sleeping = THREAD_SLEEPING;
+                wake = __atomic_compare_exchange_n(&t->state, &sleeping, THREAD_READY, false,
+                                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            }
+        }
+        if (wake) make_ready(t);
+        irq_restore(flags);
+    }
+
+    /* A reaped TCB if there is one, else a fresh slot. Dead stacks are
+       released with the lock dropped, since the TLB shootdown waits for
+       CPUs that may be spinning on it, and only once the dead thread has
+       switched away for good. */
+    thread_t* alloc_tcb() {
+        toast::thread::mutex::lock(&reap_lock);
+        uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+        thread_t* gone = dead;
+        dead = nullptr;
+        toast::spin::unlock_irqrestore(&table_lock, flags);
+
+        for (thread_t* t = gone; t; t = t->q_next) {
+            while (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+                __asm__ volatile("pause");
+            paging_release(t->stack_base, t->stack_base + t->stack_size);
+        }
+
+        flags = toast::spin::lock_irqsave(&table_lock);
+        while (gone) {
+            thread_t* t = gone;
+            gone = t->q_next;
+            index_remove(t->tid);
+            t->state = THREAD_UNUSED;
+            t->q_next = free_tcbs;
+            free_tcbs = t;
+        }
+        thread_t* t = free_tcbs;
+        if (t) free_tcbs = t->q_next;
+        toast::spin::unlock_irqrestore(&table_lock, flags);
+        toast::thread::mutex::unlock(&reap_lock);
+        if (t) return t;
+
+        t = static_cast<thread_t*>(toast::mem::alloc(sizeof(thread_t)));
+        if (!t) return nullptr;
+        memset(t, 0, sizeof(thread_t));
+        for (;;) {
+            flags = toast::spin::lock_irqsave(&table_lock);
+            if (slots_used < thread_cap) {
+                t->slot = slots_used;
+                threads[slots_used++] = t;
+                toast::spin::unlock_irqrestore(&table_lock, flags);
+                return t;
+            }
+            toast::spin::unlock_irqrestore(&table_lock, flags);
+            if (!grow_table()) {
+                toast::mem::free(t);
+                return nullptr;
+            }
+        }
+    }
+}
 
 static void thread_entry_wrapper(void (*entry)(void*), void* arg) {
+    /* First run: thread_switch_asm left us holding the run queue lock */
+    finish_switch();
+    toast::spin::unlock(&this_cpu()->lock);
+    __asm__ volatile("sti");
     entry(arg);
     toast::thread::exit(nullptr);
 }
 
+namespace {
+    /* A blank TCB on its own stack slot, not visible to the scheduler yet */
+    thread_t* new_thread(const char* name, uint32_t stack_size) {
+        thread_t* t = alloc_tcb();
+        if (!t) return nullptr;
+
+        uint32_t slot = t->slot;
+        memset(t, 0, sizeof(thread_t));
+        t->slot = slot;
+        t->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+        t->pid = 0;
+        t->state = THREAD_BLOCKED;      /* not runnable until its stack is built */
+        t->priority = t->base_priority = THREAD_PRIO_DEFAULT;
+        strncpy(t->name, name, 31);
+        t->stack_base = slot_top(slot) - stack_size;
+        t->stack_size = stack_size;
+        if (!map_stack(t)) {
+            uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+            t->state = THREAD_UNUSED;
+            t->q_next = free_tcbs;
+            free_tcbs = t;
+            toast::spin::unlock_irqrestore(&table_lock, flags);
+            return nullptr;
+        }
+        t->cpu = toast::smp::id();      /* only a hint, see make_ready */
+        toast::time::timer::setup(&t->sleep_timer, sleep_expired, t);
+        return t;
+    }
+
+    /* Stack as thread_switch_asm expects to find it, returning into
+       thread_entry_wrapper with interrupts off */
+    void build_frame(thread_t* t, void (*entry)(void*), void* arg) {
+        uint32_t* sp = (uint32_t*)(t->stack_base + t->stack_size);
+        *(--sp) = (uint32_t)arg;
+        *(--sp) = (uint32_t)entry;
+        *(--sp) = 0xDEADBEEF;
+        *(--sp) = (uint32_t)thread_entry_wrapper;
+        *(--sp) = 0x002; // eflags: IF clear until the lock is dropped
+        *(--sp) = 0; // ebp
+        *(--sp) = 0; // ebx
+        *(--sp) = 0; // esi
+        *(--sp) = 0; // edi
+        t->context.esp = (uint32_t)sp;
+    }
+
+    /* Runs whenever its CPU has nothing else to do, and first tries to
+       take work from a busier CPU. Interrupts are off from the check to
+       the hlt, so a wakeup IPI cannot slip in between. The tick stays off
+       while halted and is back before anything runs. */
+    void idle_main(void*) {
+        for (;;) {
+            __asm__ volatile("cli");
+            toast::time::tick_resume();
+            steal(this_cpu());
+            toast::thread::yield();
+            toast::time::tick_stop();
+            __asm__ volatile("sti; hlt" : : : "memory");
+        }
+    }
+
+    thread_t* new_idle(uint32_t cpu) {
+        char name[8] = "idle0";
+        name[4] = (char)('0' + cpu);
+        thread_t* t = new_thread(name, THREAD_STACK_SIZE);
+        if (!t) return nullptr;
+        t->state = THREAD_READY;
+        t->priority = t->base_priority = THREAD_PRIORITIES;     /* below everyone */
+        t->cpu = cpu;
+
+        uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+        index_insert(t);
+        cpus[cpu].idle = t;
+        toast::spin::unlock_irqrestore(&table_lock, flags);
+        return t;
+    }
+}
+
 namespace toast {
 namespace thread {
 
 void init() {
-    memset(threads, 0, sizeof(threads));
-    threads[0].tid = 0;
-    threads[0].pid = 0;
-    threads[0].state = THREAD_RUNNING;
-    threads[0].priority = 0;
-    strcpy(threads[0].name, "kernel_main");
-    current_tid = 0;
+    memset(cpus, 0, sizeof(cpus));
+    dead = free_tcbs = nullptr;
+    slots_used = 0;
+    if (!grow_table())
+        kprint("thread: no memory for the thread table");
+
+    /* Slot 0 is kernel_main on the boot stack */
+    thread_t* t = alloc_tcb();
+    t->tid = 0;
+    t->pid = 0;
+    t->state = THREAD_RUNNING;
+    t->on_cpu = 1;
+    t->priority = t->base_priority = THREAD_PRIO_DEFAULT;
+    strcpy(t->name, "kernel_main");
+    toast::time::timer::setup(&t->sleep_timer, sleep_expired, t);
+    index_insert(t);
+    cpus[0].cur = t;
+
+    thread_t* idle = new_idle(0);
+    if (idle)
+        build_frame(idle, idle_main, nullptr);
+    else
+        kprint("thread: no memory for the idle thread");
     scheduler_active = 1;
 }
 
-tid_t create(const char* name, void (*entry)(void*), void* arg) {
-    int slot = find_slot();
-    if (slot < 0) return (tid_t)-1;
+tid_t create(const char* name, void (*entry)(void*), void* arg, uint32_t stack_size) {
+    if (stack_size == 0) stack_size = THREAD_STACK_SIZE;
+    stack_size = (stack_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (stack_size > THREAD_STACK_MAX) return (tid_t)-1;
 
-    uint32_t stack_mem = (uint32_t)toast::mem::alloc(THREAD_STACK_SIZE);
-    if (!stack_mem) return (tid_t)-1;
+    thread_t* t = new_thread(name ? name : "thread", stack_size);
+    if (!t) return (tid_t)-1;
+    build_frame(t, entry, arg);
 
-    thread_t* t = &threads[slot];
-    memset(t, 0, sizeof(thread_t));
+    tid_t tid = t->tid;
+    uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+    index_insert(t);
+    toast::spin::unlock(&table_lock);
+    make_ready(t);
+    irq_restore(flags);
+    return tid;
+}
 
-    t->tid = next_tid++;
-    t->pid = 0;
-    t->state = THREAD_READY;
-    t->priority = 1;
-    strncpy(t->name, name ? name : "thread", 31);
-    t->stack_base = stack_mem;
-    t->stack_size = THREAD_STACK_SIZE;
-
-    uint32_t* sp = (uint32_t*)(stack_mem + THREAD_STACK_SIZE);
-    *(--sp) = (uint32_t)arg;
-    *(--sp) = (uint32_t)entry;
-    *(--sp) = 0xDEADBEEF;
-    *(--sp) = (uint32_t)thread_entry_wrapper;
-    *(--sp) = 0; // ebp
-    *(--sp) = 0; // ebx
-    *(--sp) = 0; // esi
-    *(--sp) = 0; // edi
-
-    t->context.esp = (uint32_t)sp;
-    return t->tid;
+uint32_t prepare_cpu(uint32_t cpu) {
+    if (cpu == 0 || cpu >= MAX_CPUS) return 0;
+    thread_t* t = new_idle(cpu);
+    if (!t) return 0;
+    return t->stack_base + t->stack_size;
+}
+
+void start_cpu() {
+    sched_cpu* c = this_cpu();
+    toast::spin::lock(&c->lock);
+    c->idle->state = THREAD_RUNNING;
+    c->idle->on_cpu = 1;
+    c->idle->last_run = toast::time::ms();
+    c->cur = c->idle;
+    toast::spin::unlock(&c->lock);
+
+    idle_main(nullptr);
+    for (;;) __asm__ volatile("hlt");
 }
 
 void yield() {
     if (!scheduler_active) return;
-    wake_sleepers();
+    uint32_t flags = irq_save();
+    switch_cpu();
+    irq_restore(flags);
+}
 
-    int cur_slot = -1;
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (threads[i].tid == current_tid && threads[i].state == THREAD_RUNNING) {
-            cur_slot = i;
-            break;
-        }
-    }
+void set_timeslice(uint32_t ticks) {
+    uint32_t flags = irq_save();
+    slice_ticks = ticks;
+    if (thread_t* t = this_cpu()->cur) t->slice_left = ticks;
+    irq_restore(flags);
+}
 
-    int next_slot = pick_next();
-    if (next_slot < 0 || next_slot == cur_slot) return;
+int set_priority(tid_t tid, uint8_t priority) {
+    if (priority >= THREAD_PRIORITIES) return -1;
+    uint32_t flags = toast::spin::lock_irqsave(&table_lock);
+    thread_t* t = find_thread(tid);
+    if (!t || t == cpus[t->cpu].idle) {
+        toast::spin::unlock_irqrestore(&table_lock, flags);
+        return -1;
+    }
+    toast::spin::lock(&pi_lock);
+    t->base_priority = priority;
+    reprioritize(t);
+    toast::spin::unlock(&pi_lock);
+    toast::spin::unlock(&table_lock);
+    resched_restore(flags);
+    return 0;
+}
 
-    if (cur_slot >= 0 && threads[cur_slot].state == THREAD_RUNNING)
-        threads[cur_slot].state = THREAD_READY;
+uint32_t timeslice() {
+    return slice_ticks;
+}
 
-    thread_t* old = (cur_slot >= 0) ? &threads[cur_slot] : nullptr;
-    thread_t* new_t = &threads[next_slot];
-    new_t->state = THREAD_RUNNING;
-    current_tid = new_t->tid;
+/* The count lives in the TCB, so only this thread ever changes it */
+void preempt_disable() {
+    if (thread_t* t = current())
+        t->preempt_count++;
+}
 
-    if (old) {
-        thread_switch_asm(&old->context.esp, new_t->context.esp);
-    }
+/* Take the switch that was held off, if any */
+void preempt_enable() {
+    thread_t* t = current();
+    if (!t || --t->preempt_count) return;
+    uint32_t flags = irq_save();
+    int resched = this_cpu()->need_resched;
+    irq_restore(flags);
+    if (resched && (flags & 0x200))
+        yield();
 }
 
 void exit(void* retval) {
-    thread_t* t = current();
-    if (t) {
-        t->exit_code = retval;
-        t->state = THREAD_DEAD;
-    }
-    yield();
+    irq_save();
+    thread_t* t = this_cpu()->cur;
+    t->exit_code = retval;
+    toast::spin::lock(&table_lock);
+    t->state = THREAD_DEAD;
+    t->q_next = dead;
+    dead = t;
+    toast::spin::unlock(&table_lock);
+    switch_cpu();
     for (;;) __asm__ volatile("hlt");
 }
 
 void sleep(uint32_t ms) {
-    thread_t* t = current();
-    if (!t) return;
-
-    uint32_t secs = (ms + 999) / 1000;
-    if (secs == 0) secs = 1;
+    if (!scheduler_active) return;
+    if (ms == 0) {
+        yield();
+        return;
+    }
 
-    t->sleep_until = get_uptime_seconds() + secs;
-    t->state = THREAD_SLEEPING;
-    yield();
+    uint32_t flags = irq_save();
+    thread_t* t = this_cpu()->cur;
+    /* +1: the current tick is already partly gone */
+    t->sleep_until = toast::time::ms() + ms + 1;
+    __atomic_store_n(&t->state, THREAD_SLEEPING, __ATOMIC_RELEASE);
+    toast::time::timer::add_at(&t->sleep_timer, t->sleep_until);
+    switch_cpu();
+    irq_restore(flags);
 }
 
 tid_t self() {
-    return current_tid;
+    thread_t* t = current();
+    return t ? t->tid : 0;
 }
 
 thread_t* current() {
-    return find_thread(current_tid);
+    uint32_t flags = irq_save();
+    thread_t* t = scheduler_active ? this_cpu()->cur : nullptr;
+    irq_restore(flags);
+    return t;
 }
 
 void schedule() {
-    if (!scheduler_active) return;
-    wake_sleepers();
+    assert(!current() || !current()->preempt_count);
     yield();
 }
 
 void block() {
-    thread_t* t = current();
-    if (t) {
-        t->state = THREAD_BLOCKED;
-        yield();
-    }
+    if (!scheduler_active) return;
+    uint32_t flags = irq_save();
+    thread_t* t = this_cpu()->cur;
+    t->state = THREAD_BLOCKED;
+    __atomic_store_n(&t->parked, 1, __ATOMIC_RELEASE);
+    switch_cpu();
+    irq_restore(flags);
 }
 
 void unblock(tid_t tid) {
+    uint32_t flags = toast::spin::lock_irqsave(&table_lock);
     thread_t* t = find_thread(tid);
-    if (t && t->state == THREAD_BLOCKED)
-        t->state = THREAD_READY;
+    uint8_t parked = 1;
+    /* Whoever clears parked does the wakeup */
+    bool wake = t && __atomic_compare_exchange_n(&t->parked, &parked, 0, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    toast::spin::unlock(&table_lock);
+    if (wake) make_ready(t);
+    resched_restore(flags);
 }
 
 pid_t pid() {
@@ -193,35 +891,280 @@ pid_t pid() {
     return t ? t->pid : 0;
 }
 
+uint32_t capacity() {
+    return slots_used;
+}
+
+void lock_table() {
+    mutex::lock(&reap_lock);
+}
+
+void unlock_table() {
+    mutex::unlock(&reap_lock);
+}
+
+thread_t* at(int slot) {
+    if (slot < 0 || (uint32_t)slot >= slots_used || threads[slot]->state == THREAD_UNUSED)
+        return nullptr;
+    return threads[slot];
+}
+
+uint32_t stack_high_water(const thread_t* t) {
+    if (!t || t->stack_size == 0) return 0;   /* boot stack is not tracked */
+
+    /* The stack starts out poisoned, so the lowest word that is not
+       marks the deepest point ever reached */
+    uint32_t top = t->stack_base + t->stack_size;
+    for (const uint32_t* p = (const uint32_t*)t->stack_base; (uint32_t)p < top; p++) {
+        if (*p != STACK_POISON) return top - (uint32_t)p;
+    }
+    return 0;
+}
+
+uint32_t idle_ticks() {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < toast::smp::count(); i++)
+        sum += cpus[i].idle_count;
+    return sum;
+}
+
+void charge_idle(uint32_t ticks) {
+    this_cpu()->idle_count += ticks;
+}
+
+thread_t* stack_overflowed(uint32_t addr) {
+    thread_t* t = slot_thread(addr);
+    if (!t || addr >= t->stack_base) return nullptr;
+    return t;
+}
+
 namespace mutex {
 
+void init(mutex_t* m) {
+    m->locked = 0;
+    m->owner = 0;
+    m->owner_t = nullptr;
+    m->waiters.head = m->waiters.tail = nullptr;
+    toast::spin::init(&m->waiters.lock);
+    m->next_held = nullptr;
+}
+
 void lock(mutex_t* m) {
-    while (__sync_lock_test_and_set(&m->locked, 1)) {
-        toast::thread::yield();
+    uint32_t flags = toast::spin::lock_irqsave(&m->waiters.lock);
+    thread_t* t = this_cpu()->cur;
+    if (!m->locked || !scheduler_active) {
+        mutex_take(m, t);
+        toast::spin::unlock_irqrestore(&m->waiters.lock, flags);
+        return;
+    }
+    toast::spin::unlock(&m->waiters.lock);
+
+    /* Contended: queue up, lend the owner our priority and sleep until
+       unlock hands the mutex over */
+    toast::spin::lock(&pi_lock);
+    toast::spin::lock(&m->waiters.lock);
+    if (!m->locked) {
+        /* let go while we were getting pi_lock */
+        mutex_take(m, t);
+        toast::spin::unlock(&m->waiters.lock);
+        toast::spin::unlock(&pi_lock);
+        irq_restore(flags);
+        return;
     }
-    m->owner = current_tid;
+    t->blocked_on = m;
+    if (!m->waiters.head) hold(m->owner_t, m);
+    wq_block(&m->waiters, t);
+    thread_t* owner = m->owner_t;
+    toast::spin::unlock(&m->waiters.lock);
+    reprioritize(owner);
+    toast::spin::unlock(&pi_lock);
+    switch_cpu();
+    irq_restore(flags);
 }
 
 void unlock(mutex_t* m) {
-    m->owner = 0;
-    __sync_lock_release(&m->locked);
+    uint32_t flags = irq_save();
+    /* Only the owner can change owner_t away from itself */
+    if (!m->locked || m->owner_t != this_cpu()->cur) {
+        irq_restore(flags);
+        return;
+    }
+    mutex_release(m);
+    resched_restore(flags);
 }
 
 int trylock(mutex_t* m) {
-    if (__sync_lock_test_and_set(&m->locked, 1) == 0) {
-        m->owner = current_tid;
+    uint32_t flags = toast::spin::lock_irqsave(&m->waiters.lock);
+    int ok = !m->locked;
+    if (ok) mutex_take(m, this_cpu()->cur);
+    toast::spin::unlock_irqrestore(&m->waiters.lock, flags);
+    return ok ? 0 : -1;
+}
+
+} // namespace mutex
+
+namespace sem {
+
+void init(semaphore_t* s, int32_t count) {
+    s->count = count;
+    s->waiters.head = s->waiters.tail = nullptr;
+    toast::spin::init(&s->waiters.lock);
+}
+
+void wait(semaphore_t* s) {
+    uint32_t flags = toast::spin::lock_irqsave(&s->waiters.lock);
+    if (s->count > 0 || !scheduler_active) {
+        s->count--;
+        toast::spin::unlock_irqrestore(&s->waiters.lock, flags);
+        return;
+    }
+    /* post() wakes us with the unit already ours */
+    wq_block(&s->waiters, this_cpu()->cur);
+    toast::spin::unlock(&s->waiters.lock);
+    switch_cpu();
+    irq_restore(flags);
+}
+
+int timedwait(semaphore_t* s, uint32_t ms) {
+    uint32_t flags = toast::spin::lock_irqsave(&s->waiters.lock);
+    if (s->count > 0 || !scheduler_active) {
+        s->count--;
+        toast::spin::unlock_irqrestore(&s->waiters.lock, flags);
         return 0;
     }
-    return -1;
+    if (ms == 0) {
+        toast::spin::unlock_irqrestore(&s->waiters.lock, flags);
+        return -1;
+    }
+    thread_t* t = this_cpu()->cur;
+    t->timed_out = 0;
+    t->timed_wait = 1;
+    t->sleep_until = toast::time::ms() + ms + 1;
+    wq_block(&s->waiters, t);
+    toast::spin::unlock(&s->waiters.lock);
+    toast::time::timer::add_at(&t->sleep_timer, t->sleep_until);
+    switch_cpu();
+    toast::time::timer::del(&t->sleep_timer);
+    t->timed_wait = 0;
+    int r = t->timed_out ? -1 : 0;
+    irq_restore(flags);
+    return r;
 }
 
-} // namespace mutex
+int trywait(semaphore_t* s) {
+    uint32_t flags = toast::spin::lock_irqsave(&s->waiters.lock);
+    int ok = s->count > 0;
+    if (ok) s->count--;
+    toast::spin::unlock_irqrestore(&s->waiters.lock, flags);
+    return ok ? 0 : -1;
+}
+
+void post(semaphore_t* s) {
+    uint32_t flags = toast::spin::lock_irqsave(&s->waiters.lock);
+    thread_t* t = wq_pop(&s->waiters);
+    if (!t) s->count++;
+    toast::spin::unlock(&s->waiters.lock);
+    if (t) make_ready(t);
+    resched_restore(flags);
+}
+
+} // namespace sem
+
+namespace cond {
+
+void init(condvar_t* c) {
+    c->waiters.head = c->waiters.tail = nullptr;
+    toast::spin::init(&c->waiters.lock);
+}
+
+void wait(condvar_t* c, mutex_t* m) {
+    uint32_t flags = irq_save();
+    thread_t* t = this_cpu()->cur;
+    if (m->owner_t != t) {
+        irq_restore(flags);
+        return;
+    }
+    /* Queue before letting go so a signal in between is not lost */
+    toast::spin::lock(&c->waiters.lock);
+    wq_block(&c->waiters, t);
+    toast::spin::unlock(&c->waiters.lock);
+    mutex_release(m);
+    switch_cpu();
+    irq_restore(flags);
+    mutex::lock(m);
+}
+
+void signal(condvar_t* c) {
+    uint32_t flags = toast::spin::lock_irqsave(&c->waiters.lock);
+    thread_t* t = wq_pop(&c->waiters);
+    toast::spin::unlock(&c->waiters.lock);
+    if (t) make_ready(t);
+    resched_restore(flags);
+}
+
+void broadcast(condvar_t* c) {
+    uint32_t flags = toast::spin::lock_irqsave(&c->waiters.lock);
+    /* Take them all at once, then wake them with the lock dropped */
+    thread_t* woken = nullptr;
+    thread_t** tail = &woken;
+    while (thread_t* t = wq_pop(&c->waiters)) {
+        *tail = t;
+        tail = &t->q_next;
+    }
+    toast::spin::unlock(&c->waiters.lock);
+    while (woken) {
+        thread_t* t = woken;
+        woken = t->q_next;
+        make_ready(t);
+    }
+    resched_restore(flags);
+}
+
+} // namespace cond
 } // namespace thread
 } // namespace toast
 
+/* Timer tail: IRQ0 on the BSP, the LAPIC timer elsewhere. Due sleepers
+   have been woken already. Charge the running thread a tick and switch
+   when a better thread woke up or the slice is used up. Interrupts are
+   off and the interrupt has had its EOI. */
+extern "C" void thread_preempt() {
+    if (!scheduler_active) return;
+    sched_cpu* c = this_cpu();
+    thread_t* t = c->cur;
+    if (!t) return;
+
+    /* Charge the tick to whoever it interrupted */
+    if (t == c->idle)
+        c->idle_count++;
+    else
+        t->run_ticks++;
+
+    if (t->preempt_count) return;
+    if (t->state != THREAD_RUNNING) return;
+    if (!c->need_resched) {
+        if (!slice_ticks) return;
+        if (t->slice_left > 1) {
+            t->slice_left--;
+            return;
+        }
+    }
+    toast::thread::yield();
+}
+
+/* Something more urgent than what we run was queued here, by another
+   CPU or by the IRQ handler we are returning from */
+extern "C" void thread_resched() {
+    if (!scheduler_active) return;
+    sched_cpu* c = this_cpu();
+    if (!c->cur || c->cur->preempt_count || c->cur->state != THREAD_RUNNING) return;
+    if (c->need_resched)
+        toast::thread::yield();
+}
+
 /* Legacy C aliases */
 void thread_init() { toast::thread::init(); }
-tid_t thread_create(const char* name, void (*entry)(void*), void* arg) { return toast::thread::create(name, entry, arg); }
+tid_t thread_create(const char* name, void (*entry)(void*), void* arg, uint32_t stack_size) { return toast::thread::create(name, entry, arg, stack_size); }
 void thread_yield() { toast::thread::yield(); }
 void thread_exit(void* retval) { toast::thread::exit(retval); }
 void thread_sleep(uint32_t ms) { toast::thread::sleep(ms); }
@@ -234,3 +1177,8 @@ pid_t getpid() { return toast::thread::pid(); }
 void mutex_lock(mutex_t* m) { toast::thread::mutex::lock(m); }
 void mutex_unlock(mutex_t* m) { toast::thread::mutex::unlock(m); }
 int mutex_trylock(mutex_t* m) { return toast::thread::mutex::trylock(m); }
+void sem_wait(semaphore_t* s) { toast::thread::sem::wait(s); }
+void sem_post(semaphore_t* s) { toast::thread::sem::post(s); }
+void cond_wait(condvar_t* c, mutex_t* m) { toast::thread::cond::wait(c, m); }
+void cond_signal(condvar_t* c) { toast::thread::cond::signal(c); }
+void cond_broadcast(condvar_t* c) { toast::thread::cond::broadcast(c); }
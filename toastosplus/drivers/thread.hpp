@@ -7,9 +7,32 @@
 #define THREAD_HPP
 
 #include "stdint.hpp"
+#include "time.hpp"
+#include "spinlock.hpp"
 
-#define MAX_THREADS     32
-#define THREAD_STACK_SIZE 4096
+#define THREAD_TABLE_INIT 32        /* thread table starts here and doubles */
+#define THREAD_TIMESLICE 10         /* default timeslice, in ms (timer ticks) */
+#define THREAD_STACK_SIZE 16384     /* default stack size */
+
+/* Priorities: 0 is the most urgent */
+#define THREAD_PRIORITIES   32
+#define THREAD_PRIO_HIGHEST 0
+#define THREAD_PRIO_DEFAULT 16
+#define THREAD_PRIO_LOWEST  (THREAD_PRIORITIES - 1)
+
+/*
+ * Thread stacks live in their own virtual region, one fixed slot per
+ * thread. A stack sits at the top of its slot and is backed in full when
+ * the thread is created; the rest of the slot stays unmapped, so an
+ * overflow hits a guard page instead of someone else's memory.
+ */
+#define THREAD_STACK_REGION     0xC0000000
+#define THREAD_STACK_REGION_END 0xD0000000  /* vmalloc area starts here */
+#define THREAD_STACK_SLOT   0x40000 /* 256KB per thread */
+#define THREAD_STACK_MAX    (THREAD_STACK_SLOT - 4096)
+
+/* One stack slot per thread bounds how far the thread table can grow */
+#define MAX_THREADS ((THREAD_STACK_REGION_END - THREAD_STACK_REGION) / THREAD_STACK_SLOT)
 
 /* Thread states */
 #define THREAD_UNUSED   0
@@ -31,33 +54,90 @@ struct cpu_context_t {
     uint32_t eflags;
 };
 
+struct thread_t;
+struct mutex_t;
+
+/* Threads blocked on something, most urgent first, FIFO within a priority */
+struct wait_queue_t {
+    thread_t  *head;
+    thread_t  *tail;
+    spinlock_t lock;                /* also guards the object it belongs to */
+};
+
+#define WAIT_QUEUE_INIT { nullptr, nullptr, SPINLOCK_INIT }
+
 /* Thread Control Block */
 struct thread_t {
     tid_t           tid;
     pid_t           pid;
     uint8_t         state;
-    uint8_t         priority;
+    uint8_t         priority;       /* effective, may be inherited */
+    uint8_t         base_priority;  /* as set by create/set_priority */
     char            name[32];
     cpu_context_t   context;
     uint32_t        stack_base;
     uint32_t        stack_size;
-    uint32_t        sleep_until;
+    uint32_t        sleep_until;    /* ms deadline while sleeping */
+    ktimer_t        sleep_timer;
+    uint32_t        slice_left;     /* ticks before IRQ0 preempts it */
     void           *exit_code;
+    uint32_t        slot;           /* table slot, picks the stack slot */
+    thread_t       *q_next;         /* run, dead or free list */
+    thread_t       *q_prev;         /* run or wait queue */
+    wait_queue_t   *waiting_on;     /* wait queue we are blocked in */
+    mutex_t        *blocked_on;     /* mutex we are waiting for */
+    mutex_t        *held;           /* owned mutexes that have waiters, for inheritance */
+    uint8_t         timed_out;      /* last timed wait gave up */
+    uint8_t         timed_wait;     /* blocked with sleep_timer armed */
+    uint8_t         cpu;            /* run queue it last ran or waits on */
+    uint8_t         rq_prio;        /* ready queue it sits in while on_rq */
+    uint8_t         on_rq;          /* queued on cpu's run queue */
+    volatile uint8_t on_cpu;        /* running, or not yet done switching away */
+    uint8_t         parked;         /* in block(), until unblock() */
+    volatile uint32_t preempt_count; /* preempt_disable() depth; travels with the thread */
+
+    /* CPU accounting, sampled by IRQ0 */
+    uint32_t        run_ticks;      /* ticks that found it on the CPU */
+    uint32_t        vol_switches;   /* left the CPU to block, sleep or exit */
+    uint32_t        invol_switches; /* left the CPU while still runnable */
+    uint32_t        last_run;       /* ms when it last got the CPU */
 };
 
-/* Mutex (simple spinlock) */
+/*
+ * Sleeping mutex. Waiters queue by priority and the owner runs at the
+ * priority of its most urgent waiter until it lets go; unlock hands the
+ * lock straight to that waiter.
+ */
 struct mutex_t {
     volatile uint32_t locked;
-    tid_t owner;
+    tid_t           owner;
+    thread_t       *owner_t;
+    wait_queue_t    waiters;
+    mutex_t        *next_held;      /* owner's held list */
+};
+
+#define MUTEX_INIT { 0, 0, nullptr, WAIT_QUEUE_INIT, nullptr }
+
+/* Counting semaphore; post() hands a unit straight to the first waiter */
+struct semaphore_t {
+    volatile int32_t count;
+    wait_queue_t     waiters;
+};
+
+#define SEMAPHORE_INIT(n) { (n), WAIT_QUEUE_INIT }
+
+/* Condition variable, always used with a mutex */
+struct condvar_t {
+    wait_queue_t waiters;
 };
 
-#define MUTEX_INIT { 0, 0 }
+#define CONDVAR_INIT { WAIT_QUEUE_INIT }
 
 namespace toast {
 namespace thread {
 
 void init();
-tid_t create(const char* name, void (*entry)(void*), void* arg);
+tid_t create(const char* name, void (*entry)(void*), void* arg, uint32_t stack_size = THREAD_STACK_SIZE);
 void yield();
 void exit(void* retval);
 void sleep(uint32_t ms);
@@ -68,18 +148,81 @@ void block();
 void unblock(tid_t tid);
 pid_t pid();
 
+/* 0 is the most urgent; returns -1 for a bad tid or priority */
+int set_priority(tid_t tid, uint8_t priority);
+
+/* Timeslice in timer ticks (ms); 0 turns preemption off */
+void set_timeslice(uint32_t ticks);
+uint32_t timeslice();
+
+/* Nestable and per CPU; the tick will not switch threads on this CPU
+   while the count is nonzero */
+/* Keep the timer and IPIs from switching the calling thread away. Nests.
+   The thread must not block or sleep until the count is back to 0. */
+void preempt_disable();
+void preempt_enable();
+
+/* Number of table slots handed out so far (bound for at()) */
+uint32_t capacity();
+
+/* Thread in a table slot, or nullptr if the slot is unused */
+thread_t* at(int slot);
+
+/* Keep exited threads' slots and stacks from being reclaimed while
+   walking the table with at(); other CPUs keep running */
+void lock_table();
+void unlock_table();
+
+/* Ticks that found no thread runnable, summed over all CPUs */
+uint32_t idle_ticks();
+
+/* Interrupts off: count ticks the idle thread ran without a tick coming,
+   while this CPU's tick was stopped */
+void charge_idle(uint32_t ticks);
+
+/* Build the idle thread for an AP before it is started; returns the top
+   of its stack, already backed, for the trampoline, or 0 */
+uint32_t prepare_cpu(uint32_t cpu);
+
+/* Run the calling AP as that idle thread; never returns */
+[[noreturn]] void start_cpu();
+
+/* Deepest stack use seen so far, in bytes; reads the stack, so hold
+   lock_table() unless t is the caller */
+uint32_t stack_high_water(const thread_t* t);
+
+/* Thread whose stack guard contains addr, or nullptr. An overflow ends
+   in #DF, which reports it from a task of its own (see smp.hpp). */
+thread_t* stack_overflowed(uint32_t addr);
+
 namespace mutex {
+    void init(mutex_t* m);
     void lock(mutex_t* m);
     void unlock(mutex_t* m);
     int trylock(mutex_t* m);
 }
 
+namespace sem {
+    void init(semaphore_t* s, int32_t count);
+    void wait(semaphore_t* s);
+    int timedwait(semaphore_t* s, uint32_t ms);  /* 0, or -1 after ms */
+    int trywait(semaphore_t* s);    /* 0 on success, -1 if it would block */
+    void post(semaphore_t* s);      /* safe from IRQ handlers */
+}
+
+namespace cond {
+    void init(condvar_t* c);
+    void wait(condvar_t* c, mutex_t* m);   /* m must be held; held again on return */
+    void signal(condvar_t* c);
+    void broadcast(condvar_t* c);
+}
+
 } // namespace thread
 } // namespace toast
 
 /* Legacy C-style function aliases */
 void thread_init();
-tid_t thread_create(const char* name, void (*entry)(void*), void* arg);
+tid_t thread_create(const char* name, void (*entry)(void*), void* arg, uint32_t stack_size = THREAD_STACK_SIZE);
 void thread_yield();
 void thread_exit(void* retval);
 void thread_sleep(uint32_t ms);
@@ -92,5 +235,18 @@ pid_t getpid();
 void mutex_lock(mutex_t* m);
 void mutex_unlock(mutex_t* m);
 int mutex_trylock(mutex_t* m);
+void sem_wait(semaphore_t* s);
+void sem_post(semaphore_t* s);
+void cond_wait(condvar_t* c, mutex_t* m);
+void cond_signal(condvar_t* c);
+void cond_broadcast(condvar_t* c);
+
+/* Called from irq0_handler after the clock has ticked, and from the
+   LAPIC timer on the other CPUs */
+extern "C" void thread_preempt();
+
+/* Called from the reschedule IPI, and at the end of the other hardware
+   IRQs after their EOI */
+extern "C" void thread_resched();
 
 #endif /* THREAD_HPP */
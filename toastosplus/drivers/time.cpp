@@ -4,10 +4,15 @@
 #include "stdint.hpp"
 #include "string.hpp"
 #include "panic.hpp"
+#include "funcs.hpp"
+#include "workqueue.hpp"
+#include "thread.hpp"
+#include "spinlock.hpp"
+#include "smp.hpp"
 
 #define ALL_MEMORY 0x100000 // Placeholder for now
 #define PIT_FREQ 1193180
-#define TARGET_HZ 18  // ~18 Hz = roughly every 55ms
+#define PIT_DIVISOR (PIT_FREQ / TIMER_HZ)
 
 extern char read_port(unsigned short port);
 extern void write_port(unsigned short port, unsigned char data);
@@ -93,11 +98,258 @@ int get_time_format(void) {
     return use_24hr;
 }
 
-void init_timer() {
-    uint16_t divisor = PIT_FREQ / TARGET_HZ;
+static volatile uint32_t ticks = 0;         /* ms, wraps after ~49 days */
+static volatile uint32_t uptime_secs = 0;   /* kept apart so it does not */
+static uint32_t second_ms = 0;
+
+/* ===== TIMER WHEEL ===== */
+
+static ktimer_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint32_t wheel_time = 0;     /* next tick the wheel will run */
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+static void wheel_link(ktimer_t **head, ktimer_t *t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void wheel_unlink(ktimer_t *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+/* File a timer under the lowest level whose span reaches its deadline */
+static void wheel_insert(ktimer_t *t) {
+    uint32_t delta = t->expires - wheel_time;
+    if ((int32_t)delta < 0) {
+        t->expires = wheel_time;
+        delta = 0;
+    } else if (delta > TIMER_MAX_DELAY) {
+        t->expires = wheel_time + TIMER_MAX_DELAY;
+        delta = TIMER_MAX_DELAY;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    uint32_t slot = (t->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    wheel_link(&wheel[level][slot], t);
+}
+
+/* Spread the current slot of a level over the levels below it;
+   returns the slot index so the caller knows whether to go up again */
+static uint32_t cascade(int level) {
+    uint32_t idx = (wheel_time >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    ktimer_t *t = wheel[level][idx];
+    wheel[level][idx] = 0;
+    while (t) {
+        ktimer_t *next = t->next;
+        wheel_insert(t);
+        t = next;
+    }
+    return idx;
+}
+
+/* Catch the wheel up with ticks. A callback may turn interrupts back on
+   (the alarm screen does), so the due list is detached before anything
+   runs and a nested IRQ0 simply carries on from the next tick. The
+   lock is dropped around each callback for the same reason, and so a
+   callback can re-arm its own timer. */
+static void run_timers(void) {
+    uint32_t flags = toast::spin::lock_irqsave(&timer_lock);
+    while ((int32_t)(ticks - wheel_time) >= 0) {
+        uint32_t slot = wheel_time & (TIMER_WHEEL_SLOTS - 1);
+        uint32_t idx = slot;
+        for (int level = 1; idx == 0 && level < TIMER_WHEEL_LEVELS; level++)
+            idx = cascade(level);
+
+        ktimer_t *due = wheel[0][slot];
+        wheel[0][slot] = 0;
+        if (due) due->pprev = &due;
+        wheel_time++;
+
+        while (due) {
+            ktimer_t *t = due;
+            wheel_unlink(t);
+            t->running++;
+            toast::spin::unlock_irqrestore(&timer_lock, flags);
+            t->fn(t->arg);
+            flags = toast::spin::lock_irqsave(&timer_lock);
+            t->running--;       /* last touch: del_sync() may free t now */
+        }
+    }
+    toast::spin::unlock_irqrestore(&timer_lock, flags);
+}
+
+/* Ticks from now until the wheel has work: the first level 0 slot with a
+   timer in it, or the next time level 0 wraps and the levels above
+   cascade into it, whichever comes first */
+static uint32_t next_timer_delay(void) {
+    uint32_t flags = toast::spin::lock_irqsave(&timer_lock);
+    uint32_t t = wheel_time;
+    while ((t & (TIMER_WHEEL_SLOTS - 1)) && !wheel[0][t & (TIMER_WHEEL_SLOTS - 1)])
+        t++;
+    toast::spin::unlock_irqrestore(&timer_lock, flags);
+    int32_t delay = (int32_t)(t - ticks);
+    return delay > 0 ? (uint32_t)delay : 0;
+}
+
+static void clock_advance(uint32_t n) {
+    ticks += n;
+    second_ms += n;
+    while (second_ms >= TIMER_HZ) {
+        second_ms -= TIMER_HZ;
+        uptime_secs++;
+    }
+}
+
+/* ===== CLOCK EVENTS ===== */
+
+struct tick_cpu {
+    clock_event_t *dev;
+    volatile uint32_t stopped;  /* a one-shot is armed instead of the tick */
+    uint32_t carry_us;          /* stopped time short of a whole ms, kept for next time */
+};
+static tick_cpu tick_cpus[MAX_CPUS];
+
+static uint32_t pit_armed = 0;  /* PIT counts of the current one-shot */
+
+static void pit_periodic(void) {
     write_port(0x43, 0x36);              // Channel 0, lo/hi byte, square wave
-    write_port(0x40, divisor & 0xFF);    // Low byte
-    write_port(0x40, (divisor >> 8) & 0xFF); // High byte
+    write_port(0x40, PIT_DIVISOR & 0xFF);    // Low byte
+    write_port(0x40, (PIT_DIVISOR >> 8) & 0xFF); // High byte
+}
+
+static void pit_oneshot(uint32_t ms) {
+    pit_armed = ms * PIT_DIVISOR;
+    write_port(0x43, 0x30);              // Channel 0, lo/hi byte, interrupt on terminal count
+    write_port(0x40, pit_armed & 0xFF);
+    write_port(0x40, (pit_armed >> 8) & 0xFF);
+}
+
+static uint32_t pit_elapsed_us(void) {
+    write_port(0x43, 0xC2);              // Read-back: status and count of channel 0
+    uint8_t status = (uint8_t)read_port(0x40);
+    uint32_t count = (uint8_t)read_port(0x40);
+    count |= (uint32_t)(uint8_t)read_port(0x40) << 8;
+    if (status & 0x80)                   // OUT is high: the count ran out
+        count = 0;
+    else if (status & 0x40)              // count not loaded yet
+        return 0;
+    return (pit_armed - count) * 1000 / PIT_DIVISOR;
+}
+
+/* 16-bit counter: about 54ms at most */
+static clock_event_t pit_clock = {
+    "pit", 0xFFFF / PIT_DIVISOR, pit_periodic, pit_oneshot, pit_elapsed_us
+};
+
+/* Back to periodic ticks; returns the whole ms the tick was stopped for.
+   The part of a ms left over is carried into the next stop rather than
+   dropped, or the clock would fall behind a little with every idle spell.
+   The BSP only stops while every other CPU has, so an AP that starts
+   again kicks it to get the clock going. */
+static uint32_t tick_restart(uint32_t cpu) {
+    tick_cpu *tc = &tick_cpus[cpu];
+    uint32_t us = tc->dev->elapsed_us() + tc->carry_us;
+    tc->dev->periodic();
+    uint32_t n = us / 1000;
+    tc->carry_us = us % 1000;
+    __atomic_store_n(&tc->stopped, 0, __ATOMIC_SEQ_CST);
+    if (cpu != 0 && __atomic_load_n(&tick_cpus[0].stopped, __ATOMIC_SEQ_CST))
+        toast::smp::send_resched(0);
+    return n;
+}
+
+/* ===== TSC CLOCK ===== */
+
+/* ns = cycles * tsc_mult >> tsc_shift, with tsc_mult as large as fits */
+static uint32_t tsc_rate_khz = 0;
+static uint32_t tsc_mult = 0;
+static uint32_t tsc_shift = 0;
+static uint64_t tsc_base = 0;
+
+/* 64 by 32 bit division without libgcc: the remainder of the high half
+   is below d, so the quotient of the second divl fits */
+static uint64_t div64(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t qhi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t qlo;
+    __asm__("divl %4" : "=a"(qlo), "=d"(r) : "a"((uint32_t)n), "d"(r), "rm"(d));
+    return ((uint64_t)qhi << 32) | qlo;
+}
+
+/* TSC cycles over 10ms of PIT channel 2, which only the speaker uses and
+   which counts without interrupts. Best of three, as an SMI or a VM exit
+   can only make a run longer. */
+static uint32_t tsc_calibrate(void) {
+    uint32_t count = PIT_FREQ / 100;
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < 3; run++) {
+        write_port(0x61, ((uint8_t)read_port(0x61) & ~0x02) | 0x01);  // gate on, speaker off
+        write_port(0x43, 0xB0);          // Channel 2, lo/hi byte, interrupt on terminal count
+        write_port(0x42, count & 0xFF);
+        write_port(0x42, (count >> 8) & 0xFF);
+        uint64_t start = toast::time::cycles();
+        uint32_t spins = 0;
+        while (!((uint8_t)read_port(0x61) & 0x20) && ++spins < 10000000)
+            ;
+        uint64_t taken = toast::time::cycles() - start;
+        if (spins < 10000000 && taken < best)
+            best = taken;
+    }
+    if (best == ~0ULL) return 0;
+    return (uint32_t)div64(best, 10);
+}
+
+static void tsc_init(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1U << 4)))
+        return;
+    tsc_rate_khz = tsc_calibrate();
+    if (!tsc_rate_khz) return;
+
+    uint64_t mult;
+    tsc_shift = 32;
+    while ((mult = div64(1000000ULL << tsc_shift, tsc_rate_khz)) > 0xFFFFFFFFULL)
+        tsc_shift--;
+    tsc_mult = (uint32_t)mult;
+    tsc_base = toast::time::cycles();
+}
+
+static ktimer_t second_timer;
+static work_t alarm_work;
+
+static void alarm_work_fn(void *arg) {
+    (void)arg;
+    alarm_check();
+}
+
+static void second_tick(void *arg) {
+    (void)arg;
+    toast::time::timer::add_at(&second_timer, second_timer.expires + TIMER_HZ);
+    update_top_bar();
+    /* An alarm blocks until dismissed, so it runs on a worker thread */
+    if (alarm_count() > 0)
+        toast::work::queue(&alarm_work);
+}
+
+void init_timer() {
+    tsc_init();
+    toast::time::clockevent_register(0, &pit_clock);
+
+    /* Top bar and alarms run off a once-a-second wheel timer */
+    toast::work::setup(&alarm_work, alarm_work_fn, 0);
+    toast::time::timer::setup(&second_timer, second_tick, 0);
+    toast::time::timer::add(&second_timer, TIMER_HZ);
 }
 
 static int bcd2bin(int num) { // Convert BCD to Binary
@@ -173,18 +425,17 @@ void write_time_string(int x, int y, uint8_t val) {
     write_string_at(x, y, buf, ((BLUE << 4) | WHITE));
 }
 
-static uint32_t ticks = 0;
-
 uint32_t get_uptime_seconds(void) {
-    return ticks / 18;
+    return uptime_secs;
+}
+
+uint32_t get_uptime_ms(void) {
+    return ticks;
 }
 
 void timer_handler() {
-    ticks++;
-    if (ticks % 18 == 0) { // Roughly every second (18.2 Hz is standard ticker)
-        update_top_bar();
-        alarm_check();
-    }
+    clock_advance(toast::time::tick_fired());
+    run_timers();
     // Don't auto-save registry from timer - only on explicit reg_save() calls
     // Send EOI to PIC (Master only since IRQ0)
     write_port(0x20, 0x20); 
@@ -317,9 +568,9 @@ const Alarm* alarm_get(int index) {
     return (const Alarm*)0;
 }
 
-/* Called from timer_handler every second. If an alarm matches the current
-   time (hour:minute, adjusted for timezone), take over the screen with a
-   flashing red alert and block until the user types "OK". */
+/* Queued on the kworker thread every second while alarms are set. If one
+   matches the current time (hour:minute, adjusted for timezone), take over
+   the screen with a flashing red alert and block until the user types "OK". */
 void alarm_check(void) {
     if (alarm_firing) return;
 
@@ -333,11 +584,10 @@ void alarm_check(void) {
         if ((uint8_t)adj_h == alarms[i].hour && t.minute == alarms[i].minute) {
             alarm_firing = 1;
 
-            /* --- save IRQ state and switch to polled keyboard --- */
+            /* --- switch to polled keyboard and keep the screen to ourselves --- */
             uint8_t saved_mask = read_port(0x21);
-            write_port(0x20, 0x20);
             write_port(0x21, saved_mask | 0x02);  /* mask IRQ1 */
-            __asm__ volatile("sti");
+            toast::thread::preempt_disable();
 
             volatile char *vid = (volatile char *)0xB8000;
             int ok_index = 0;
@@ -417,8 +667,9 @@ void alarm_check(void) {
                     }
                 }
 
-                /* ~1 second on, ~1 second off (18 ticks ≈ 1s) */
-                for (int w = 0; w < 18; w++) {
+                /* ~1 second on, ~1 second off */
+                uint32_t flip = toast::time::ms() + 1000;
+                while (!toast::time::reached(flip)) {
                     __asm__ volatile("hlt");
                     /* check keyboard each tick so dismiss feels responsive */
                     unsigned char ks = read_port(0x64);
@@ -448,6 +699,7 @@ void alarm_check(void) {
 
             /* Restore IRQ */
             write_port(0x21, saved_mask);
+            toast::thread::preempt_enable();
             alarm_firing = 0;
 
             /* Redraw screen - clear and let the top bar restore */
@@ -475,6 +727,126 @@ int get_timezone() { return ::get_timezone(); }
 void set_24hr(int is_24hr) { set_time_format(is_24hr); }
 int is_24hr() { return get_time_format(); }
 uint32_t uptime() { return get_uptime_seconds(); }
+uint32_t ms() { return ticks; }
+
+uint32_t tsc_khz() { return tsc_rate_khz; }
+
+uint64_t cycles_to_ns(uint64_t c) {
+    uint64_t lo = (uint64_t)(uint32_t)c * tsc_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(c >> 32) * tsc_mult;
+    return (lo >> tsc_shift) + (hi << (32 - tsc_shift));
+}
+
+uint64_t monotonic_ns() {
+    if (!tsc_mult)
+        return (uint64_t)ms() * 1000000;
+    return cycles_to_ns(cycles() - tsc_base);
+}
+
+void delay(uint32_t n) {
+    uint32_t deadline = ms() + n;
+    while (!reached(deadline))
+        __asm__ volatile("hlt");
+}
+
+void clockevent_register(uint32_t cpu, clock_event_t* dev) {
+    if (cpu >= MAX_CPUS) return;
+    tick_cpus[cpu].dev = dev;
+    tick_cpus[cpu].stopped = 0;
+    tick_cpus[cpu].carry_us = 0;
+    dev->periodic();
+}
+
+void tick_stop() {
+    uint32_t cpu = smp::id();
+    tick_cpu *tc = &tick_cpus[cpu];
+    if (!tc->dev || tc->stopped) return;
+
+    uint32_t sleep = tc->dev->max_ms;
+    if (cpu == 0) {
+        /* Claim the stop first so an AP starting up meanwhile sees it */
+        __atomic_store_n(&tc->stopped, 1, __ATOMIC_SEQ_CST);
+        for (uint32_t i = 1; i < smp::count(); i++) {
+            if (!__atomic_load_n(&tick_cpus[i].stopped, __ATOMIC_SEQ_CST)) {
+                tc->stopped = 0;
+                return;
+            }
+        }
+        uint32_t next = next_timer_delay();
+        if (next < sleep) sleep = next;
+        if (sleep < 2) {
+            tc->stopped = 0;    /* due next tick anyway */
+            return;
+        }
+    } else {
+        tc->stopped = 1;
+    }
+    tc->dev->oneshot(sleep);
+}
+
+void tick_resume() {
+    uint32_t cpu = smp::id();
+    if (!tick_cpus[cpu].stopped) return;
+    uint32_t n = tick_restart(cpu);
+    if (cpu == 0) clock_advance(n);
+    thread::charge_idle(n);
+}
+
+uint32_t tick_fired() {
+    uint32_t cpu = smp::id();
+    if (!tick_cpus[cpu].stopped) return 1;
+    uint32_t n = tick_restart(cpu);
+    if (n < 1) n = 1;
+    /* thread_preempt charges the tick that ended it */
+    thread::charge_idle(n - 1);
+    return n;
+}
+
+namespace timer {
+    void setup(ktimer_t* t, void (*fn)(void*), void* arg) {
+        t->expires = 0;
+        t->fn = fn;
+        t->arg = arg;
+        t->next = nullptr;
+        t->pprev = nullptr;
+        t->running = 0;
+    }
+
+    void add_at(ktimer_t* t, uint32_t expires) {
+        uint32_t flags = spin::lock_irqsave(&timer_lock);
+        if (t->pprev) wheel_unlink(t);
+        t->expires = expires;
+        wheel_insert(t);
+        spin::unlock_irqrestore(&timer_lock, flags);
+    }
+
+    void add(ktimer_t* t, uint32_t delay_ms) {
+        add_at(t, ms() + delay_ms);
+    }
+
+    int del(ktimer_t* t) {
+        uint32_t flags = spin::lock_irqsave(&timer_lock);
+        int was = t->pprev != nullptr;
+        if (was) wheel_unlink(t);
+        spin::unlock_irqrestore(&timer_lock, flags);
+        return was;
+    }
+
+    int del_sync(ktimer_t* t) {
+        int was = 0;
+        for (;;) {
+            uint32_t flags = spin::lock_irqsave(&timer_lock);
+            if (t->pprev) {
+                wheel_unlink(t);
+                was = 1;
+            }
+            bool busy = t->running != 0;
+            spin::unlock_irqrestore(&timer_lock, flags);
+            if (!busy) return was;
+            __asm__ volatile("pause");
+        }
+    }
+}
 
 namespace alarm {
     int set(uint8_t hour, uint8_t minute, const char* note) { return alarm_set(hour, minute, note); }
@@ -27,6 +27,43 @@ struct Alarm {
     char    note[ALARM_NOTE_LEN];
 };
 
+/* IRQ0 runs at TIMER_HZ, so one tick is one millisecond */
+#define TIMER_HZ 1000
+
+/*
+ * Timer wheel: four levels of 64 slots. Level 0 holds the next 64ms at
+ * 1ms granularity, each level above covers 64 times the span of the one
+ * below, and timers cascade down as their slot comes round. Anything due
+ * further out than TIMER_MAX_DELAY fires at that limit instead.
+ */
+#define TIMER_WHEEL_BITS  6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_MAX_DELAY   ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/* A kernel timer; fn(arg) runs from IRQ0 with interrupts off */
+struct ktimer_t {
+    uint32_t   expires;     /* tick it is due at */
+    void     (*fn)(void*);
+    void      *arg;
+    ktimer_t  *next;
+    ktimer_t **pprev;       /* link pointing at us, nullptr when idle */
+    volatile uint32_t running;  /* CPUs inside fn(arg) right now */
+};
+
+/*
+ * A CPU's tick source: the PIT on the BSP, the local APIC timer on the
+ * others. It ticks every millisecond while there is work; an idle CPU
+ * switches it to a single interrupt at the next timer due instead.
+ */
+struct clock_event_t {
+    const char *name;
+    uint32_t    max_ms;                 /* longest one-shot it can arm */
+    void      (*periodic)();            /* back to one interrupt per tick */
+    void      (*oneshot)(uint32_t ms);  /* one interrupt, ms from now */
+    uint32_t  (*elapsed_us)();          /* microseconds since oneshot() */
+};
+
 namespace toast {
 namespace time {
 
@@ -44,6 +81,65 @@ int is_24hr();
 /* Uptime */
 uint32_t uptime();
 
+/* Milliseconds since the timer started; wraps after ~49 days */
+uint32_t ms();
+
+/* True once ms() has reached deadline, safe across the wrap */
+inline bool reached(uint32_t deadline) { return (int32_t)(ms() - deadline) >= 0; }
+
+/* Wait at least n milliseconds; needs interrupts on */
+void delay(uint32_t n);
+
+/* CPU timestamp counter; every CPU we boot on has one */
+inline uint64_t cycles() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* TSC rate measured against the PIT at boot, 0 if there is no TSC */
+uint32_t tsc_khz();
+
+/* A cycles() difference in nanoseconds */
+uint64_t cycles_to_ns(uint64_t c);
+
+/* Nanoseconds since the TSC was calibrated; never goes backwards on one
+   CPU. Falls back to ms() resolution without a TSC. */
+uint64_t monotonic_ns();
+
+/* Time a stretch of code: two rdtsc and nothing else */
+struct stopwatch {
+    uint64_t start;
+    stopwatch() : start(cycles()) {}
+    uint64_t elapsed_cycles() const { return cycles() - start; }
+    uint64_t elapsed_ns() const { return cycles_to_ns(elapsed_cycles()); }
+};
+
+/* Make dev the tick source of a CPU and start it ticking */
+void clockevent_register(uint32_t cpu, clock_event_t* dev);
+
+/* Idle CPU, interrupts off: stop the tick until the next timer is due */
+void tick_stop();
+
+/* Interrupts off: tick again if tick_stop() stopped it. The BSP's clock
+   catches up with the time it was stopped. */
+void tick_resume();
+
+/* From the tick interrupt: how many ticks it stands for, which is more
+   than one when it ends a stopped period */
+uint32_t tick_fired();
+
+namespace timer {
+    void setup(ktimer_t* t, void (*fn)(void*), void* arg);
+    void add(ktimer_t* t, uint32_t delay_ms);   /* re-arms if pending */
+    void add_at(ktimer_t* t, uint32_t expires);
+    int del(ktimer_t* t);                       /* 1 if it was pending */
+    /* del(), then wait for fn(arg) to return on every CPU running it; so
+       t may be freed. Never from t's own fn or with interrupts off. */
+    int del_sync(ktimer_t* t);
+    inline bool pending(const ktimer_t* t) { return t->pprev != nullptr; }
+}
+
 /* Alarm system */
 namespace alarm {
     int set(uint8_t hour, uint8_t minute, const char* note);
@@ -68,6 +164,7 @@ extern "C" {
     void set_time_format(int is_24hr);
     int get_time_format();
     uint32_t get_uptime_seconds();
+    uint32_t get_uptime_ms();
     int alarm_set(uint8_t hour, uint8_t minute, const char* note);
     void alarm_clear(int index);
     void alarm_clear_all();
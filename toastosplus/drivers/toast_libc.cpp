@@ -6,6 +6,7 @@
 
 #include "toast_libc.hpp"
 #include "kio.hpp"
+#include "mmu.hpp"
 
 /* ===== ctype functions ===== */
 
@@ -262,90 +263,24 @@ char *strerror(int errnum) {
     }
 }
 
-/* ===== simple heap allocator ===== */
+/* ===== heap allocator ===== */
 
-#define HEAP_SIZE (2 * 1024 * 1024) /* 2 MB */
-
-/* Block header for tracking allocations */
-typedef struct block_header {
-    size_t size;              /* payload size */
-    int    used;              /* 1 = in use, 0 = free */
-    struct block_header *next;
-} block_header_t;
-
-static unsigned char heap[HEAP_SIZE] __attribute__((aligned(16)));
-static int heap_initialized = 0;
-static block_header_t *free_list = NULL;
-
-static void heap_init(void) {
-    free_list = (block_header_t *)heap;
-    free_list->size = HEAP_SIZE - sizeof(block_header_t);
-    free_list->used = 0;
-    free_list->next = NULL;
-    heap_initialized = 1;
-}
+/* malloc and friends share the kernel heap with kmalloc (see mmu.cpp) */
 
 void *malloc(size_t size) {
-    if (!heap_initialized) heap_init();
-    if (size == 0) return NULL;
-
-    /* align to 8 bytes */
-    size = (size + 7) & ~(size_t)7;
-
-    block_header_t *curr = free_list;
-    while (curr) {
-        if (!curr->used && curr->size >= size) {
-            /* split if there's room for another block */
-            if (curr->size >= size + sizeof(block_header_t) + 8) {
-                block_header_t *new_block =
-                    (block_header_t *)((unsigned char *)(curr + 1) + size);
-                new_block->size = curr->size - size - sizeof(block_header_t);
-                new_block->used = 0;
-                new_block->next = curr->next;
-                curr->size = size;
-                curr->next = new_block;
-            }
-            curr->used = 1;
-            return (void *)(curr + 1);
-        }
-        curr = curr->next;
-    }
-    return NULL; /* out of memory */
+    return toast::mem::alloc(size);
 }
 
 void free(void *ptr) {
-    if (!ptr) return;
-    block_header_t *blk = ((block_header_t *)ptr) - 1;
-    blk->used = 0;
-
-    /* coalesce adjacent free blocks */
-    block_header_t *curr = free_list;
-    while (curr) {
-        if (!curr->used && curr->next && !curr->next->used) {
-            curr->size += sizeof(block_header_t) + curr->next->size;
-            curr->next = curr->next->next;
-            continue; /* check again in case of triple-coalesce */
-        }
-        curr = curr->next;
-    }
+    toast::mem::free(ptr);
 }
 
 void *realloc(void *ptr, size_t size) {
-    if (!ptr) return malloc(size);
-    if (size == 0) { free(ptr); return NULL; }
-
-    block_header_t *blk = ((block_header_t *)ptr) - 1;
-    if (blk->size >= size) return ptr;
-
-    void *new_ptr = malloc(size);
-    if (new_ptr) {
-        memcpy(new_ptr, ptr, blk->size);
-        free(ptr);
-    }
-    return new_ptr;
+    return toast::mem::realloc(ptr, size);
 }
 
 void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > 0xFFFFFFFFu / size) return NULL;
     size_t total = nmemb * size;
     void *ptr = malloc(total);
     if (ptr) memset(ptr, 0, total);
@@ -292,10 +292,8 @@ int tscript_run(const char *src) {
             clear_screen();
         }
         else if (strcmp(cmd, "wait") == 0) {
-            /* Poll keyboard until any key is pressed */
-            while (!(read_port(0x64) & 0x01))
-                __asm__ volatile("hlt");
-            (void)read_port(0x60);   /* consume scancode */
+            /* Wait until any key is pressed */
+            while (kb_read_scancode() & 0x80) {}
         }
         else if (strcmp(cmd, "exit") == 0) {
             break;
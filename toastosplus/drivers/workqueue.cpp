@@ -0,0 +1,126 @@
+/*
+ * toastOS++ Work Queues
+ * Namespace: toast::work
+ */
+
+#include "workqueue.hpp"
+#include "mmu.hpp"
+#include "kio.hpp"
+#include "funcs.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    workqueue_t* system_wq = nullptr;
+    spinlock_t wq_lock = SPINLOCK_INIT;     /* every queue's list and queued flags */
+
+    void worker_main(void* arg) {
+        workqueue_t* wq = static_cast<workqueue_t*>(arg);
+        for (;;) {
+            toast::thread::sem::wait(&wq->pending);
+
+            uint32_t flags = toast::spin::lock_irqsave(&wq_lock);
+            work_t* w = wq->head;
+            if (!w) {               /* its unit outlived a cancel() */
+                toast::spin::unlock_irqrestore(&wq_lock, flags);
+                continue;
+            }
+            wq->head = w->next;
+            if (!wq->head) wq->tail = nullptr;
+            w->next = nullptr;
+            w->queued = 0;          /* may be queued again while it runs */
+            wq->current = w;
+            toast::spin::unlock_irqrestore(&wq_lock, flags);
+
+            w->fn(w->arg);
+
+            flags = toast::spin::lock_irqsave(&wq_lock);
+            wq->current = nullptr;
+            toast::spin::unlock_irqrestore(&wq_lock, flags);
+        }
+    }
+}
+
+namespace toast {
+namespace work {
+
+void init() {
+    if (!system_wq)
+        system_wq = create("kworker", WORK_PRIO_SYSTEM);
+    if (!system_wq)
+        kprint("work: could not start kworker");
+}
+
+workqueue_t* create(const char* name, uint8_t priority) {
+    workqueue_t* wq = static_cast<workqueue_t*>(toast::mem::alloc(sizeof(workqueue_t)));
+    if (!wq) return nullptr;
+    wq->name = name;
+    wq->head = wq->tail = nullptr;
+    wq->current = nullptr;
+    toast::thread::sem::init(&wq->pending, 0);
+
+    wq->worker = toast::thread::create(name, worker_main, wq);
+    if (wq->worker == (tid_t)-1) {
+        toast::mem::free(wq);
+        return nullptr;
+    }
+    toast::thread::set_priority(wq->worker, priority);
+    return wq;
+}
+
+void setup(work_t* w, void (*fn)(void*), void* arg) {
+    w->fn = fn;
+    w->arg = arg;
+    w->next = nullptr;
+    w->wq = nullptr;
+    w->queued = 0;
+}
+
+int queue_on(workqueue_t* wq, work_t* w) {
+    if (!wq) return 0;
+
+    uint32_t flags = spin::lock_irqsave(&wq_lock);
+    if (w->queued) {
+        spin::unlock_irqrestore(&wq_lock, flags);
+        return 0;
+    }
+    w->queued = 1;
+    w->next = nullptr;
+    w->wq = wq;
+    if (wq->tail) wq->tail->next = w;
+    else wq->head = w;
+    wq->tail = w;
+    spin::unlock_irqrestore(&wq_lock, flags);
+
+    toast::thread::sem::post(&wq->pending);
+    return 1;
+}
+
+int queue(work_t* w) {
+    return queue_on(system_wq, w);
+}
+
+void cancel(work_t* w) {
+    for (;;) {
+        uint32_t flags = spin::lock_irqsave(&wq_lock);
+        workqueue_t* wq = w->wq;
+        if (w->queued) {
+            /* The worker skips the semaphore unit this leaves behind */
+            work_t* prev = nullptr;
+            for (work_t* p = wq->head; p != w; p = p->next)
+                prev = p;
+            if (prev) prev->next = w->next;
+            else wq->head = w->next;
+            if (wq->tail == w) wq->tail = prev;
+            w->next = nullptr;
+            w->queued = 0;
+        }
+        bool busy = wq && wq->current == w && toast::thread::self() != wq->worker;
+        spin::unlock_irqrestore(&wq_lock, flags);
+        if (!busy) return;
+        /* Workers outrank ordinary threads, so this lets it finish */
+        toast::thread::yield();
+    }
+}
+
+} // namespace work
+} // namespace toast
@@ -0,0 +1,63 @@
+/*
+ * toastOS++ Work Queues
+ * Namespace: toast::work
+ */
+
+#ifndef WORKQUEUE_HPP
+#define WORKQUEUE_HPP
+
+#include "stdint.hpp"
+#include "thread.hpp"
+
+/*
+ * Deferred work. An IRQ handler does the bare minimum, queues a work
+ * item and returns; a worker thread later runs fn(arg) with interrupts
+ * on, where it may block, touch the disk or take as long as it likes.
+ */
+struct workqueue_t;
+
+struct work_t {
+    void           (*fn)(void*);
+    void            *arg;
+    work_t          *next;
+    workqueue_t     *wq;        /* queue it last went on */
+    volatile uint8_t queued;    /* already waiting, queueing again is a no-op */
+};
+
+/* A FIFO of work items drained by one worker thread */
+struct workqueue_t {
+    const char  *name;
+    work_t      *head;
+    work_t      *tail;
+    work_t      *current;       /* item the worker is running, if any */
+    semaphore_t  pending;       /* one unit per queued item, or cancelled one */
+    tid_t        worker;
+};
+
+/* The shared queue runs ahead of ordinary threads so bottom halves stay prompt */
+#define WORK_PRIO_SYSTEM 4
+
+namespace toast {
+namespace work {
+
+/* Start the shared "kworker" queue; needs the scheduler */
+void init();
+
+/* A private queue with its own worker, for work that runs long */
+workqueue_t* create(const char* name, uint8_t priority);
+
+void setup(work_t* w, void (*fn)(void*), void* arg);
+
+/* Safe from IRQ handlers. 1 if queued, 0 if it was already pending */
+int queue(work_t* w);
+int queue_on(workqueue_t* wq, work_t* w);
+
+/* Take w off its queue if it is waiting there, then wait for a run
+   already under way to return, unless the caller is that run. Once
+   nothing queues it again, w may be freed. */
+void cancel(work_t* w);
+
+} // namespace work
+} // namespace toast
+
+#endif /* WORKQUEUE_HPP */
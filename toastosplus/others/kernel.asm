@@ -13,11 +13,19 @@ section .text
 	global start
 	global keyboard_handler
     global irq0_handler
+    global irq_stub_table
 	global read_port
 	global write_port
 	global load_idt
 	global syscall_isr
 	global thread_switch_asm
+	global lapic_timer_isr
+	global resched_isr
+	global tlb_isr
+	global spurious_isr
+	global ap_trampoline
+	global ap_trampoline_end
+	global ap_params
 
 	; ISR stubs for CPU exceptions
 	global isr0
@@ -46,6 +54,13 @@ section .text
     extern timer_handler
 	extern isr_handler  ; Common C handler for exceptions
 	extern syscall_dispatch ; Syscall C handler
+	extern thread_preempt   ; Timeslice accounting, may switch threads
+    extern irq_dispatch     ; Handlers for PIC lines 2-15
+    extern lapic_timer_interrupt
+    extern resched_interrupt
+    extern thread_resched   ; Switch if an IRQ woke something more urgent
+    extern tlb_interrupt
+    extern ap_main          ; First C code on an application processor
 
 	read_port:
 		mov edx, [esp + 4]
@@ -66,16 +81,95 @@ section .text
 		sti 				;turn on interrupts
 		ret
 
+    ; The whole interrupted context stays on the thread's own stack, so
+    ; thread_preempt can switch away here and resume it much later.
+    ; GS is left alone: it selects the per-CPU block, and the thread may
+    ; be resumed on a different CPU.
     irq0_handler:
         pusha
-        call timer_handler
+        push ds
+        push es
+        push fs
+        mov ax, 0x10
+        mov ds, ax
+        mov es, ax
+        mov fs, ax
+        cld
+        call timer_handler      ; clock work + EOI
+        call thread_preempt
+        pop fs
+        pop es
+        pop ds
         popa
         iretd
 
+    ; IRQ1 now lands in the middle of running threads, so the C handler
+    ; must not clobber their registers. A keypress can wake a thread that
+    ; should run before the one interrupted, so it takes the same
+    ; switching tail as the timer.
 	keyboard_handler:
+		pusha
+		push ds
+		push es
+		push fs
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		cld
 		call    keyboard_handler_main
+		call    thread_resched
+		pop fs
+		pop es
+		pop ds
+		popa
 		iretd
 
+    ; PIC lines 2-15: irq_dispatch runs the driver's handler, sends EOI
+    ; and switches threads if the handler woke a more urgent one
+    %macro IRQ_STUB 1
+    irq%1_stub:
+        pusha
+        push ds
+        push es
+        push fs
+        mov ax, 0x10
+        mov ds, ax
+        mov es, ax
+        mov fs, ax
+        cld
+        push dword %1
+        call irq_dispatch
+        add esp, 4
+        pop fs
+        pop es
+        pop ds
+        popa
+        iretd
+    %endmacro
+
+    IRQ_STUB 2
+    IRQ_STUB 3
+    IRQ_STUB 4
+    IRQ_STUB 5
+    IRQ_STUB 6
+    IRQ_STUB 7
+    IRQ_STUB 8
+    IRQ_STUB 9
+    IRQ_STUB 10
+    IRQ_STUB 11
+    IRQ_STUB 12
+    IRQ_STUB 13
+    IRQ_STUB 14
+    IRQ_STUB 15
+
+    irq_stub_table:
+        dd 0, 0
+        dd irq2_stub, irq3_stub, irq4_stub, irq5_stub
+        dd irq6_stub, irq7_stub, irq8_stub, irq9_stub
+        dd irq10_stub, irq11_stub, irq12_stub, irq13_stub
+        dd irq14_stub, irq15_stub
+
 ; Common ISR stub - saves all registers and calls C handler
 isr_common_stub:
     pusha                ; Push all general-purpose registers
@@ -86,7 +180,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     push esp             ; Push pointer to stack (registers_t*)
     call isr_handler
@@ -96,7 +189,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     popa                 ; Restore all general-purpose registers
     add esp, 8           ; Clean up error code and ISR number
@@ -252,12 +344,16 @@ syscall_isr:
 
 ; ---- Thread context switch ----
 ; void thread_switch_asm(uint32_t *old_esp, uint32_t new_esp)
-; Saves callee-saved regs on old stack, switches to new stack, restores regs
+; Saves EFLAGS and callee-saved regs on old stack, switches to new stack,
+; restores regs. Runs with interrupts off; each thread gets its own IF
+; back, so it is safe to call from IRQ0 as well as from yield().
 thread_switch_asm:
     mov eax, [esp+4]     ; old_esp pointer
     mov edx, [esp+8]     ; new_esp value
 
-    ; Save callee-saved registers on current stack
+    ; Save flags (IF included), then callee-saved registers
+    pushfd
+    cli
     push ebp
     push ebx
     push esi
@@ -274,9 +370,90 @@ thread_switch_asm:
     pop esi
     pop ebx
     pop ebp
+    popfd
 
     ret                  ; returns to the EIP that was on the new stack
 
+; ---- Local APIC interrupts ----
+; Same frame as the PIC stubs; the C handlers send their own EOI
+%macro APIC_STUB 2
+%1:
+    pusha
+    push ds
+    push es
+    push fs
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    cld
+    call %2
+    pop fs
+    pop es
+    pop ds
+    popa
+    iretd
+%endmacro
+
+APIC_STUB lapic_timer_isr, lapic_timer_interrupt
+APIC_STUB resched_isr, resched_interrupt
+APIC_STUB tlb_isr, tlb_interrupt
+
+; Spurious vector: no EOI, nothing to do
+spurious_isr:
+    iretd
+
+; ---- AP trampoline ----
+; Copied to AP_TRAMPOLINE (0x8000) and entered there in real mode by the
+; startup IPI. The BSP fills ap_params in the copy before each start.
+%define TRAMP(x) ((x) - ap_trampoline + 0x8000)
+
+bits 16
+ap_trampoline:
+    cli
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [TRAMP(ap_gdtr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_pmode)
+
+bits 32
+ap_pmode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, [TRAMP(ap_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(ap_cr3)]
+    mov cr3, eax
+    mov eax, [TRAMP(ap_cr0)]
+    mov cr0, eax            ; paging on, same tables as the BSP
+    mov esp, [TRAMP(ap_stack)]
+    push dword [TRAMP(ap_cpu)]
+    mov eax, ap_main        ; absolute: this copy runs away from its link address
+    call eax
+.halt:
+    hlt
+    jmp .halt
+
+    align 4
+ap_params:                  ; layout matches ap_params_t in smp.cpp
+    dw 0
+ap_gdtr:
+    dw 0                    ; limit
+    dd 0                    ; base
+ap_cr3:   dd 0
+ap_cr4:   dd 0
+ap_cr0:   dd 0
+ap_stack: dd 0
+ap_cpu:   dd 0
+ap_trampoline_end:
+
 	start:
 		cli 				;block interrupts
 		mov esp, stack_space
@@ -21,6 +21,9 @@
 #include "drivers/user.hpp"
 #include "drivers/paging.hpp"
 #include "drivers/thread.hpp"
+#include "drivers/workqueue.hpp"
+#include "drivers/async.hpp"
+#include "drivers/smp.hpp"
 #include "drivers/syscall.hpp"
 #include "drivers/posix.hpp"
 
@@ -35,17 +38,30 @@ extern "C" {
 /* there are 25 lines each of 80 columns; each element takes 2 bytes */
 void kmain(unsigned long magic, unsigned long addr)
 {
+    /* Own GDT first: GS must select this CPU's block before any lock is taken */
+    toast::smp::init();
 
     int memory_info_available = 0;
 
     // Check for Multiboot magic number
     if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
-        unsigned int* mb_info = (unsigned int*)addr;
-        unsigned int flags = mb_info[0];
-        if (flags & MULTIBOOT_INFO_MEMORY) {
-            total_memory_kb = mb_info[1] + mb_info[2] + 1024;
+        multiboot_info_t* mb_info = (multiboot_info_t*)addr;
+        if (mb_info->flags & MULTIBOOT_INFO_MEMORY) {
+            total_memory_kb = mb_info->mem_lower + mb_info->mem_upper + 1024;
             memory_info_available = 1;
         }
+
+        /* Hand the usable entries of the memory map to the frame allocator */
+        if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+            uint32_t pos = mb_info->mmap_addr;
+            uint32_t end = mb_info->mmap_addr + mb_info->mmap_length;
+            while (pos < end) {
+                multiboot_memory_map_t* entry = (multiboot_memory_map_t*)pos;
+                if (entry->type == MULTIBOOT_MEMORY_AVAILABLE)
+                    paging_add_region(entry->addr, entry->len);
+                pos += entry->size + sizeof(entry->size);
+            }
+        }
     }
 
     if (memory_info_available && total_memory_kb < MIN_RAM_KB) {
@@ -59,11 +75,15 @@ void kmain(unsigned long magic, unsigned long addr)
 
 
 
-    mmu_init();
-
     /* Paging: identity-map first 8MB and enable virtual memory */
     paging_init(total_memory_kb > 0 ? total_memory_kb : 8192);
 
+    /* #DF gets a task of its own, now there are page tables to give it */
+    toast::smp::init_fault_task();
+
+    /* Heap maps its pages through paging, so it comes up second */
+    mmu_init();
+
     /* POSIX file descriptor table (stdin/stdout/stderr) */
     posix_init();
 
@@ -73,8 +93,17 @@ void kmain(unsigned long magic, unsigned long addr)
     /* Threading / scheduler */
     thread_init();
 
+    /* Bottom halves for IRQ handlers (the timer queues alarms here) */
+    toast::work::init();
+
+    /* Worker for drivers' async tasks */
+    toast::async::init();
+
 	init_timer();
 
+    /* Other CPUs calibrate their timers against the PIT, so this comes last */
+    toast::smp::start();
+
     {
         uint32_t start = get_uptime_seconds();
 
@@ -189,7 +218,9 @@ void kmain(unsigned long magic, unsigned long addr)
         __asm__ volatile ("cli; hlt");
     }
 
-	while(1);
+    /* The shell lives on its workqueue from here on; nothing left to do */
+    for (;;)
+        thread_block();
 }
 
 } // extern "C"
\ No newline at end of file